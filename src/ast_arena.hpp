@@ -0,0 +1,94 @@
+#pragma once
+
+#include "commons.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace CL {
+/*
+ * Owns every node of a parsed script.
+ * Nodes are bump allocated in large chunks and refer to their children
+ * with plain pointers; the chunks are released together when the last
+ * Script, function or compiled frame referring to the tree goes away.
+ * Only nodes owning heap memory of their own (names, child lists) have
+ * their destructor recorded and run.
+ */
+class AstArena {
+private:
+	static constexpr size_t CHUNK_SIZE = 32 * 1024;
+
+	struct Destructor {
+		void *object;
+		void (*destroy)(void *);
+	};
+
+	std::vector<std::unique_ptr<std::byte[]>> m_chunks;
+	size_t m_first_chunk_size{0};
+	std::byte *m_cursor{nullptr};
+	size_t m_remaining{0};
+	std::vector<Destructor> m_destructors;
+
+	void *allocate(size_t size, size_t alignment) {
+		auto padding = -reinterpret_cast<uintptr_t>(m_cursor) & (alignment - 1);
+		if(m_cursor == nullptr || padding + size > m_remaining) {
+			auto chunk_size = std::max(CHUNK_SIZE, size + alignment);
+			m_chunks.push_back(std::make_unique<std::byte[]>(chunk_size));
+			if(m_chunks.size() == 1) {
+				m_first_chunk_size = chunk_size;
+			}
+			m_cursor = m_chunks.back().get();
+			m_remaining = chunk_size;
+			padding = -reinterpret_cast<uintptr_t>(m_cursor) & (alignment - 1);
+		}
+		auto *memory = m_cursor + padding;
+		m_cursor += padding + size;
+		m_remaining -= padding + size;
+		return memory;
+	}
+
+	void destroy_nodes() {
+		for (auto it = m_destructors.rbegin(); it != m_destructors.rend(); it++) {
+			it->destroy(it->object);
+		}
+		m_destructors.clear();
+	}
+
+public:
+	AstArena() = default;
+	AstArena(const AstArena &) = delete;
+	AstArena &operator=(const AstArena &) = delete;
+	~AstArena() {
+		destroy_nodes();
+	}
+
+	// Destroys every node, keeping the first chunk for the next ones
+	void clear() {
+		destroy_nodes();
+		if(m_chunks.empty()) {
+			return;
+		}
+		m_chunks.resize(1);
+		m_cursor = m_chunks.front().get();
+		m_remaining = m_first_chunk_size;
+	}
+
+	template<class T, class... Args>
+	T *make(Args &&... args) {
+		auto *node = new(allocate(sizeof(T), alignof(T)))
+			T(std::forward<Args>(args)...);
+		if constexpr (!std::is_trivially_destructible_v<T>) {
+			m_destructors.push_back(Destructor{node, [](void *object) {
+				static_cast<T *>(object)->~T();
+			}});
+		}
+		return node;
+	}
+};
+}
@@ -2,9 +2,11 @@
 #include "commons.hpp"
 #include "environment.hpp"
 #include "exceptions.hpp"
+#include "memoized_function.hpp"
 #include "value.hpp"
 
 #include <algorithm>
+#include <cmath>
 #include <memory>
 
 namespace CL {
@@ -12,13 +14,13 @@ void ASTEvaluator::visit_number_expression(Number n) {
 	push(n);
 }
 
-void ASTEvaluator::visit_string_expression(String s) {
+void ASTEvaluator::visit_string_expression(const RuntimeValue &s) {
 	push(s);
 }
 
 void ASTEvaluator::visit_dict_expression(const std::vector<std::pair<ExprPtr,
 																	 ExprPtr>> &exprs) {
-	auto d = std::make_shared<Dictionary>();
+	auto d = make_ref<Dictionary>();
 	for (const auto &e : exprs) {
 		e.first->evaluate(*this);
 		e.second->evaluate(*this);
@@ -31,7 +33,7 @@ void ASTEvaluator::visit_dict_expression(const std::vector<std::pair<ExprPtr,
 }
 
 void ASTEvaluator::visit_list_expression(const ExprList &exprs) {
-	auto l = std::make_shared<List>();
+	auto l = make_ref<List>();
 	for (const auto &e : exprs) {
 		e->evaluate(*this);
 		l->append(pop());
@@ -61,42 +63,130 @@ void ASTEvaluator::visit_or_expression(const ExprPtr &left,
 	}
 }
 
+namespace {
+using FeedbackState = TypeFeedback::State;
+
+FeedbackState specialize(BinaryOp op,
+						 const RuntimeValue &left,
+						 const RuntimeValue &right) {
+	if(left.is<Number>() && right.is<Number>()) {
+		return FeedbackState::Numbers;
+	}
+	if(left.is<String>() && right.is<String>()) {
+		switch (op) {
+			case BinaryOp::Addition:
+			case BinaryOp::Less:
+			case BinaryOp::Less_Equals:
+			case BinaryOp::Greater:
+			case BinaryOp::Greater_Equals:
+			case BinaryOp::Equals:
+			case BinaryOp::Not_Equals: return FeedbackState::Strings;
+			default: break;
+		}
+	}
+	return FeedbackState::Generic;
+}
+
+RuntimeValue number_binary(BinaryOp op, Number l, Number r) {
+	switch (op) {
+		case BinaryOp::Addition: return l + r;
+		case BinaryOp::Subtraction: return l - r;
+		case BinaryOp::Multiplication: return l * r;
+		case BinaryOp::Division: return l / r;
+		case BinaryOp::Exponentiation: return pow(l, r);
+		case BinaryOp::Modulo: return fmod(l, r);
+		case BinaryOp::Less: return RuntimeValue(l < r);
+		case BinaryOp::Less_Equals: return RuntimeValue(l <= r);
+		case BinaryOp::Greater: return RuntimeValue(l > r);
+		case BinaryOp::Greater_Equals: return RuntimeValue(l >= r);
+		case BinaryOp::Equals: return RuntimeValue(l == r);
+		case BinaryOp::Not_Equals: return RuntimeValue(l != r);
+		case BinaryOp::And:
+		case BinaryOp::Or: break;
+	}
+	NOT_REACHED();
+}
+
+// Only called with the operators specialize() accepts for strings
+RuntimeValue string_binary(BinaryOp op, RuntimeValue &left, const RuntimeValue &right) {
+	if(op == BinaryOp::Addition) {
+		// Doesn't read the text, the operands may be ropes
+		return left + right;
+	}
+	auto l = left.as<String>();
+	auto r = right.as<String>();
+	switch (op) {
+		case BinaryOp::Less: return RuntimeValue(l < r);
+		case BinaryOp::Less_Equals: return RuntimeValue(l <= r);
+		case BinaryOp::Greater: return RuntimeValue(l > r);
+		case BinaryOp::Greater_Equals: return RuntimeValue(l >= r);
+		case BinaryOp::Equals: return RuntimeValue(l == r);
+		case BinaryOp::Not_Equals: return RuntimeValue(l != r);
+		default: break;
+	}
+	NOT_REACHED();
+}
+}
+
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "UnreachableCode"
 
 void ASTEvaluator::visit_binary_expression(const ExprPtr &left,
 										   BinaryOp op,
-										   const ExprPtr &right) {
+										   const ExprPtr &right,
+										   TypeFeedback &feedback) {
 	right->evaluate(*this);
 	left->evaluate(*this);
 	auto l_val = pop();
-	auto r_val = pop();
+	// The right operand is replaced in place by the result
+	auto &r_val = peek();
+
+	if(feedback.state == FeedbackState::Uninitialized) {
+		feedback.state = specialize(op, l_val, r_val);
+	}
+	switch (feedback.state) {
+		case FeedbackState::Numbers:
+			if(l_val.is<Number>() && r_val.is<Number>()) {
+				r_val = number_binary(op, l_val.as<Number>(), r_val.as<Number>());
+				return;
+			}
+			feedback.state = FeedbackState::Generic;
+			break;
+		case FeedbackState::Strings:
+			if(l_val.is<String>() && r_val.is<String>()) {
+				r_val = string_binary(op, l_val, r_val);
+				return;
+			}
+			feedback.state = FeedbackState::Generic;
+			break;
+		default: break;
+	}
 
 	switch (op) {
-		case BinaryOp::Addition:push(l_val + r_val);
+		case BinaryOp::Addition:r_val = l_val + r_val;
 			break;
-		case BinaryOp::Subtraction:push(l_val - r_val);
+		case BinaryOp::Subtraction:r_val = l_val - r_val;
 			break;
-		case BinaryOp::Multiplication:push(l_val * r_val);
+		case BinaryOp::Multiplication:r_val = l_val * r_val;
 			break;
-		case BinaryOp::Division:push(l_val / r_val);
+		case BinaryOp::Division:r_val = l_val / r_val;
 			break;
-		case BinaryOp::Exponentiation:push(l_val.to_power_of(r_val));
+		case BinaryOp::Exponentiation:r_val = l_val.to_power_of(r_val);
 			break;
-		case BinaryOp::Modulo:push(l_val.modulo(r_val));
+		case BinaryOp::Modulo:r_val = l_val.modulo(r_val);
 			break;
-		case BinaryOp::Less:push(RuntimeValue((bool) (l_val < r_val)));
+		case BinaryOp::Less:r_val = RuntimeValue((bool) (l_val < r_val));
 			break;
-		case BinaryOp::Less_Equals:push(RuntimeValue((bool) (l_val <= r_val)));
+		case BinaryOp::Less_Equals:r_val = RuntimeValue((bool) (l_val <= r_val));
 			break;
-		case BinaryOp::Greater:push(RuntimeValue((bool) (l_val > r_val)));
+		case BinaryOp::Greater:r_val = RuntimeValue((bool) (l_val > r_val));
 			break;
 		case BinaryOp::Greater_Equals:
-			push(RuntimeValue((bool) (l_val >= r_val)));
+			r_val = RuntimeValue((bool) (l_val >= r_val));
 			break;
-		case BinaryOp::Equals:push(RuntimeValue((bool) (l_val == r_val)));
+		case BinaryOp::Equals:r_val = RuntimeValue((bool) (l_val == r_val));
 			break;
-		case BinaryOp::Not_Equals:push(RuntimeValue((bool) (l_val != r_val)));
+		case BinaryOp::Not_Equals:r_val = RuntimeValue((bool) (l_val != r_val));
 			break;
 		case BinaryOp::And:
 		case BinaryOp::Or: NOT_REACHED()
@@ -108,30 +198,43 @@ void ASTEvaluator::visit_binary_expression(const ExprPtr &left,
 
 void ASTEvaluator::visit_unary_expression(UnaryOp op, const ExprPtr &expr) {
 	expr->evaluate(*this);
-	auto val = pop();
 
 	switch (op) {
-		case UnaryOp::Identity:push(val);
+		case UnaryOp::Identity:
 			break;
-		case UnaryOp::Negation:val.negate();
-			push(val);
+		case UnaryOp::Negation:peek().negate();
 			break;
 	}
 }
 
-void ASTEvaluator::visit_var_expression(const std::string &var) {
-	push(m_env->get(var));
+void ASTEvaluator::assign(const Symbol &name,
+						  const Slot &slot,
+						  RuntimeValue val) {
+	if(slot.is_local()) {
+		m_locals->at(slot.depth, slot.index) = std::move(val);
+	} else {
+		m_env->assign(name, std::move(val), false);
+	}
+}
+
+void ASTEvaluator::visit_var_expression(const Symbol &var, Slot &slot) {
+	if(slot.is_local()) {
+		push(m_locals->at(slot.depth, slot.index));
+	} else {
+		push(m_env->get(var));
+	}
 }
 
-void ASTEvaluator::visit_assign_expression(const std::string &name,
+void ASTEvaluator::visit_assign_expression(const Symbol &name,
+										   Slot &slot,
 										   const ExprPtr &value) {
 	value->evaluate(*this);
-	auto val = pop();
-	m_env->assign(name, val, false);
-	push(val);
+	assign(name, slot, peek());
 }
 
-void ASTEvaluator::visit_fun_call(const ExprPtr &fun, const ExprList &args) {
+void ASTEvaluator::visit_fun_call(const ExprPtr &fun,
+								  const ExprList &args,
+								  bool tail_call) {
 	fun->evaluate(*this);
 	auto call = pop();
 	if(call.is<CallablePtr>()) {
@@ -143,24 +246,56 @@ void ASTEvaluator::visit_fun_call(const ExprPtr &fun, const ExprList &args) {
 					+ " arguments, but it got " + std::to_string(args.size())
 					+ "!");
 		}
+		if(auto *function = dynamic_cast<ASTFunction *>(callable.get())) {
+			// Arguments go straight into the parameter slots
+			auto locals = function->make_call_locals();
+			for (size_t i = 0; i < args.size(); i++) {
+				args[i]->evaluate(*this);
+				(*locals)[i] = pop();
+			}
+			if(tail_call) {
+				m_tail_callee = std::move(callable);
+				m_tail_locals = std::move(locals);
+			} else {
+				run_function(*function, std::move(locals));
+			}
+			return;
+		}
 		Args evaluated_args;
+		evaluated_args.reserve(args.size());
 		for (const auto &arg : args) {
 			arg->evaluate(*this);
 			evaluated_args.push_back(pop());
 		}
 		auto result = callable->call(evaluated_args);
 		if(result.has_value()) {
-			push(result.value());
+			push(std::move(result.value()));
 		}
 	} else {
 		throw RuntimeException(call.to_string() + " is not callable.");
 	}
 }
 
-void ASTEvaluator::visit_fun_def_statement(const String& name, const Names &names, const StatementPtr &body) {
-	auto fun = std::make_shared<ASTFunction>(body, names, m_env);
-	auto val = RuntimeValue(fun);
-	m_env->bind(name, val);
+void ASTEvaluator::visit_fun_def_statement(const Symbol &name,
+										   Slot &slot,
+										   const Names &names,
+										   ScopeLayout &layout,
+										   const StatementPtr &body,
+										   bool memoized) {
+	auto fun = make_ref<ASTFunction>(body,
+											 m_arena,
+											 names,
+											 layout.size,
+											 m_env,
+											 m_locals);
+	auto val = memoized
+			   ? RuntimeValue(make_ref<MemoizedFunction>(fun))
+			   : RuntimeValue(fun);
+	if(slot.is_local()) {
+		m_locals->at(slot.depth, slot.index) = val;
+	} else {
+		m_env->bind(name, val);
+	}
 }
 
 void ASTEvaluator::visit_return_expression(const ExprPtr &expr) {
@@ -187,7 +322,7 @@ void ASTEvaluator::visit_set_expression(const ExprPtr &obj,
 	auto &m_obj = peek();
 
 	m_obj.set_property(m_name, m_val);
-	push(m_val);
+	m_obj = std::move(m_val);
 }
 
 void ASTEvaluator::visit_get_expression(const ExprPtr &obj,
@@ -195,8 +330,8 @@ void ASTEvaluator::visit_get_expression(const ExprPtr &obj,
 	obj->evaluate(*this);
 	name->evaluate(*this);
 	auto m_name = pop();
-	auto m_obj = pop();
-	push(m_obj.get_property(m_name));
+	auto &m_obj = peek();
+	m_obj = m_obj.get_property(m_name);
 }
 
 void ASTEvaluator::visit_if_statement(const ExprPtr &cond,
@@ -214,15 +349,18 @@ void ASTEvaluator::visit_while_statement(const ExprPtr &cond,
                                          const StatementPtr &body) {
 	cond->evaluate(*this);
 	while (pop().is_truthy()) {
+		Collector::instance().safe_point();
 		if(!is_flag_set(FLAGS::CONTINUE))
 			body->execute(*this);
-		if(is_flag_set(FLAGS::RETURN) || is_flag_set(FLAGS::BREAK))
+		// A return keeps its flag, to unwind the enclosing blocks as well
+		if(m_flags == FLAGS::RETURN || is_flag_set(FLAGS::BREAK))
 			break;
 		cond->evaluate(*this);
 	}
 }
 
-void ASTEvaluator::visit_for_statement(const std::string &name,
+void ASTEvaluator::visit_for_statement(const Symbol &name,
+                                       Slot &slot,
                                        const ExprPtr &iterable,
                                        const StatementPtr &body) {
 	iterable->evaluate(*this);
@@ -231,44 +369,120 @@ void ASTEvaluator::visit_for_statement(const std::string &name,
 	auto has_next_fun = iterable_val.get_named("__has_next").as<CallablePtr>();
 	auto next_fun = iterable_val.get_named("__next").as<CallablePtr>();
 	while (has_next_fun->call().value().is_truthy()) {
-		auto val = next_fun->call().value();
-		m_env->assign(name, val, false);
+		Collector::instance().safe_point();
+		assign(name, slot, next_fun->call().value());
 		if(!is_flag_set(FLAGS::CONTINUE))
 			body->execute(*this);
-		if(is_flag_set(FLAGS::RETURN) || is_flag_set(FLAGS::BREAK))
+		// A return keeps its flag, to unwind the enclosing blocks as well
+		if(m_flags == FLAGS::RETURN || is_flag_set(FLAGS::BREAK))
 			break;
 	}
 }
 
-void ASTEvaluator::visit_block_statement(const StatementList &block) {
-	auto env = std::make_shared<StackedEnvironment>(m_env);
-	auto old_env = m_env;
-	m_env = env;
+void ASTEvaluator::visit_expression_statement(const ExprPtr &expr) {
+	auto size = m_stack.size();
+	expr->evaluate(*this);
+	// Replaces the value of the previous statement, which nothing can use now
+	if(m_stack.size() > size && size > m_statement_base) {
+		m_stack[m_statement_base] = std::move(m_stack.back());
+		m_stack.resize(m_statement_base + 1);
+	}
+}
+
+void ASTEvaluator::visit_block_statement(const StatementList &block,
+										 ScopeLayout &layout) {
+	auto old_locals = m_locals;
+	if(layout.size > 0) {
+		m_locals = make_ref<SlotEnvironment>(layout.size, m_locals);
+	}
 	for (const auto &expr : block) {
 		expr->execute(*this);
 		if(is_any_flag_set())
 			break;
 	}
-	m_env = old_env;
+	m_locals = old_locals;
 }
 
 void ASTEvaluator::visit_module_definition(const ExprList &list) {
-	auto env = std::make_shared<StackedEnvironment>(m_env);
-	auto evaluator = ASTEvaluator(env);
+	auto env = make_ref<StackedEnvironment>(m_env);
+	auto evaluator = ASTEvaluator(env, m_arena, m_locals);
 	for (auto &expr : list) {
 		expr->evaluate(evaluator);
 	}
-	auto mod = std::make_shared<Module>(env);
-	push(std::dynamic_pointer_cast<Indexable>(mod));
+	auto mod = make_ref<Module>(env);
+	push(IndexablePtr(mod));
+}
+
+void ASTEvaluator::run_function(const ASTFunction &function,
+								SlotEnvPtr locals) {
+	CallDepthGuard guard;
+	Collector::instance().safe_point();
+	auto env = std::move(m_env);
+	auto arena = std::move(m_arena);
+	auto outer_locals = std::move(m_locals);
+	auto base = m_stack.size();
+	auto statement_base = std::exchange(m_statement_base, base);
+	m_env = function.definition_env();
+	m_arena = function.arena();
+	m_locals = std::move(locals);
+
+	// Keeps the function run by the last tail call alive
+	CallablePtr callee;
+	const auto *current = &function;
+	try {
+		while (true) {
+			current->body()->execute(*this);
+			if(!m_tail_callee) {
+				break;
+			}
+			callee = std::move(m_tail_callee);
+			current = static_cast<const ASTFunction *>(callee.get());
+			m_stack.erase(m_stack.begin() + base, m_stack.end());
+			m_flags = FLAGS::NONE;
+			m_env = current->definition_env();
+			m_arena = current->arena();
+			m_locals = std::move(m_tail_locals);
+		}
+	} catch (...) {
+		m_stack.erase(m_stack.begin() + base, m_stack.end());
+		m_flags = FLAGS::NONE;
+		m_tail_callee.reset();
+		m_tail_locals.reset();
+		m_statement_base = statement_base;
+		m_env = std::move(env);
+		m_arena = std::move(arena);
+		m_locals = std::move(outer_locals);
+		throw;
+	}
+	if(m_stack.size() > base + 1) {
+		m_stack[base] = std::move(m_stack.back());
+		m_stack.erase(m_stack.begin() + base + 1, m_stack.end());
+	}
+	m_flags = FLAGS::NONE;
+	m_statement_base = statement_base;
+	m_env = std::move(env);
+	m_arena = std::move(arena);
+	m_locals = std::move(outer_locals);
+}
+
+std::optional<RuntimeValue> ASTEvaluator::call_function(const ASTFunction &function,
+														SlotEnvPtr locals) {
+	auto base = m_stack.size();
+	run_function(function, std::move(locals));
+	if(m_stack.size() > base) {
+		return pop();
+	}
+	return std::nullopt;
 }
 
 std::optional<RuntimeValue> ASTFunction::call(const Args &args) {
-	auto env = std::make_shared<StackedEnvironment>(m_definition_env);
+	// Calls from native code share one evaluator per thread, it only holds
+	// the environments of the calls in progress
+	static thread_local ASTEvaluator evaluator(nullptr, nullptr);
+	auto locals = make_call_locals();
 	for (size_t i = 0; i < args.size(); i++) {
-		env->assign(m_arg_names[i], args[i], false);
+		(*locals)[i] = args[i];
 	}
-	ASTEvaluator evaluator(env);
-	m_body->execute(evaluator);
-	return evaluator.get_result();
+	return evaluator.call_function(*this, std::move(locals));
 }
 }
@@ -10,6 +10,8 @@
 #include "value.hpp"
 
 namespace CL {
+class ASTFunction;
+
 class ASTEvaluator : public StackMachine<RuntimeValue>, public Evaluator {
 private:
 	enum class FLAGS {
@@ -19,8 +21,17 @@ private:
 		BREAK = 0x04,
 
 	};
-	std::shared_ptr<StackedEnvironment> m_env;
+	RuntimeEnvPtr m_env;
+	AstArenaPtr m_arena;
+	SlotEnvPtr m_locals;
 	FLAGS m_flags = FLAGS::NONE;
+	// A call in tail position, run by run_function in place of the
+	// function body it returns from
+	CallablePtr m_tail_callee;
+	SlotEnvPtr m_tail_locals;
+	// Where the function or script being run keeps the value of its last
+	// expression statement, which is its result
+	size_t m_statement_base{0};
 
 	bool is_flag_set(FLAGS flag) {
 		if(m_flags == flag) {
@@ -35,8 +46,10 @@ private:
 		m_flags = flag;
 	}
 
+	void assign(const Symbol &name, const Slot &slot, RuntimeValue val);
+
 	void visit_number_expression(Number n) override;
-	void visit_string_expression(String s) override;
+	void visit_string_expression(const RuntimeValue &s) override;
 	void visit_dict_expression(const std::vector<std::pair<ExprPtr,
 														   ExprPtr>> &) override;
 	void visit_list_expression(const ExprList &) override;
@@ -47,16 +60,27 @@ private:
 							 const ExprPtr &right) override;
 	void visit_binary_expression(const ExprPtr &left,
 								 BinaryOp op,
-								 const ExprPtr &right) override;
+								 const ExprPtr &right,
+								 TypeFeedback &feedback) override;
 
 	void visit_unary_expression(UnaryOp op, const ExprPtr &expr) override;
 
-	void visit_var_expression(const std::string &var) override;
-	void visit_assign_expression(const std::string &name,
+	void visit_var_expression(const Symbol &var, Slot &slot) override;
+	void visit_assign_expression(const Symbol &name,
+								 Slot &slot,
 								 const ExprPtr &value) override;
-	void visit_fun_call(const ExprPtr &fun, const ExprList &args) override;
-	void visit_fun_def_statement(const String& name, const Names &names, const StatementPtr &body) override;
-	void visit_block_statement(const StatementList &block) override;
+	void visit_fun_call(const ExprPtr &fun,
+						const ExprList &args,
+						bool tail_call) override;
+	void visit_fun_def_statement(const Symbol &name,
+								 Slot &slot,
+								 const Names &names,
+								 ScopeLayout &layout,
+								 const StatementPtr &body,
+								 bool memoized) override;
+	void visit_expression_statement(const ExprPtr &expr) override;
+	void visit_block_statement(const StatementList &block,
+							   ScopeLayout &layout) override;
 	void visit_return_expression(const ExprPtr &expr) override;
 	void visit_break_expression() override;
 	void visit_continue_expression() override;
@@ -66,7 +90,8 @@ private:
 	override;
 	void visit_while_statement(const ExprPtr &cond,
                                const StatementPtr &body) override;
-	void visit_for_statement(const std::string &name,
+	void visit_for_statement(const Symbol &name,
+                             Slot &slot,
                              const ExprPtr &iterable,
                              const StatementPtr &body) override;
 	void visit_set_expression(const ExprPtr &obj,
@@ -76,8 +101,14 @@ private:
 	void visit_module_definition(const ExprList &list) override;
 
 public:
-	explicit ASTEvaluator(std::shared_ptr<StackedEnvironment> env)
-		: m_env(std::move(env)) {
+	ASTEvaluator(RuntimeEnvPtr env,
+				 AstArenaPtr arena,
+				 SlotEnvPtr locals = nullptr,
+				 size_t stack_capacity = DEFAULT_STACK_CAPACITY)
+		: StackMachine(stack_capacity),
+		  m_env(std::move(env)),
+		  m_arena(std::move(arena)),
+		  m_locals(std::move(locals)) {
 	}
 
 	std::optional<RuntimeValue> get_result() {
@@ -85,21 +116,64 @@ public:
 			return pop();
 		return std::nullopt;
 	}
+
+	/*
+	 * Runs a function body on this evaluator, switching to the function's
+	 * environments for the duration of the call. Like a fresh evaluator,
+	 * the call results in the value left on top of its part of the stack,
+	 * which is left there for the caller.
+	 * Tail calls to other ASTFunctions reuse the frame of the call.
+	 */
+	void run_function(const ASTFunction &function, SlotEnvPtr locals);
+	std::optional<RuntimeValue> call_function(const ASTFunction &function,
+											  SlotEnvPtr locals);
 };
 class ASTFunction : public Callable {
 private:
 	StatementPtr m_body;
-	std::shared_ptr<StackedEnvironment> m_definition_env;
+	AstArenaPtr m_arena;
+	RuntimeEnvPtr m_definition_env;
+	SlotEnvPtr m_definition_locals;
 	Names m_arg_names;
+	uint32_t m_scope_size;
 
 public:
 	ASTFunction(StatementPtr body,
+				AstArenaPtr arena,
 				Names names,
-				std::shared_ptr<StackedEnvironment> definition_env)
-		: m_body(std::move(body)),
+				uint32_t scope_size,
+				RuntimeEnvPtr definition_env,
+				SlotEnvPtr definition_locals)
+		: m_body(body),
+		  m_arena(std::move(arena)),
+		  m_definition_env(std::move(definition_env)),
+		  m_definition_locals(std::move(definition_locals)),
 		  m_arg_names(std::move(names)),
-		  m_definition_env(std::move(definition_env)) {
+		  m_scope_size(scope_size) {
+	}
+	[[nodiscard]]
+	StatementPtr body() const noexcept { return m_body; }
+	[[nodiscard]]
+	const AstArenaPtr &arena() const noexcept { return m_arena; }
+	[[nodiscard]]
+	const RuntimeEnvPtr &definition_env() const noexcept {
+		return m_definition_env;
 	}
+	[[nodiscard]]
+	SlotEnvPtr make_call_locals() const {
+		return make_ref<SlotEnvironment>(m_scope_size,
+												 m_definition_locals);
+	}
+
+	void visit_references(GcVisitor &visitor) const override {
+		visitor.visit(m_definition_env);
+		visitor.visit(m_definition_locals);
+	}
+	void clear_references() override {
+		m_definition_env.reset();
+		m_definition_locals.reset();
+	}
+
 	std::optional<RuntimeValue> call(const Args &args) override;
 	uint8_t arity() override { return m_arg_names.size(); }
 	[[nodiscard]]
@@ -1,6 +1,26 @@
 #include "commons.hpp"
 
+#include <charconv>
+#include <cmath>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
 namespace CL {
+size_t native_stack_size() noexcept {
+#if defined(__unix__) || defined(__APPLE__)
+	rlimit limit{};
+	if(getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+		return static_cast<size_t>(limit.rlim_cur);
+	}
+	return size_t{8} << 20;
+#else
+	// The default of MSVC and MinGW executables
+	return size_t{1} << 20;
+#endif
+}
+
 std::string binary_op_to_string(BinaryOp op) noexcept {
 	switch (op) {
 		case BinaryOp::Addition: return "+";
@@ -28,4 +48,22 @@ std::string unary_op_to_string(UnaryOp op) noexcept {
 	return "Unrecognized";
 }
 
+char *format_number(Number n, char *buffer) noexcept {
+	constexpr Number MAX_EXACT_INTEGER = 9007199254740992.0;
+	auto *end = buffer + NUMBER_BUFFER_SIZE;
+	if(n == 0 && std::signbit(n)) {
+		buffer[0] = '-';
+		buffer[1] = '0';
+		return buffer + 2;
+	}
+	if(std::trunc(n) == n && std::fabs(n) < MAX_EXACT_INTEGER) {
+		return std::to_chars(buffer, end, static_cast<int64_t>(n)).ptr;
+	}
+	return std::to_chars(buffer, end, n).ptr;
+}
+
+std::string number_to_string(Number n) {
+	char buffer[NUMBER_BUFFER_SIZE];
+	return {buffer, format_number(n, buffer)};
+}
 }
@@ -4,10 +4,14 @@
 #include <iostream>
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "ref.hpp"
+#include "symbol.hpp"
+
 #define TODO()                                                                 \
     {                                                                          \
     std::cerr << "TODO Reached on file " << std::string(__FILE__) << "\n"; \
@@ -19,6 +23,12 @@
 #define NOT_REACHED() TODO()
 
 namespace CL {
+// Nested calls of script functions allowed on the VM, whose frames live on the heap
+constexpr size_t DEFAULT_MAX_CALL_DEPTH = 100000;
+// Bytes of the native stack of the main thread, from the soft limit when
+// the platform has one
+size_t native_stack_size() noexcept;
+
 class RuntimeValue;
 
 class Callable;
@@ -26,19 +36,24 @@ class Expression;
 class Statement;
 class Indexable;
 class StackedEnvironment;
+class SlotEnvironment;
+class AstArena;
 
-using RuntimeEnvPtr = std::shared_ptr<StackedEnvironment>;
-using IndexablePtr = std::shared_ptr<Indexable>;
+using RuntimeEnvPtr = Ref<StackedEnvironment>;
+using SlotEnvPtr = Ref<SlotEnvironment>;
+using IndexablePtr = Ref<Indexable>;
+using AstArenaPtr = std::shared_ptr<AstArena>;
 
 using Number = double;
 using String = std::string;
 using Args = std::vector<RuntimeValue>;
 using Names = std::vector<std::string>;
-using ExprPtr = std::shared_ptr<Expression>;
+// Nodes are owned by the AstArena of the script they were parsed from
+using ExprPtr = Expression *;
 using ExprList = std::vector<ExprPtr>;
-using StatementPtr = std::shared_ptr<Statement>;
+using StatementPtr = Statement *;
 using StatementList = std::vector<StatementPtr>;
-using CallablePtr = std::shared_ptr<Callable>;
+using CallablePtr = Ref<Callable>;
 using FunctionCallback = std::function<std::optional<RuntimeValue>(const Args &args)>;
 using VoidFunctionCallback = std::function<void(const Args &args)>;
 
@@ -64,7 +79,13 @@ enum class UnaryOp {
 	Identity,
 };
 
-enum class TokenType {
+enum class OptimizationLevel {
+	O0,
+	O1,
+	O2,
+};
+
+enum class TokenType : uint8_t {
 	Eof,
 	Newline,
 	Number,
@@ -122,4 +143,14 @@ enum class TokenType {
 std::string token_type_to_string(TokenType type) noexcept;
 std::string binary_op_to_string(BinaryOp op) noexcept;
 std::string unary_op_to_string(UnaryOp op) noexcept;
+
+// Fits the text format_number writes for any Number
+constexpr size_t NUMBER_BUFFER_SIZE = 32;
+/*
+ * Writes the shortest text that reads back as n into buffer, which holds at
+ * least NUMBER_BUFFER_SIZE chars, and returns the end of the text.
+ * Integers below 2^53 are written without a fraction or an exponent.
+ */
+char *format_number(Number n, char *buffer) noexcept;
+std::string number_to_string(Number n);
 } // namespace CL
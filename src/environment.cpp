@@ -12,9 +12,9 @@ public:
 	}
 };
 
-RuntimeValue &StackedEnvironment::get(const std::string &name) {
-	if(m_scope.find(name) != m_scope.end()) {
-		return m_scope.at(name);
+RuntimeValue &StackedEnvironment::get(const Symbol &name) {
+	if(auto it = m_scope.find(name); it != m_scope.end()) {
+		return it->second;
 	}
 	if(m_parent) {
 		return m_parent->get(name);
@@ -22,34 +22,76 @@ RuntimeValue &StackedEnvironment::get(const std::string &name) {
 	throw NotBoundException(name);
 }
 
-void StackedEnvironment::assign(const std::string &name,
+void StackedEnvironment::assign(const Symbol &name,
 								RuntimeValue val,
 								bool is_const) {
-	auto current = shared_from_this();
-	while (current != nullptr) {
+	for (auto *current = this; current != nullptr;
+		 current = current->m_parent.get()) {
 		if(current->is_bound(name)) {
 			current->bind(name, val, is_const);
 			return;
 		}
-		current = current->m_parent;
 	}
 	bind(name, val, is_const);
 }
 
-void StackedEnvironment::bind(const std::string &name,
+void StackedEnvironment::bind(const Symbol &name,
 							  RuntimeValue val,
 							  bool is_const) {
 
 	if(m_consts.find(name) != m_consts.end()) {
-		throw RuntimeException(name + " is const.");
+		throw RuntimeException(name.str() + " is const.");
 	}
-	m_scope[name] = val;
+	auto [binding, added] = m_scope.try_emplace(name);
+	binding->second = std::move(val);
 	if(is_const)
 		m_consts.insert(name);
+	if(added || is_const)
+		s_version++;
 }
 
-bool StackedEnvironment::is_bound(const std::string &name) {
-	return m_scope.find(name) != m_scope.end();
+void StackedEnvironment::visit_references(GcVisitor &visitor) const {
+	for (const auto &binding : m_scope) {
+		visitor.visit(binding.second);
+	}
+	visitor.visit(m_parent);
+}
+
+void StackedEnvironment::clear_references() {
+	s_version++;
+	m_scope.clear();
+	m_consts.clear();
+	m_parent.reset();
+}
+
+bool StackedEnvironment::is_const(const Symbol &name) const {
+	for (const auto *env = this; env != nullptr; env = env->m_parent.get()) {
+		if(env->m_scope.find(name) != env->m_scope.end()) {
+			return env->m_consts.find(name) != env->m_consts.end();
+		}
+	}
+	return false;
+}
+
+RuntimeValue &NameCache::get(StackedEnvironment &from, const Symbol &name) {
+	if(env != &from || version != StackedEnvironment::version()) {
+		value = &from.get(name);
+		writable = !from.is_const(name);
+		env = &from;
+		version = StackedEnvironment::version();
+	}
+	return *value;
+}
+
+void NameCache::assign(StackedEnvironment &from,
+					   const Symbol &name,
+					   const RuntimeValue &new_value) {
+	if(env == &from && version == StackedEnvironment::version() && writable) {
+		*value = new_value;
+		return;
+	}
+	from.assign(name, new_value, false);
+	get(from, name);
 }
 
 std::string StackedEnvironment::to_string() const noexcept {
@@ -26,27 +26,116 @@ public:
 	virtual std::string to_string() const noexcept = 0;
 };
 
-class StackedEnvironment
-	: public Env<RuntimeValue>,
-	  public std::enable_shared_from_this<StackedEnvironment> {
+class StackedEnvironment : public Env<RuntimeValue>, public GcObject {
 private:
-	using Scope = std::unordered_map<std::string, RuntimeValue>;
+	// Bindings are keyed by Symbol, the string overloads intern their name
+	using Scope = std::unordered_map<Symbol, RuntimeValue, Symbol::Hash,
+									   std::equal_to<Symbol>,
+									   PoolAllocator<std::pair<const Symbol, RuntimeValue>>>;
 	Scope m_scope;
-	std::unordered_set<std::string> m_consts;
+	std::unordered_set<Symbol, Symbol::Hash> m_consts;
 	RuntimeEnvPtr m_parent{nullptr};
 
+	// Bumped when any environment adds, removes or makes const a binding
+	inline static uint64_t s_version{1};
+
 public:
 	explicit StackedEnvironment(RuntimeEnvPtr parent = nullptr)
 		: m_parent(std::move(parent)) {
 	}
-	void assign(const std::string &,
-				RuntimeValue,
-				bool is_const = false) override;
-	RuntimeValue &get(const std::string &) override;
-	bool is_bound(const std::string &) override;
-	void bind(const std::string &,
-			  RuntimeValue,
-			  bool is_const = false) override;
+	~StackedEnvironment() override { s_version++; }
+
+	// References to bindings stay valid and keep their constness
+	// as long as the version doesn't change
+	static uint64_t version() noexcept { return s_version; }
+	void assign(const std::string &name,
+				RuntimeValue val,
+				bool is_const = false) override {
+		assign(Symbol(name), std::move(val), is_const);
+	}
+	RuntimeValue &get(const std::string &name) override {
+		return get(Symbol(name));
+	}
+	bool is_bound(const std::string &name) override {
+		return is_bound(Symbol(name));
+	}
+	void bind(const std::string &name,
+			  RuntimeValue val,
+			  bool is_const = false) override {
+		bind(Symbol(name), std::move(val), is_const);
+	}
+	void assign(const Symbol &, RuntimeValue, bool is_const = false);
+	RuntimeValue &get(const Symbol &);
+	bool is_bound(const Symbol &name) {
+		return m_scope.find(name) != m_scope.end();
+	}
+	void bind(const Symbol &, RuntimeValue, bool is_const = false);
 	std::string to_string() const noexcept override;
+	// True when the closest binding of name was made const
+	bool is_const(const Symbol &name) const;
+	bool is_const(const std::string &name) const {
+		return is_const(Symbol(name));
+	}
+	[[nodiscard]]
+	const RuntimeEnvPtr &parent() const noexcept { return m_parent; }
+
+	void visit_references(GcVisitor &visitor) const override;
+	void clear_references() override;
+};
+
+/*
+ * Where a name was last found from an environment, valid as long as it is
+ * looked up from the same environment and no binding was added or removed
+ * since. Engines keep one for each place a global is read or assigned.
+ */
+struct NameCache {
+	const StackedEnvironment *env{nullptr};
+	uint64_t version{0};
+	RuntimeValue *value{nullptr};
+	// Stores to const bindings go through assign, which rejects them
+	bool writable{false};
+
+	RuntimeValue &get(StackedEnvironment &from, const Symbol &name);
+	void assign(StackedEnvironment &from,
+				const Symbol &name,
+				const RuntimeValue &new_value);
+};
+
+/*
+ * Holds the locals of a block or function call, indexed by the
+ * (depth, index) pairs computed by the Resolver.
+ */
+class SlotEnvironment : public GcObject {
+private:
+	std::vector<RuntimeValue> m_slots;
+	SlotEnvPtr m_parent{nullptr};
+
+public:
+	SlotEnvironment(size_t size, SlotEnvPtr parent)
+		: m_slots(size), m_parent(std::move(parent)) {
+	}
+
+	RuntimeValue &at(uint32_t depth, uint32_t index) noexcept {
+		auto *env = this;
+		for (; depth > 0; depth--) {
+			env = env->m_parent.get();
+		}
+		return env->m_slots[index];
+	}
+	RuntimeValue &operator[](uint32_t index) noexcept { return m_slots[index]; }
+
+	[[nodiscard]]
+	const SlotEnvPtr &parent() const noexcept { return m_parent; }
+
+	void visit_references(GcVisitor &visitor) const override {
+		for (const auto &value : m_slots) {
+			visitor.visit(value);
+		}
+		visitor.visit(m_parent);
+	}
+	void clear_references() override {
+		m_slots.clear();
+		m_parent.reset();
+	}
 };
 }
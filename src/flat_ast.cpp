@@ -0,0 +1,295 @@
+#include "flat_ast.hpp"
+#include "exceptions.hpp"
+
+#include <algorithm>
+
+namespace CL {
+std::shared_ptr<const FlatTree> FlatTree::build(const StatementList &statements,
+												AstArenaPtr arena) {
+	auto tree = std::make_shared<FlatTree>();
+	tree->m_arena = std::move(arena);
+	FlatBuilder builder(*tree);
+	for (const auto &statement : statements) {
+		builder.add_statement(statement);
+	}
+	tree->m_stack_size = builder.stack_size();
+	return tree;
+}
+
+void FlatBuilder::add_statement(const StatementPtr &statement) {
+	m_tree.m_statements.push_back(flatten(statement));
+}
+
+NodeIndex FlatBuilder::add_node(NodeKind kind,
+								uint32_t a,
+								uint32_t b,
+								uint32_t c,
+								uint8_t op) {
+	m_tree.m_nodes.push_back(FlatNode{kind, op, a, b, c});
+	m_last = m_tree.m_nodes.size() - 1;
+	return m_last;
+}
+
+NodeIndex FlatBuilder::flatten(const ExprPtr &expr) {
+	if(!expr) {
+		return NO_NODE;
+	}
+	expr->evaluate(*this);
+	return m_last;
+}
+
+NodeIndex FlatBuilder::flatten(const StatementPtr &statement) {
+	if(!statement) {
+		return NO_NODE;
+	}
+	statement->execute(*this);
+	return m_last;
+}
+
+uint32_t FlatBuilder::add_children(const std::vector<NodeIndex> &children) {
+	auto first = m_tree.m_children.size();
+	m_tree.m_children.insert(m_tree.m_children.end(),
+							 children.begin(),
+							 children.end());
+	return first;
+}
+
+uint32_t FlatBuilder::add_string(const Symbol &string) {
+	auto it = m_tree.m_string_indices.find(string);
+	if(it != m_tree.m_string_indices.end()) {
+		return it->second;
+	}
+	m_tree.m_strings.push_back(string);
+	auto index = m_tree.m_strings.size() - 1;
+	m_tree.m_string_indices[string] = index;
+	return index;
+}
+
+uint32_t FlatBuilder::add_binding(const Symbol &name, const Slot &slot) {
+	auto binding = FlatBinding{add_string(name), slot};
+	if(slot.is_local()) {
+		// Only the captured scopes count in the depth of the SlotEnvironments
+		auto depth = slot.depth;
+		uint32_t captured_depth = 0;
+		for (auto scope = m_scopes.rbegin(); scope != m_scopes.rend(); scope++) {
+			if(depth == 0) {
+				binding.on_stack = scope->on_stack;
+				break;
+			}
+			depth--;
+			captured_depth += scope->on_stack ? 0 : 1;
+		}
+		binding.slot = binding.on_stack
+					   ? Slot{0, m_scopes[m_scopes.size() - 1 - slot.depth].first + slot.index}
+					   : Slot{captured_depth + depth, slot.index};
+	}
+	m_tree.m_bindings.push_back(binding);
+	m_tree.m_name_caches.emplace_back();
+	return m_tree.m_bindings.size() - 1;
+}
+
+void FlatBuilder::visit_number_expression(Number n) {
+	m_tree.m_numbers.push_back(n);
+	add_node(NodeKind::Number, m_tree.m_numbers.size() - 1);
+}
+
+void FlatBuilder::visit_string_expression(const RuntimeValue &s) {
+	m_tree.m_literals.push_back(s);
+	add_node(NodeKind::String, m_tree.m_literals.size() - 1);
+}
+
+void FlatBuilder::visit_dict_expression(const std::vector<std::pair<ExprPtr,
+																	ExprPtr>> &exprs) {
+	std::vector<NodeIndex> children;
+	for (const auto &e : exprs) {
+		children.push_back(flatten(e.first));
+		children.push_back(flatten(e.second));
+	}
+	add_node(NodeKind::Dict, add_children(children), children.size());
+}
+
+void FlatBuilder::visit_list_expression(const ExprList &exprs) {
+	std::vector<NodeIndex> children;
+	for (const auto &e : exprs) {
+		children.push_back(flatten(e));
+	}
+	add_node(NodeKind::List, add_children(children), children.size());
+}
+
+void FlatBuilder::visit_and_expression(const ExprPtr &left,
+									   const ExprPtr &right) {
+	auto l = flatten(left);
+	auto r = flatten(right);
+	add_node(NodeKind::And, l, r);
+}
+
+void FlatBuilder::visit_or_expression(const ExprPtr &left,
+									  const ExprPtr &right) {
+	auto l = flatten(left);
+	auto r = flatten(right);
+	add_node(NodeKind::Or, l, r);
+}
+
+void FlatBuilder::visit_binary_expression(const ExprPtr &left,
+										  BinaryOp op,
+										  const ExprPtr &right,
+										  TypeFeedback &feedback) {
+	auto l = flatten(left);
+	auto r = flatten(right);
+	add_node(NodeKind::Binary, l, r, 0, static_cast<uint8_t>(op));
+}
+
+void FlatBuilder::visit_unary_expression(UnaryOp op, const ExprPtr &expr) {
+	add_node(NodeKind::Unary, flatten(expr), 0, 0, static_cast<uint8_t>(op));
+}
+
+void FlatBuilder::visit_var_expression(const Symbol &var, Slot &slot) {
+	add_node(NodeKind::Var, add_binding(var, slot));
+}
+
+void FlatBuilder::visit_assign_expression(const Symbol &name,
+										  Slot &slot,
+										  const ExprPtr &value) {
+	auto v = flatten(value);
+	add_node(NodeKind::Assign, add_binding(name, slot), v);
+}
+
+void FlatBuilder::visit_fun_call(const ExprPtr &fun,
+								 const ExprList &args,
+								 bool tail_call) {
+	auto callee = flatten(fun);
+	std::vector<NodeIndex> children;
+	for (const auto &arg : args) {
+		children.push_back(flatten(arg));
+	}
+	add_node(NodeKind::Call,
+			 callee,
+			 add_children(children),
+			 children.size(),
+			 tail_call ? 1 : 0);
+}
+
+void FlatBuilder::visit_fun_def_statement(const Symbol &name,
+										  Slot &slot,
+										  const Names &names,
+										  ScopeLayout &layout,
+										  const StatementPtr &body,
+										  bool memoized) {
+	// The body is laid out as a call of its own
+	auto scopes = std::move(m_scopes);
+	auto stack_top = m_stack_top;
+	auto stack_size = m_stack_size;
+	auto params_on_stack = !layout.captured;
+	m_scopes = {Scope{params_on_stack, 0, layout.size}};
+	m_stack_top = m_stack_size = params_on_stack ? layout.size : 0;
+	auto b = flatten(body);
+	m_tree.m_functions.push_back(FlatFunctionInfo{add_string(name),
+												  names,
+												  layout.size,
+												  m_stack_size,
+												  params_on_stack,
+												  b,
+												  memoized,
+												  body});
+	m_scopes = std::move(scopes);
+	m_stack_top = stack_top;
+	m_stack_size = stack_size;
+	add_node(NodeKind::Fun_Def,
+			 add_binding(name, slot),
+			 m_tree.m_functions.size() - 1);
+}
+
+void FlatBuilder::visit_expression_statement(const ExprPtr &expr) {
+	add_node(NodeKind::Expression_Statement, flatten(expr));
+}
+
+void FlatBuilder::visit_block_statement(const StatementList &block,
+										ScopeLayout &layout) {
+	auto on_stack = layout.size > 0 && !layout.captured;
+	auto first = m_stack_top;
+	if(layout.size > 0) {
+		m_scopes.push_back(Scope{on_stack, first, layout.size});
+	}
+	if(on_stack) {
+		if(first > UINT16_MAX || layout.size > UINT16_MAX) {
+			throw RuntimeException("Too many nested scopes or locals to flatten");
+		}
+		m_stack_top += layout.size;
+		m_stack_size = std::max(m_stack_size, m_stack_top);
+	}
+	std::vector<NodeIndex> children;
+	for (const auto &statement : block) {
+		children.push_back(flatten(statement));
+	}
+	if(layout.size > 0) {
+		m_scopes.pop_back();
+		m_stack_top = first;
+	}
+	add_node(NodeKind::Block,
+			 add_children(children),
+			 children.size(),
+			 on_stack ? first << 16 | layout.size : layout.size,
+			 on_stack ? 1 : 0);
+}
+
+void FlatBuilder::visit_return_expression(const ExprPtr &expr) {
+	add_node(NodeKind::Return, flatten(expr));
+}
+
+void FlatBuilder::visit_break_expression() {
+	add_node(NodeKind::Break);
+}
+
+void FlatBuilder::visit_continue_expression() {
+	add_node(NodeKind::Continue);
+}
+
+void FlatBuilder::visit_if_statement(const ExprPtr &cond,
+									 const StatementPtr &if_branch,
+									 const StatementPtr &else_branch) {
+	auto c = flatten(cond);
+	auto i = flatten(if_branch);
+	auto e = flatten(else_branch);
+	add_node(NodeKind::If, c, i, e);
+}
+
+void FlatBuilder::visit_while_statement(const ExprPtr &cond,
+										const StatementPtr &body) {
+	auto c = flatten(cond);
+	auto b = flatten(body);
+	add_node(NodeKind::While, c, b);
+}
+
+void FlatBuilder::visit_for_statement(const Symbol &name,
+									  Slot &slot,
+									  const ExprPtr &iterable,
+									  const StatementPtr &body) {
+	auto i = flatten(iterable);
+	auto b = flatten(body);
+	add_node(NodeKind::For, add_binding(name, slot), i, b);
+}
+
+void FlatBuilder::visit_set_expression(const ExprPtr &obj,
+									   const ExprPtr &name,
+									   const ExprPtr &val) {
+	auto o = flatten(obj);
+	auto n = flatten(name);
+	auto v = flatten(val);
+	add_node(NodeKind::Set, o, n, v);
+}
+
+void FlatBuilder::visit_get_expression(const ExprPtr &obj,
+									   const ExprPtr &name) {
+	auto o = flatten(obj);
+	auto n = flatten(name);
+	add_node(NodeKind::Get, o, n);
+}
+
+void FlatBuilder::visit_module_definition(const ExprList &list) {
+	std::vector<NodeIndex> children;
+	for (const auto &expr : list) {
+		children.push_back(flatten(expr));
+	}
+	add_node(NodeKind::Module, add_children(children), children.size());
+}
+}
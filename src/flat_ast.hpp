@@ -0,0 +1,257 @@
+#pragma once
+
+#include "commons.hpp"
+#include "environment.hpp"
+#include "nodes.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CL {
+using NodeIndex = uint32_t;
+constexpr NodeIndex NO_NODE = UINT32_MAX;
+
+enum class NodeKind : uint8_t {
+	Number,
+	String,
+	Dict,
+	List,
+	And,
+	Or,
+	Binary,
+	Unary,
+	Var,
+	Assign,
+	Call,
+	Fun_Def,
+	Expression_Statement,
+	Block,
+	Return,
+	Break,
+	Continue,
+	If,
+	While,
+	For,
+	Set,
+	Get,
+	Module,
+};
+
+/*
+ * A node record of a FlatTree.
+ * The meaning of a, b and c depends on the kind:
+ *  Number, String        a: literal index
+ *  Dict, List, Module    a: first child, b: child count (keys and values alternate)
+ *  And, Or, Binary       a: left, b: right, op: BinaryOp
+ *  Unary                 a: operand, op: UnaryOp
+ *  Var                   a: binding
+ *  Assign                a: binding, b: value
+ *  Call                  a: callee, b: first argument, c: argument count,
+ *                        op: 1 for a tail call
+ *  Fun_Def               a: binding, b: function
+ *  Expression_Statement  a: expression
+ *  Block                 a: first child, b: child count, c: scope size or 0 when elided,
+ *                        op: 1 for a scope on the stack, c: then first slot << 16 | size
+ *  Return                a: value or NO_NODE
+ *  If                    a: condition, b: then, c: else or NO_NODE
+ *  While                 a: condition, b: body
+ *  For                   a: binding, b: iterable, c: body
+ *  Set                   a: object, b: name, c: value
+ *  Get                   a: object, b: name
+ * Children of list-like nodes are stored contiguously in the child table.
+ */
+struct FlatNode {
+	NodeKind kind;
+	uint8_t op;
+	uint32_t a;
+	uint32_t b;
+	uint32_t c;
+};
+static_assert(sizeof(FlatNode) == 16);
+
+struct FlatBinding {
+	uint32_t name;
+	// On the stack, the index is the offset of the slot in the call
+	Slot slot;
+	bool on_stack{false};
+};
+
+/*
+ * Like in the VM, the slots of the scopes that no function captures live
+ * on the stack of the evaluator, stack_size of them for each call.
+ */
+struct FlatFunctionInfo {
+	uint32_t name;
+	Names params;
+	uint32_t scope_size;
+	uint32_t stack_size;
+	bool params_on_stack;
+	NodeIndex body;
+	bool memoized;
+	// Kept to print the function, the tree owns its arena
+	StatementPtr source;
+};
+
+/*
+ * A parsed script laid out as a contiguous array of FlatNodes that refer
+ * to their children by index, with literals, names and functions kept in
+ * side tables. Built from a resolved Statement tree by FlatTree::build.
+ */
+class FlatTree {
+private:
+	std::vector<FlatNode> m_nodes;
+	std::vector<NodeIndex> m_children;
+	std::vector<NodeIndex> m_statements;
+	std::vector<Number> m_numbers;
+	std::vector<RuntimeValue> m_literals;
+	std::vector<Symbol> m_strings;
+	std::unordered_map<Symbol, uint32_t, Symbol::Hash> m_string_indices;
+	std::vector<FlatBinding> m_bindings;
+	// One for each binding, only used by the global ones
+	mutable std::vector<NameCache> m_name_caches;
+	std::vector<FlatFunctionInfo> m_functions;
+	// The stack slots of the top level statements
+	uint32_t m_stack_size{0};
+	AstArenaPtr m_arena;
+
+	friend class FlatBuilder;
+
+public:
+	static std::shared_ptr<const FlatTree> build(const StatementList &statements,
+												 AstArenaPtr arena);
+
+	[[nodiscard]]
+	const FlatNode &node(NodeIndex index) const noexcept {
+		return m_nodes[index];
+	}
+	[[nodiscard]]
+	const NodeIndex *children(uint32_t first) const noexcept {
+		return m_children.data() + first;
+	}
+	[[nodiscard]]
+	const std::vector<NodeIndex> &statements() const noexcept {
+		return m_statements;
+	}
+	[[nodiscard]]
+	Number number(uint32_t index) const noexcept { return m_numbers[index]; }
+	[[nodiscard]]
+	const RuntimeValue &literal(uint32_t index) const noexcept {
+		return m_literals[index];
+	}
+	[[nodiscard]]
+	const Symbol &string(uint32_t index) const noexcept {
+		return m_strings[index];
+	}
+	[[nodiscard]]
+	const FlatBinding &binding(uint32_t index) const noexcept {
+		return m_bindings[index];
+	}
+	[[nodiscard]]
+	NameCache &name_cache(uint32_t binding) const noexcept {
+		return m_name_caches[binding];
+	}
+	[[nodiscard]]
+	const FlatFunctionInfo &function(uint32_t index) const noexcept {
+		return m_functions[index];
+	}
+	[[nodiscard]]
+	size_t size() const noexcept { return m_nodes.size(); }
+	[[nodiscard]]
+	uint32_t stack_size() const noexcept { return m_stack_size; }
+};
+
+/*
+ * Flattens a Statement tree in post order, so that children always
+ * precede their parent in the node array.
+ */
+class FlatBuilder : public Evaluator {
+private:
+	// A scope with locals, on the stack from first or captured
+	struct Scope {
+		bool on_stack;
+		uint32_t first;
+		uint32_t size;
+	};
+
+	FlatTree &m_tree;
+	NodeIndex m_last{NO_NODE};
+	// The scopes of the call being flattened, innermost last
+	std::vector<Scope> m_scopes;
+	uint32_t m_stack_top{0};
+	uint32_t m_stack_size{0};
+
+	NodeIndex add_node(NodeKind kind,
+					   uint32_t a = 0,
+					   uint32_t b = 0,
+					   uint32_t c = 0,
+					   uint8_t op = 0);
+	NodeIndex flatten(const ExprPtr &expr);
+	NodeIndex flatten(const StatementPtr &statement);
+	uint32_t add_children(const std::vector<NodeIndex> &children);
+	uint32_t add_string(const Symbol &string);
+	uint32_t add_binding(const Symbol &name, const Slot &slot);
+
+	void visit_number_expression(Number n) override;
+	void visit_string_expression(const RuntimeValue &s) override;
+	void visit_dict_expression(const std::vector<std::pair<ExprPtr,
+														   ExprPtr>> &) override;
+	void visit_list_expression(const ExprList &) override;
+
+	void visit_and_expression(const ExprPtr &left,
+							  const ExprPtr &right) override;
+	void visit_or_expression(const ExprPtr &left,
+							 const ExprPtr &right) override;
+	void visit_binary_expression(const ExprPtr &left,
+								 BinaryOp op,
+								 const ExprPtr &right,
+								 TypeFeedback &feedback) override;
+
+	void visit_unary_expression(UnaryOp op, const ExprPtr &expr) override;
+
+	void visit_var_expression(const Symbol &var, Slot &slot) override;
+	void visit_assign_expression(const Symbol &name,
+								 Slot &slot,
+								 const ExprPtr &value) override;
+	void visit_fun_call(const ExprPtr &fun,
+						const ExprList &args,
+						bool tail_call) override;
+	void visit_fun_def_statement(const Symbol &name,
+								 Slot &slot,
+								 const Names &names,
+								 ScopeLayout &layout,
+								 const StatementPtr &body,
+								 bool memoized) override;
+	void visit_expression_statement(const ExprPtr &expr) override;
+	void visit_block_statement(const StatementList &block,
+							   ScopeLayout &layout) override;
+	void visit_return_expression(const ExprPtr &expr) override;
+	void visit_break_expression() override;
+	void visit_continue_expression() override;
+	void visit_if_statement(const ExprPtr &cond,
+							const StatementPtr &expr,
+							const StatementPtr &else_branch) override;
+	void visit_while_statement(const ExprPtr &cond,
+							   const StatementPtr &body) override;
+	void visit_for_statement(const Symbol &name,
+							 Slot &slot,
+							 const ExprPtr &iterable,
+							 const StatementPtr &body) override;
+	void visit_set_expression(const ExprPtr &obj,
+							  const ExprPtr &name,
+							  const ExprPtr &val) override;
+	void visit_get_expression(const ExprPtr &obj, const ExprPtr &name) override;
+	void visit_module_definition(const ExprList &list) override;
+
+public:
+	explicit FlatBuilder(FlatTree &tree)
+		: m_tree(tree) {
+	}
+
+	void add_statement(const StatementPtr &statement);
+	[[nodiscard]]
+	uint32_t stack_size() const noexcept { return m_stack_size; }
+};
+}
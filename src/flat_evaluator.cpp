@@ -0,0 +1,392 @@
+#include "flat_evaluator.hpp"
+#include "exceptions.hpp"
+#include "memoized_function.hpp"
+#include "stack_based_evaluator.hpp"
+#include "string_visitor.hpp"
+
+#include <typeinfo>
+
+namespace CL {
+std::optional<RuntimeValue> FlatEvaluator::run() {
+	m_stack.resize(m_tree->stack_size());
+	for (auto statement : m_tree->statements()) {
+		if(execute(statement) == Completion::Return) {
+			break;
+		}
+	}
+	return std::move(m_result);
+}
+
+SlotEnvPtr FlatEvaluator::enter_call(const FlatFunction &function,
+									size_t base,
+									size_t args) {
+	const auto &info = function.info();
+	auto argc = info.params.size();
+	SlotEnvPtr locals;
+	if(info.params_on_stack) {
+		for (size_t i = 0; base != args && i < argc; i++) {
+			m_stack[base + i] = std::move(m_stack[args + i]);
+		}
+		m_stack.resize(base + argc);
+		locals = function.definition_locals();
+	} else {
+		locals = function.make_call_locals(m_stack.data() + args, argc);
+		m_stack.resize(base);
+	}
+	m_stack.resize(base + info.stack_size);
+	return locals;
+}
+
+std::optional<RuntimeValue> FlatEvaluator::run_function(const FlatFunction &function,
+														const Args &args) {
+	auto base = m_stack.size();
+	m_stack.insert(m_stack.end(), args.begin(), args.end());
+	auto locals = enter_call(function, base, base);
+	return run_function(function, base, std::move(locals));
+}
+
+std::optional<RuntimeValue> FlatEvaluator::run_function(const FlatFunction &function,
+														size_t base,
+														SlotEnvPtr locals) {
+	CallDepthGuard guard;
+	Collector::instance().safe_point();
+	auto tree = std::move(m_tree);
+	auto env = std::move(m_env);
+	auto outer_locals = std::move(m_locals);
+	auto result = std::move(m_result);
+	auto outer_base = m_base;
+	m_base = base;
+	m_tree = function.tree();
+	m_env = function.definition_env();
+	m_locals = std::move(locals);
+	m_result.reset();
+
+	std::optional<RuntimeValue> function_result;
+	// Keeps the function run by the last tail call alive
+	Ref<FlatFunction> callee;
+	const auto *current = &function;
+	try {
+		while (true) {
+			execute(current->info().body);
+			if(!m_tail_callee) {
+				break;
+			}
+			callee = std::move(m_tail_callee);
+			current = callee.get();
+			m_tree = current->tree();
+			m_env = current->definition_env();
+			m_locals = enter_call(*current, m_base, m_tail_args);
+			m_result.reset();
+		}
+		function_result = std::move(m_result);
+	} catch (...) {
+		m_tail_callee.reset();
+		m_stack.resize(base);
+		m_base = outer_base;
+		m_tree = std::move(tree);
+		m_env = std::move(env);
+		m_locals = std::move(outer_locals);
+		m_result = std::move(result);
+		throw;
+	}
+	m_stack.resize(base);
+	m_base = outer_base;
+	m_tree = std::move(tree);
+	m_env = std::move(env);
+	m_locals = std::move(outer_locals);
+	m_result = std::move(result);
+	return function_result;
+}
+
+RuntimeValue FlatEvaluator::load(uint32_t index) {
+	const auto &binding = m_tree->binding(index);
+	if(binding.slot.is_local()) {
+		return local(binding);
+	}
+	return m_tree->name_cache(index).get(*m_env, m_tree->string(binding.name));
+}
+
+void FlatEvaluator::store(uint32_t index, const RuntimeValue &value) {
+	const auto &binding = m_tree->binding(index);
+	if(binding.slot.is_local()) {
+		local(binding) = value;
+	} else {
+		m_tree->name_cache(index).assign(*m_env,
+										 m_tree->string(binding.name),
+										 value);
+	}
+}
+
+RuntimeValue FlatEvaluator::binary(BinaryOp op,
+								   const RuntimeValue &left,
+								   const RuntimeValue &right) {
+	switch (op) {
+		case BinaryOp::Addition: return RuntimeValue(left) + right;
+		case BinaryOp::Subtraction: return left - right;
+		case BinaryOp::Multiplication: return left * right;
+		case BinaryOp::Division: return left / right;
+		case BinaryOp::Exponentiation: return left.to_power_of(right);
+		case BinaryOp::Modulo: return left.modulo(right);
+		case BinaryOp::Less: return RuntimeValue(left < right);
+		case BinaryOp::Less_Equals: return RuntimeValue(left <= right);
+		case BinaryOp::Greater: return RuntimeValue(left > right);
+		case BinaryOp::Greater_Equals: return RuntimeValue(left >= right);
+		case BinaryOp::Equals: return RuntimeValue(left == right);
+		case BinaryOp::Not_Equals: return RuntimeValue(left != right);
+		case BinaryOp::And:
+		case BinaryOp::Or: break;
+	}
+	NOT_REACHED();
+}
+
+RuntimeValue FlatEvaluator::call(const FlatNode &node) {
+	auto callee = evaluate(node.a);
+	if(!callee.is<CallablePtr>()) {
+		throw RuntimeException(callee.to_string() + " is not callable.");
+	}
+	const auto &callable = callee.as<CallablePtr>();
+	if(node.c != callable->arity() && callable->arity() != VAR_ARGS) {
+		throw RuntimeException(
+			"This callable expects " + std::to_string(callable->arity())
+				+ " arguments, but it got " + std::to_string(node.c)
+				+ "!");
+	}
+
+	const auto *children = m_tree->children(node.b);
+	std::optional<RuntimeValue> result;
+	// FlatFunction is final, so this is cheaper than a dynamic_cast
+	if(typeid(*callable) == typeid(FlatFunction)) {
+		const auto &function = static_cast<const FlatFunction &>(*callable);
+		// Arguments are evaluated onto the stack, above the running frame
+		auto args = m_stack.size();
+		for (uint32_t i = 0; i < node.c; i++) {
+			auto value = evaluate(children[i]);
+			m_stack.push_back(std::move(value));
+		}
+		if(node.op != 0) {
+			// The enclosing return completes, then run_function calls it
+			m_tail_callee = static_ref_cast<FlatFunction>(callable);
+			m_tail_args = args;
+			return RuntimeValue();
+		}
+		auto locals = enter_call(function, args, args);
+		result = run_function(function, args, std::move(locals));
+	} else {
+		Args args;
+		args.reserve(node.c);
+		for (uint32_t i = 0; i < node.c; i++) {
+			args.push_back(evaluate(children[i]));
+		}
+		result = callable->call(args);
+	}
+	return result.has_value() ? std::move(result.value()) : RuntimeValue();
+}
+
+RuntimeValue FlatEvaluator::evaluate(NodeIndex index) {
+	const auto &node = m_tree->node(index);
+	switch (node.kind) {
+		case NodeKind::Number: return m_tree->number(node.a);
+		case NodeKind::String: return m_tree->literal(node.a);
+		case NodeKind::Dict: {
+			auto d = make_ref<Dictionary>();
+			const auto *children = m_tree->children(node.a);
+			for (uint32_t i = 0; i < node.b; i += 2) {
+				auto key = evaluate(children[i]);
+				d->set(key, evaluate(children[i + 1]));
+			}
+			return RuntimeValue(d);
+		}
+		case NodeKind::List: {
+			auto l = make_ref<List>();
+			const auto *children = m_tree->children(node.a);
+			for (uint32_t i = 0; i < node.b; i++) {
+				l->append(evaluate(children[i]));
+			}
+			return RuntimeValue(l);
+		}
+		case NodeKind::And:
+			if(!evaluate(node.a).is_truthy()) {
+				return RuntimeValue(false);
+			}
+			return evaluate(node.b);
+		case NodeKind::Or:
+			if(evaluate(node.a).is_truthy()) {
+				return RuntimeValue(true);
+			}
+			return evaluate(node.b);
+		case NodeKind::Binary: {
+			auto left = evaluate(node.a);
+			return binary(static_cast<BinaryOp>(node.op), left, evaluate(node.b));
+		}
+		case NodeKind::Unary: {
+			auto value = evaluate(node.a);
+			if(static_cast<UnaryOp>(node.op) == UnaryOp::Negation) {
+				value.negate();
+			}
+			return value;
+		}
+		case NodeKind::Var: return load(node.a);
+		case NodeKind::Assign: {
+			auto value = evaluate(node.b);
+			store(node.a, value);
+			return value;
+		}
+		case NodeKind::Call: return call(node);
+		case NodeKind::Set: {
+			auto obj = evaluate(node.a);
+			auto value = evaluate(node.c);
+			obj.set_property(evaluate(node.b), value);
+			return value;
+		}
+		case NodeKind::Get: {
+			auto obj = evaluate(node.a);
+			return obj.get_property(evaluate(node.b));
+		}
+		case NodeKind::Module: {
+			auto env = make_ref<StackedEnvironment>(m_env);
+			auto outer_env = std::move(m_env);
+			m_env = env;
+			const auto *children = m_tree->children(node.a);
+			for (uint32_t i = 0; i < node.b; i++) {
+				evaluate(children[i]);
+			}
+			m_env = std::move(outer_env);
+			return RuntimeValue(static_ref_cast<Indexable>(
+				make_ref<Module>(env)));
+		}
+		case NodeKind::Return:
+		case NodeKind::Break:
+		case NodeKind::Continue:
+			throw RuntimeException("return, break and continue can only be used as statements");
+		default: NOT_REACHED();
+	}
+}
+
+FlatEvaluator::Completion FlatEvaluator::execute(NodeIndex index) {
+	const auto &node = m_tree->node(index);
+	switch (node.kind) {
+		case NodeKind::Expression_Statement: {
+			const auto &expr = m_tree->node(node.a);
+			switch (expr.kind) {
+				case NodeKind::Return:
+					m_result = expr.a == NO_NODE ? RuntimeValue() : evaluate(expr.a);
+					return Completion::Return;
+				case NodeKind::Break: return Completion::Break;
+				case NodeKind::Continue: return Completion::Continue;
+				default: m_result = evaluate(node.a);
+					return Completion::Normal;
+			}
+		}
+		case NodeKind::Block: {
+			// Only the scopes captured by a function get a SlotEnvironment
+			SlotEnvPtr outer_locals;
+			auto heap_scope = node.op == 0 && node.c > 0;
+			if(heap_scope) {
+				outer_locals = m_locals;
+				m_locals = make_ref<SlotEnvironment>(node.c, m_locals);
+			}
+			auto completion = Completion::Normal;
+			const auto *children = m_tree->children(node.a);
+			for (uint32_t i = 0; i < node.b; i++) {
+				completion = execute(children[i]);
+				if(completion != Completion::Normal) {
+					break;
+				}
+			}
+			if(heap_scope) {
+				m_locals = std::move(outer_locals);
+			} else if(node.op != 0) {
+				// Like leaving a SlotEnvironment, drops the values of the scope
+				auto first = m_base + (node.c >> 16);
+				for (auto i = first; i < first + (node.c & 0xFFFF); i++) {
+					m_stack[i] = RuntimeValue();
+				}
+			}
+			return completion;
+		}
+		case NodeKind::Fun_Def: {
+			auto function = make_ref<FlatFunction>(m_tree,
+														   node.b,
+														   m_env,
+														   m_locals);
+			const auto &binding = m_tree->binding(node.a);
+			auto value = m_tree->function(node.b).memoized
+						 ? RuntimeValue(make_ref<MemoizedFunction>(function))
+						 : RuntimeValue(function);
+			if(binding.slot.is_local()) {
+				local(binding) = value;
+			} else {
+				m_env->bind(m_tree->string(binding.name), value);
+			}
+			return Completion::Normal;
+		}
+		case NodeKind::If:
+			if(evaluate(node.a).is_truthy()) {
+				return execute(node.b);
+			} else if(node.c != NO_NODE) {
+				return execute(node.c);
+			}
+			return Completion::Normal;
+		case NodeKind::While:
+			while (evaluate(node.a).is_truthy()) {
+				Collector::instance().safe_point();
+				auto completion = execute(node.b);
+				if(completion == Completion::Break) {
+					break;
+				} else if(completion == Completion::Return) {
+					return completion;
+				}
+			}
+			return Completion::Normal;
+		case NodeKind::For: {
+			auto iterable = evaluate(node.b);
+			auto has_next = iterable.get_named("__has_next");
+			auto next = iterable.get_named("__next");
+			const auto &has_next_fun = has_next.as<CallablePtr>();
+			const auto &next_fun = next.as<CallablePtr>();
+			while (has_next_fun->call().value().is_truthy()) {
+				Collector::instance().safe_point();
+				store(node.a, next_fun->call().value());
+				auto completion = execute(node.c);
+				if(completion == Completion::Break) {
+					break;
+				} else if(completion == Completion::Return) {
+					return completion;
+				}
+			}
+			return Completion::Normal;
+		}
+		default: NOT_REACHED();
+	}
+}
+
+SlotEnvPtr FlatFunction::make_call_locals(const RuntimeValue *args,
+										  size_t count) const {
+	auto locals = make_ref<SlotEnvironment>(info().scope_size,
+													m_definition_locals);
+	for (size_t i = 0; i < count; i++) {
+		(*locals)[i] = args[i];
+	}
+	return locals;
+}
+
+std::optional<RuntimeValue> FlatFunction::call(const Args &args) {
+	FlatEvaluator evaluator(m_tree, m_definition_env);
+	return evaluator.run_function(*this, args);
+}
+
+std::string FlatFunction::string_repr() const noexcept {
+	StringVisitor eval;
+	std::string name_string;
+	for (const auto &name : info().params) {
+		name_string += name + ", ";
+	}
+
+	if(name_string.length() > 2) {
+		name_string.pop_back();
+		name_string.pop_back();
+	}
+	info().source->execute(eval);
+	return "fun( " + name_string + " ) -> " + eval.get_result();
+}
+}
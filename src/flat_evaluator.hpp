@@ -0,0 +1,132 @@
+#pragma once
+
+#include "commons.hpp"
+#include "environment.hpp"
+#include "flat_ast.hpp"
+#include "value.hpp"
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace CL {
+class FlatFunction;
+
+/*
+ * Walks a FlatTree with a switch over the node kinds, without going
+ * through the virtual evaluate/execute of the node classes.
+ * Calls to functions defined by a FlatTree reuse this evaluator, other
+ * callables are invoked through Callable::call.
+ * Like the VM, a function that doesn't return explicitly results in the
+ * value of its last expression statement.
+ * Tail calls to other FlatFunctions reuse the frame of the call.
+ * The slots that no function captures live on m_stack, from m_base for
+ * the running call.
+ */
+class FlatEvaluator {
+private:
+	enum class Completion {
+		Normal,
+		Break,
+		Continue,
+		Return,
+	};
+
+	std::shared_ptr<const FlatTree> m_tree;
+	RuntimeEnvPtr m_env;
+	SlotEnvPtr m_locals;
+	std::optional<RuntimeValue> m_result;
+	std::vector<RuntimeValue> m_stack;
+	size_t m_base{0};
+	// A call in tail position, run by run_function in place of the
+	// function that made it, with its arguments on the stack from m_tail_args
+	Ref<FlatFunction> m_tail_callee;
+	size_t m_tail_args{0};
+
+	RuntimeValue evaluate(NodeIndex index);
+	Completion execute(NodeIndex index);
+
+	RuntimeValue &local(const FlatBinding &binding) {
+		return binding.on_stack
+			   ? m_stack[m_base + binding.slot.index]
+			   : m_locals->at(binding.slot.depth, binding.slot.index);
+	}
+	// Moves the arguments at args to the frame at base and makes its slots
+	SlotEnvPtr enter_call(const FlatFunction &function, size_t base, size_t args);
+	std::optional<RuntimeValue> run_function(const FlatFunction &function,
+											 size_t base,
+											 SlotEnvPtr locals);
+
+	// Global bindings are looked up through their NameCache
+	RuntimeValue load(uint32_t binding);
+	void store(uint32_t binding, const RuntimeValue &value);
+	RuntimeValue call(const FlatNode &node);
+	static RuntimeValue binary(BinaryOp op,
+							   const RuntimeValue &left,
+							   const RuntimeValue &right);
+
+public:
+	FlatEvaluator(std::shared_ptr<const FlatTree> tree,
+				  RuntimeEnvPtr env,
+				  SlotEnvPtr locals = nullptr)
+		: m_tree(std::move(tree)),
+		  m_env(std::move(env)),
+		  m_locals(std::move(locals)) {
+	}
+
+	std::optional<RuntimeValue> run();
+	std::optional<RuntimeValue> run_function(const FlatFunction &function,
+											 const Args &args);
+};
+
+class FlatFunction final : public Callable {
+private:
+	std::shared_ptr<const FlatTree> m_tree;
+	uint32_t m_function;
+	RuntimeEnvPtr m_definition_env;
+	SlotEnvPtr m_definition_locals;
+
+public:
+	FlatFunction(std::shared_ptr<const FlatTree> tree,
+				 uint32_t function,
+				 RuntimeEnvPtr definition_env,
+				 SlotEnvPtr definition_locals)
+		: m_tree(std::move(tree)),
+		  m_function(function),
+		  m_definition_env(std::move(definition_env)),
+		  m_definition_locals(std::move(definition_locals)) {
+	}
+
+	[[nodiscard]]
+	const std::shared_ptr<const FlatTree> &tree() const noexcept {
+		return m_tree;
+	}
+	[[nodiscard]]
+	const FlatFunctionInfo &info() const noexcept {
+		return m_tree->function(m_function);
+	}
+	[[nodiscard]]
+	const RuntimeEnvPtr &definition_env() const noexcept {
+		return m_definition_env;
+	}
+	[[nodiscard]]
+	const SlotEnvPtr &definition_locals() const noexcept {
+		return m_definition_locals;
+	}
+	SlotEnvPtr make_call_locals(const RuntimeValue *args, size_t count) const;
+
+	void visit_references(GcVisitor &visitor) const override {
+		visitor.visit(m_definition_env);
+		visitor.visit(m_definition_locals);
+	}
+	void clear_references() override {
+		m_definition_env.reset();
+		m_definition_locals.reset();
+	}
+
+	std::optional<RuntimeValue> call(const Args &args) override;
+	uint8_t arity() override { return info().params.size(); }
+	[[nodiscard]]
+	std::string string_repr() const noexcept override;
+};
+}
@@ -70,15 +70,15 @@ private:
 	std::optional<RuntimeValue> call_helper(const Args &args,
 											std::index_sequence<I...>) {
 		if constexpr (std::is_same<R, void>::value) {
-			m_fun(Detail::ensure_is_convertible<Ts>(args[I])...);
+			m_fun(Detail::ensure_is_convertible<std::decay_t<Ts>>(args[I])...);
 			return std::nullopt;
 		} else if constexpr (std::is_same<R,
 										  std::optional<RuntimeValue>>::value) {
-			return m_fun(Detail::ensure_is_convertible<Ts>(args[I])...);
+			return m_fun(Detail::ensure_is_convertible<std::decay_t<Ts>>(args[I])...);
 		} else {
-			auto ret = m_fun(Detail::ensure_is_convertible<Ts>(args[I])...);
+			auto ret = m_fun(Detail::ensure_is_convertible<std::decay_t<Ts>>(args[I])...);
 			if constexpr (std::is_arithmetic<R>::value)
-				return RuntimeValue::make_from_raw_value(RawValue((Number) ret));
+				return RuntimeValue(static_cast<Number>(ret));
 			else
 				return ret;
 		}
@@ -97,10 +97,10 @@ public:
 
 template<typename R, typename... Ts>
 static CallablePtr make_function(R(*fun)(Ts...)) {
-	return std::make_shared<Function<R, Ts...>>(fun);
+	return make_ref<Function<R, Ts...>>(fun);
 }
 template<typename R, typename... Ts>
 static CallablePtr make_function(std::function<R(Ts...)> fun) {
-	return std::make_shared<Function<R, Ts...>>(fun);
+	return make_ref<Function<R, Ts...>>(fun);
 }
 }
@@ -0,0 +1,212 @@
+#include "gc.hpp"
+#include "value.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+namespace CL {
+GcObject::GcObject() {
+	Collector::instance().link(this);
+}
+
+GcObject::GcObject(const GcObject &)
+	: RefCounted() {
+	Collector::instance().link(this);
+}
+
+GcObject::~GcObject() {
+	Collector::instance().unlink(this);
+}
+
+Collector &Collector::instance() noexcept {
+	// Trivially destructible, so objects outliving main can still unlink
+	static Collector collector;
+	return collector;
+}
+
+void Collector::link(GcObject *object) noexcept {
+	object->m_next = m_objects;
+	if(m_objects != nullptr) {
+		m_objects->m_previous = object;
+	}
+	m_objects = object;
+	m_live++;
+	m_allocations++;
+}
+
+void Collector::unlink(GcObject *object) noexcept {
+	if(object->m_previous != nullptr) {
+		object->m_previous->m_next = object->m_next;
+	} else {
+		m_objects = object->m_next;
+	}
+	if(object->m_next != nullptr) {
+		object->m_next->m_previous = object->m_previous;
+	}
+	m_live--;
+}
+
+void Collector::set_threshold(size_t threshold) noexcept {
+	m_base_threshold = threshold;
+	m_threshold = threshold == 0 ? std::numeric_limits<size_t>::max()
+								 : threshold;
+}
+
+const GcObject *Collector::object_of(const RuntimeValue &value) noexcept {
+	if(!value.is_cell()) {
+		return nullptr;
+	}
+	switch (value.kind_of_cell()) {
+		case RuntimeValue::Indexable_Cell:
+			return value.cell<IndexablePtr>()->value.get();
+		case RuntimeValue::Callable_Cell:
+			return value.cell<CallablePtr>()->value.get();
+		default: return nullptr;
+	}
+}
+
+const void *Collector::cell_of(const RuntimeValue &value) noexcept {
+	return value.header();
+}
+
+size_t Collector::copies_of(const void *cell) noexcept {
+	return static_cast<const RuntimeValue::CellHeader *>(cell)->refs;
+}
+
+struct Collector::Node {
+	const GcObject *object;
+	long references;
+	bool reachable;
+};
+
+// Subtracts the references between GcObjects from their use counts
+class Collector::Subtractor : public GcVisitor {
+private:
+	std::vector<Node> &m_nodes;
+	const std::unordered_map<const GcObject *, size_t> &m_index;
+
+public:
+	// Copies of each cell seen inside GcObjects, with the object it points to
+	std::unordered_map<const void *, std::pair<size_t, size_t>> cells;
+
+	Subtractor(std::vector<Node> &nodes,
+			   const std::unordered_map<const GcObject *, size_t> &index)
+		: m_nodes(nodes), m_index(index) {
+	}
+
+	void visit(const RuntimeValue &value) override {
+		auto it = m_index.find(object_of(value));
+		if(it != m_index.end()) {
+			auto &cell = cells[cell_of(value)];
+			cell.first++;
+			cell.second = it->second;
+		}
+	}
+	void visit(const GcObject *object) override {
+		auto it = m_index.find(object);
+		if(it != m_index.end()) {
+			m_nodes[it->second].references--;
+		}
+	}
+};
+
+// Collects the objects directly referenced by another one
+class Collector::Successors : public GcVisitor {
+private:
+	const std::unordered_map<const GcObject *, size_t> &m_index;
+
+public:
+	std::vector<size_t> found;
+
+	explicit Successors(const std::unordered_map<const GcObject *,
+												 size_t> &index)
+		: m_index(index) {
+	}
+
+	void visit(const RuntimeValue &value) override {
+		visit(object_of(value));
+	}
+	void visit(const GcObject *object) override {
+		auto it = m_index.find(object);
+		if(it != m_index.end()) {
+			found.push_back(it->second);
+		}
+	}
+};
+
+size_t Collector::collect() {
+	auto start = std::chrono::steady_clock::now();
+
+	// Objects not owned by a Ref yet are left alone, the values they
+	// hold count as outer references
+	std::vector<Node> nodes;
+	std::unordered_map<const GcObject *, size_t> index;
+	nodes.reserve(m_live);
+	for (auto *object = m_objects; object != nullptr; object = object->m_next) {
+		auto uses = object->use_count();
+		if(uses > 0) {
+			index.emplace(object, nodes.size());
+			nodes.push_back(Node{object, uses, false});
+		}
+	}
+
+	Subtractor subtractor(nodes, index);
+	for (const auto &node : nodes) {
+		node.object->visit_references(subtractor);
+	}
+	for (const auto &[cell, seen] : subtractor.cells) {
+		if(seen.first == copies_of(cell)) {
+			nodes[seen.second].references--;
+		}
+	}
+
+	std::vector<size_t> pending;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		if(nodes[i].references > 0) {
+			nodes[i].reachable = true;
+			pending.push_back(i);
+		}
+	}
+	Successors successors(index);
+	while (!pending.empty()) {
+		auto current = pending.back();
+		pending.pop_back();
+		successors.found.clear();
+		nodes[current].object->visit_references(successors);
+		for (auto next : successors.found) {
+			if(!nodes[next].reachable) {
+				nodes[next].reachable = true;
+				pending.push_back(next);
+			}
+		}
+	}
+
+	// Keep the garbage alive while its references are cleared, so that
+	// clearing one object doesn't destroy another one still to clear
+	std::vector<Ref<GcObject>> garbage;
+	for (const auto &node : nodes) {
+		if(!node.reachable) {
+			garbage.emplace_back(const_cast<GcObject *>(node.object));
+		}
+	}
+	for (const auto &object : garbage) {
+		object->clear_references();
+	}
+	auto freed = garbage.size();
+	garbage.clear();
+
+	m_allocations = 0;
+	if(m_base_threshold != 0) {
+		m_threshold = std::max(m_base_threshold, m_live);
+	}
+	auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start);
+	m_stats.collections++;
+	m_stats.freed_objects += freed;
+	m_stats.last_pause = pause;
+	m_stats.total_pause += pause;
+	return freed;
+}
+}
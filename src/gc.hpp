@@ -0,0 +1,125 @@
+#pragma once
+
+#include "commons.hpp"
+#include "slab.hpp"
+
+#include <chrono>
+#include <cstddef>
+
+namespace CL {
+class GcObject;
+
+// Default number of GcObjects allocated between two collections
+constexpr size_t DEFAULT_GC_THRESHOLD = 10000;
+
+/*
+ * Receives the references a GcObject holds: the values it contains and the
+ * other objects it owns through a Ref.
+ */
+class GcVisitor {
+public:
+	virtual ~GcVisitor() = default;
+	virtual void visit(const RuntimeValue &value) = 0;
+	virtual void visit(const GcObject *object) = 0;
+
+	template<class T>
+	void visit(const Ref<T> &object) {
+		visit(static_cast<const GcObject *>(object.get()));
+	}
+};
+
+/*
+ * Base of the heap objects that can end up in a reference cycle:
+ * containers, environments and the functions closing over them.
+ * Every GcObject is linked in the Collector's list for as long as it
+ * lives. Subclasses report what they own in visit_references, and drop
+ * it in clear_references when the collector finds them unreachable.
+ * They are allocated from the SlabAllocator.
+ */
+class GcObject : public RefCounted {
+private:
+	GcObject *m_previous{nullptr};
+	GcObject *m_next{nullptr};
+
+	friend class Collector;
+
+public:
+	GcObject();
+	GcObject(const GcObject &);
+	GcObject &operator=(const GcObject &) { return *this; }
+	virtual ~GcObject();
+
+	static void *operator new(size_t size) {
+		return SlabAllocator::instance().allocate(size);
+	}
+	// The destructor is virtual, so size is the one of the most derived class
+	static void operator delete(void *pointer, size_t size) noexcept {
+		SlabAllocator::instance().deallocate(pointer, size);
+	}
+
+	virtual void visit_references(GcVisitor &) const {}
+	virtual void clear_references() {}
+};
+
+struct GcStats {
+	size_t collections{0};
+	size_t freed_objects{0};
+	std::chrono::nanoseconds last_pause{0};
+	std::chrono::nanoseconds total_pause{0};
+};
+
+/*
+ * A trial deletion cycle collector for the GcObjects owned by Refs.
+ * It subtracts from the use count of every object the references coming
+ * from other objects: the ones left with references from outside, like the
+ * evaluators' stacks and the script's environment, are live together with
+ * whatever they reach, the others are only kept alive by cycles and get
+ * their references cleared.
+ * Values are shared through refcounted cells, so a cell only counts as an
+ * inner reference when all of its copies live in GcObjects.
+ * Collections run at the safe points of the engines, calls and loop
+ * iterations, once enough objects were allocated since the last one.
+ */
+class Collector {
+private:
+	GcObject *m_objects{nullptr};
+	size_t m_live{0};
+	size_t m_allocations{0};
+	size_t m_threshold{DEFAULT_GC_THRESHOLD};
+	size_t m_base_threshold{DEFAULT_GC_THRESHOLD};
+	GcStats m_stats;
+
+	struct Node;
+	class Subtractor;
+	class Successors;
+
+	void link(GcObject *object) noexcept;
+	void unlink(GcObject *object) noexcept;
+
+	// The object a value points to, if any, and the cell it shares
+	static const GcObject *object_of(const RuntimeValue &value) noexcept;
+	static const void *cell_of(const RuntimeValue &value) noexcept;
+	static size_t copies_of(const void *cell) noexcept;
+
+	friend class GcObject;
+
+public:
+	static Collector &instance() noexcept;
+
+	// Collects when enough objects were allocated since the last collection
+	void safe_point() {
+		if(m_allocations >= m_threshold) {
+			collect();
+		}
+	}
+	// Frees the unreachable cycles and returns the number of objects freed
+	size_t collect();
+
+	// 0 disables the collections triggered by allocations
+	void set_threshold(size_t threshold) noexcept;
+	[[nodiscard]]
+	size_t live_objects() const noexcept { return m_live; }
+	[[nodiscard]]
+	const GcStats &stats() const noexcept { return m_stats; }
+};
+}
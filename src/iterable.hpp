@@ -5,20 +5,29 @@
 #include "dictionary.h"
 namespace CL {
 class Iterable : public Dictionary {
-public:
-	Iterable() {
-		std::function has_next_lambda = [this]() {
-			return static_cast<bool>(this->has_next());
-		};
-		std::function next_lambda = [this]() {
-			return static_cast<RuntimeValue>(this->next());
+private:
+	static const MethodTable &iterable_methods() {
+		static const MethodTable table{
+			{"__has_next", {[](Indexable &self, const Args &) -> std::optional<RuntimeValue> {
+				return RuntimeValue(static_cast<Number>(
+					static_cast<Iterable &>(self).has_next()));
+			}, 0}},
+			{"__next", {[](Indexable &self, const Args &) -> std::optional<RuntimeValue> {
+				return static_cast<Iterable &>(self).next();
+			}, 0}},
 		};
-		set_named("__has_next",
-				  CL::make_function(has_next_lambda));
-		set_named("__next", CL::make_function(next_lambda));
+		return table;
+	}
+
+protected:
+	RuntimeValue *method(const RuntimeValue &name) override {
+		if(auto *m = Dictionary::method(name)) {
+			return m;
+		}
+		return iterable_methods().bind(*this, name, m_bound_methods);
 	}
+
+public:
 	virtual bool has_next() const = 0;
 	virtual RuntimeValue next() = 0;
-};
-
-}
+};}
@@ -3,40 +3,43 @@
 #include "exceptions.hpp"
 #include "tokens.hpp"
 
+#include <algorithm>
+#include <array>
+#include <charconv>
 #include <cstdio>
-#include <map>
+#include <limits>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <system_error>
 
 namespace CL {
 class LexerException : public CLException {
 private:
 	static std::string generate_nice_error(std::string_view error_message,
-										   std::string_view source_line,
-										   uint16_t line,
-										   uint16_t column) {
+										   const SourceLocation &location) {
 		std::stringstream stream;
 		stream << "Lexing error " << error_message << " at "
-			   << std::to_string(line) << ":" << std::to_string(column);
-		stream << "\n" << source_line << "\n";
+			   << std::to_string(location.line) << ":"
+			   << std::to_string(location.column);
+		stream << "\n" << location.text << "\n";
 		return stream.str();
 	}
 
 public:
 	LexerException(std::string_view error_message,
-				   std::string_view current_line,
-				   uint64_t line,
-				   uint64_t column)
-		: CLException(generate_nice_error(error_message,
-										  current_line,
-										  line,
-										  column)) {
+				   const SourceLocation &location)
+		: CLException(generate_nice_error(error_message, location)) {
 	}
 };
 
-static std::map<std::string, TokenType>
-	token_map = { // NOLINT(cert-err58-cpp)
+namespace {
+struct Keyword {
+	std::string_view text;
+	TokenType type{TokenType::Identifier};
+};
+
+constexpr Keyword KEYWORDS[] = {
 	{"if", TokenType::If},
 	{"else", TokenType::Else},
 	{"while", TokenType::While},
@@ -48,167 +51,220 @@ static std::map<std::string, TokenType>
 	{"and", TokenType::And},
 	{"or", TokenType::Or},
 	{"function", TokenType::Fun},
-    {"expose", TokenType::Expose},
+	{"expose", TokenType::Expose},
 	{"module", TokenType::Module},
 	{"dict", TokenType::Dict},
 	{"list", TokenType::List},
 };
+constexpr size_t KEYWORD_MIN_LENGTH = 2;
+constexpr size_t KEYWORD_MAX_LENGTH = 8;
+constexpr size_t KEYWORD_SLOTS = 32;
 
-constexpr static std::string_view IGNORE_CHARS = "\n\t ";
+/*
+ * Perfect hash of the keywords: each one lands in its own slot, so a word
+ * is a keyword only if it equals the text in its slot.
+ * Adding a keyword may need new multipliers, the static_assert below tells.
+ */
+constexpr size_t keyword_slot(std::string_view word) noexcept {
+	auto first = static_cast<unsigned char>(word[0]);
+	auto second = static_cast<unsigned char>(word[1]);
+	return (word.size() + first + second * 23) & (KEYWORD_SLOTS - 1);
+}
 
-char Lexer::get_next() {
-	char c = m_source.get();
-	m_current_column++;
-	if(c == '\n') {
-		m_current_line++;
-		m_current_column = 0;
-		update_line_view();
+constexpr std::array<Keyword, KEYWORD_SLOTS> make_keyword_table() noexcept {
+	std::array<Keyword, KEYWORD_SLOTS> table{};
+	for(const auto &keyword : KEYWORDS) {
+		table[keyword_slot(keyword.text)] = keyword;
 	}
-	if (c == -1) {
-	    m_done_lexing = true;
+	return table;
+}
+constexpr auto KEYWORD_TABLE = make_keyword_table();
+
+constexpr bool keywords_hash_perfectly() noexcept {
+	for(const auto &keyword : KEYWORDS) {
+		if(keyword.text.size() < KEYWORD_MIN_LENGTH
+			|| keyword.text.size() > KEYWORD_MAX_LENGTH
+			|| KEYWORD_TABLE[keyword_slot(keyword.text)].text != keyword.text) {
+			return false;
+		}
 	}
-	return c;
+	return true;
 }
+static_assert(keywords_hash_perfectly(), "Two keywords share a slot");
 
-char Lexer::peekc() { return m_source.peek(); }
-void Lexer::prev() {
-	m_current_column--;
-	if(m_source.peek() == '\n') {
-		m_current_line--;
+TokenType keyword_type(std::string_view word) noexcept {
+	if(word.size() < KEYWORD_MIN_LENGTH || word.size() > KEYWORD_MAX_LENGTH) {
+		return TokenType::Identifier;
+	}
+	const auto &keyword = KEYWORD_TABLE[keyword_slot(word)];
+	return keyword.text == word ? keyword.type : TokenType::Identifier;
+}
+
+// The char written by the escape sequence \selector, 0 for unknown ones
+char escaped_char(char selector) noexcept {
+	switch (selector) {
+		case 'n': return '\n';
+		case 'b': return '\b';
+		case 'a': return '\a';
+		case 't': return '\t';
+		case 'f': return '\f';
+		case 'r': return '\r';
+		case 'v': return '\v';
+		case '"': return '"';
+		case '\'': return '\'';
+		case '\\': return '\\';
+		default: return 0;
+	}
+}
+}
+
+constexpr static std::string_view IGNORE_CHARS = "\n\t ";
+
+Lexer::Lexer(std::string_view source)
+	: m_source(source) {
+	if(source.size() >= std::numeric_limits<uint32_t>::max()) {
+		throw CLException("Sources are limited to 4GiB");
+	}
+}
+
+char Lexer::get_next() {
+	if(m_position >= m_source.size()) {
+		// Stepping past the end too, so that prev() can step back
+		m_position++;
+		m_done_lexing = true;
+		return EOF;
 	}
-	m_source.unget();
+	return m_source[m_position++];
+}
+
+char Lexer::peekc() {
+	return m_position < m_source.size() ? m_source[m_position] : EOF;
 }
 
-void Lexer::update_line_view() {
-	m_current_source_line = "";
-	auto pos = m_source.tellg();
-	std::getline(m_source, m_current_source_line);
-	m_source.seekg(pos);
+void Lexer::prev() {
+	m_position--;
 }
 
-template<class... T>
-Token Lexer::make_token(uint64_t column,
-						uint64_t line,
-						const std::string &source,
-						T... params) {
-	return Token(params..., column, line, source);
+Token Lexer::make_token(TokenType type,
+						size_t start,
+						uint32_t symbol) const noexcept {
+	auto end = std::min(m_position, m_source.size());
+	return Token(type,
+				 static_cast<uint32_t>(start),
+				 static_cast<uint32_t>(end - start),
+				 symbol);
 }
 
-Token Lexer::check_for_alternative(char expected, TokenType first,
+Token Lexer::check_for_alternative(size_t start,
+								   char expected,
+								   TokenType first,
 								   TokenType second) {
 	if(peekc() == expected) {
 		get_next();
-		return make_token(m_current_column - 1,
-						  m_current_line,
-						  m_current_source_line,
-						  second);
+		return make_token(second, start);
 	}
-	return make_token(m_current_column,
-					  m_current_line,
-					  m_current_source_line,
-					  first);
+	return make_token(first, start);
 }
-Token Lexer::parse_string(char delim) {
-	auto line = m_current_line;
-	auto column = m_current_column;
-	String s;
+
+Token Lexer::parse_string(size_t start, char delim) {
+	// The text is only checked here, string() reads it back from the span
 	char c = get_next();
 	while (c != delim) {
 		if(c == '\\') {
 			char selector = get_next();
-			switch (selector) {
-				case 'n': c = '\n';
-					break;
-				case 'b': c = '\b';
-					break;
-				case 'a': c = '\a';
-					break;
-				case 't': c = '\t';
-					break;
-				case 'f': c = '\f';
-					break;
-				case 'r': c = '\r';
-					break;
-				case 'v': c = '\v';
-					break;
-				case '"': c = '"';
-					break;
-				case '\'': c = '\'';
-					break;
-				case '\\': c = '\\';
-					break;
-				case 'x':
-				case 'u':
-				case 'U': TODO();
-				default: s += c;
-					c = selector;
-					break;
+			if(selector == 'x' || selector == 'u' || selector == 'U') {
+				TODO();
 			}
 		}
-		s += c;
 		c = get_next();
 		if(is_at_end()) {
 			throw LexerException("Unexpected EOF while parsing string!",
-								 m_current_source_line,
-								 m_current_line,
-								 m_current_column);
+								 location(start));
 		}
 	}
-	return make_token(column,
-					  line,
-					  m_current_source_line,
-					  TokenType::String,
-					  s);
+	return make_token(TokenType::String, start);
 }
 
-Token Lexer::parse_number() {
-	auto line = m_current_line;
-	auto column = m_current_column;
+Token Lexer::parse_number(size_t start) {
 	bool met_dot = false;
-	std::string number_string;
 	char ch = get_next();
 	while ((isdigit(ch) || ch == '.') && !is_at_end()) {
-		number_string += ch;
-		ch = get_next();
 		if(ch == '.') {
-			if(!met_dot) {
-				met_dot = true;
-			} else {
-				throw LexerException("Invalid numeric literal!",
-									 m_current_source_line,
-									 line,
-									 column);
+			if(met_dot) {
+				throw LexerException("Invalid numeric literal!", location(start));
 			}
+			met_dot = true;
 		}
+		ch = get_next();
 	}
 	prev();
-	Number n = std::stod(number_string);
-	return make_token(column, line, m_current_source_line, n);
+	auto token = make_token(TokenType::Number, start);
+	// Checked here so that number() can read the literal back without failing
+	auto digits = text(token);
+	Number n = 0;
+	auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), n);
+	if(error != std::errc()) {
+		throw LexerException("Numeric literal out of range!", location(start));
+	}
+	return token;
 }
 
-Token Lexer::parse_keyword() {
-	auto line = m_current_line;
-	auto column = m_current_column;
-	std::string token_string;
+Token Lexer::parse_keyword(size_t start) {
 	auto ch = get_next();
 	while ((isalpha(ch) || ch == '_' || isdigit(ch) || ch == ':')
 		&& !is_at_end()) {
-		token_string += ch;
 		ch = get_next();
 	}
-
 	prev();
 
-	auto it = token_map.find(token_string);
-	if(it != token_map.end()) {
-		return make_token(column, line, m_current_source_line, it->second);
-	} else {
-		return make_token(column,
-						  line,
-						  m_current_source_line,
-						  TokenType::Identifier,
-						  token_string);
+	auto word = m_source.substr(start, m_position - start);
+	auto type = keyword_type(word);
+	if(type != TokenType::Identifier) {
+		return make_token(type, start);
 	}
+	return make_token(TokenType::Identifier, start, Symbol(word).id());
+}
+
+Number Lexer::number(const Token &token) const noexcept {
+	auto digits = text(token);
+	Number n = 0;
+	std::from_chars(digits.data(), digits.data() + digits.size(), n);
+	return n;
+}
+
+String Lexer::string(const Token &token) const {
+	auto quoted = text(token);
+	auto body = quoted.substr(1, quoted.size() - 2);
+	String s;
+	s.reserve(body.size());
+	for (size_t i = 0; i < body.size(); i++) {
+		if(body[i] != '\\' || i + 1 == body.size()) {
+			s += body[i];
+			continue;
+		}
+		auto selector = body[++i];
+		if(auto c = escaped_char(selector)) {
+			s += c;
+		} else {
+			// Unknown escapes are kept as written
+			s += '\\';
+			s += selector;
+		}
+	}
+	return s;
+}
+
+SourceLocation Lexer::location(size_t offset) const noexcept {
+	offset = std::min(offset, m_source.size());
+	auto before = m_source.substr(0, offset);
+	auto line_start = before.rfind('\n');
+	line_start = line_start == std::string_view::npos ? 0 : line_start + 1;
+	auto line = m_source.substr(line_start);
+	return {
+		static_cast<size_t>(std::count(before.begin(), before.end(), '\n')) + 1,
+		offset - line_start + 1,
+		line.substr(0, line.find('\n'))
+	};
 }
 
 void Lexer::ignore_comment() {
@@ -230,131 +286,84 @@ Token Lexer::try_lex_one() {
 
 	if(ch == EOF) {
 		m_done_lexing = true;
-		return make_token(m_current_column,
-						  m_current_line,
-						  m_current_source_line,
-						  TokenType::Eof);
+		return make_token(TokenType::Eof, m_source.size());
 	}
 
-	auto token_line = m_current_line;
-	auto token_column = m_current_column;
+	auto start = m_position - 1;
 	switch (ch) // NOLINT(hicpp-multiway-paths-covered)
 	{
 		case '+':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Plus);
+			return make_token(TokenType::Plus, start);
 		case '-':
-			return check_for_alternative('>',
+			return check_for_alternative(start,
+										 '>',
 										 TokenType::Minus,
 										 TokenType::Arrow);
 		case '*':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Star);
+			return make_token(TokenType::Star, start);
 		case '/':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Slash);
+			return make_token(TokenType::Slash, start);
 		case '%':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Percent);
+			return make_token(TokenType::Percent, start);
 		case '.':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Dot);
+			return make_token(TokenType::Dot, start);
 		case ',':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Comma);
+			return make_token(TokenType::Comma, start);
 		case '(':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Left_Brace);
+			return make_token(TokenType::Left_Brace, start);
 		case ')':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Right_Brace);
+			return make_token(TokenType::Right_Brace, start);
 		case '{':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Left_Curly_Brace);
+			return make_token(TokenType::Left_Curly_Brace, start);
 		case '}':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Right_Curly_Brace);
+			return make_token(TokenType::Right_Curly_Brace, start);
 		case '[':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Left_Square_Brace);
+			return make_token(TokenType::Left_Square_Brace, start);
 		case ']':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Right_Square_Brace);
+			return make_token(TokenType::Right_Square_Brace, start);
 		case ':':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Double_Dots);
+			return make_token(TokenType::Double_Dots, start);
 		case ';':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Point_Comma);
+			return make_token(TokenType::Point_Comma, start);
 		case '=':
-			return check_for_alternative('=',
+			return check_for_alternative(start,
+										 '=',
 										 TokenType::Assign,
 										 TokenType::Equals);
 		case '!':
-			return check_for_alternative('=',
+			return check_for_alternative(start,
+										 '=',
 										 TokenType::Not,
 										 TokenType::Not_Equals);
 		case '<':
-			return check_for_alternative('=',
+			return check_for_alternative(start,
+										 '=',
 										 TokenType::Less,
 										 TokenType::Less_Or_Equals);
 		case '>':
-			return check_for_alternative('=',
+			return check_for_alternative(start,
+										 '=',
 										 TokenType::Greater,
 										 TokenType::Greater_Or_Equals);
 		case '^':
-			return make_token(m_current_column,
-							  m_current_line,
-							  m_current_source_line,
-							  TokenType::Xor);
+			return make_token(TokenType::Xor, start);
 	}
 
+
 	if(ch == '"' || ch == '\'') {
-		return parse_string(ch);
+		return parse_string(start, ch);
 	}
 	if(isdigit(ch)) {
-		prev();
-		return parse_number();
+		return parse_number(start);
 	}
 	if(isalpha(ch) || ch == '_') {
-		prev();
-		return parse_keyword();
+		return parse_keyword(start);
 	}
 
 	// FAILURE IDENTIFYING TOKEN
-	auto unknown_token = parse_keyword();
-	throw LexerException("Unknown token: " + unknown_token.to_string(),
-						 m_current_source_line,
-						 token_line,
-						 token_column);
+	auto unknown_token = parse_keyword(start);
+	throw LexerException("Unknown token: " + std::string(text(unknown_token)),
+						 location(start));
 }
 
 Token Lexer::next() {
@@ -368,7 +377,7 @@ Token &Lexer::peek() {
 	if(m_parsed_tokens.empty()) {
 		m_parsed_tokens.push(try_lex_one());
 	}
-	return m_parsed_tokens.back();
+	return m_parsed_tokens.front();
 }
 
 [[maybe_unused]] void Lexer::lex_all() {
@@ -1,36 +1,41 @@
 #pragma once
 
 #include "commons.hpp"
+#include "tokens.hpp"
 
-#include <istream>
-#include <list>
 #include <queue>
-#include <sstream>
 #include <string>
+#include <string_view>
 
 namespace CL {
-class Token;
+// Where an offset of the source is, only computed for error messages
+struct SourceLocation {
+	size_t line;
+	size_t column;
+	std::string_view text;
+};
+
 class Lexer {
 
 private:
-	std::istream &m_source;
-	std::string m_current_source_line;
+	// Read in place, tokens are spans of it
+	std::string_view m_source;
+	size_t m_position{0};
 
 	std::queue<Token> m_parsed_tokens;
-	uint64_t m_current_column{0};
-	uint64_t m_current_line{1};
 	bool m_done_lexing = false;
 
-	Token parse_number();
-	Token parse_string(char delimiter);
-	Token parse_keyword();
+	Token parse_number(size_t start);
+	Token parse_string(size_t start, char delimiter);
+	Token parse_keyword(size_t start);
 
-	template<class... T>
-	Token make_token(uint64_t column,
-					 uint64_t line,
-					 const std::string &source,
-					 T... params);
-	Token check_for_alternative(char expected,
+	// The token from start to the current position
+	[[nodiscard]]
+	Token make_token(TokenType type,
+					 size_t start,
+					 uint32_t symbol = Token::NO_SYMBOL) const noexcept;
+	Token check_for_alternative(size_t start,
+								char expected,
 								TokenType first,
 								TokenType second);
 
@@ -38,18 +43,32 @@ private:
 	char get_next();
 	char peekc();
 	void prev();
-	void update_line_view();
 	void ignore_comment();
 
 public:
-	explicit Lexer(std::istream &stream)
-		: m_source(stream) {
-		update_line_view();
-	}
+	// Throws a CLException when the source doesn't fit 32-bit offsets
+	explicit Lexer(std::string_view source);
 
 	Token next();
 	Token &peek();
 
+	[[nodiscard]]
+	std::string_view text(const Token &token) const noexcept {
+		return m_source.substr(token.get_offset(), token.get_length());
+	}
+	// Only valid for the tokens of type Number
+	[[nodiscard]]
+	Number number(const Token &token) const noexcept;
+	// Only valid for the tokens of type String, with the escapes replaced
+	[[nodiscard]]
+	String string(const Token &token) const;
+	[[nodiscard]]
+	SourceLocation location(size_t offset) const noexcept;
+	[[nodiscard]]
+	SourceLocation location(const Token &token) const noexcept {
+		return location(token.get_offset());
+	}
+
 	[[maybe_unused]] [[maybe_unused]]
 	void lex_all();
 	[[nodiscard]]
@@ -4,18 +4,37 @@
 #include <istream>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "ast_evaluator.hpp"
 #include "commons.hpp"
 #include "environment.hpp"
 #include "exceptions.hpp"
+#include "gc.hpp"
+#include "slab.hpp"
 #include "std_lib.hpp"
 #include "script.h"
 
-void run_script(const std::string &script_path,
-				std::shared_ptr<CL::StackedEnvironment> env) {
-	auto script = CL::Script::from_file(script_path, env);
-	script.run();
+bool run_script(const std::string &script_path,
+				CL::RuntimeEnvPtr env,
+				CL::Engine engine,
+				CL::OptimizationLevel level,
+				bool memoize,
+				size_t max_depth,
+				bool stream) {
+	try {
+		if(stream) {
+			CL::Script::stream_file(script_path, env, level, memoize, engine, max_depth);
+			return true;
+		}
+		auto script = CL::Script::from_file(script_path, env, level, memoize);
+		script.run(engine, max_depth);
+	} catch (CL::CLException &ex) {
+		std::cerr << "Error: " << ex.get_message() << "\n";
+		return false;
+	}
+	return true;
 }
 
 std::string read_from_console() {
@@ -38,13 +57,17 @@ std::string read_from_console() {
 	return content;
 }
 
-void run_from_cli(const CL::RuntimeEnvPtr &env) {
+void run_from_cli(const CL::RuntimeEnvPtr &env,
+				  CL::Engine engine,
+				  CL::OptimizationLevel level,
+				  bool memoize,
+				  size_t max_depth) {
 	while (true) {
 		try {
 			auto source = read_from_console();
-			auto script = CL::Script::from_source(source, env);
-			auto result = script.run();
-			if(result.has_value()) {
+			auto script = CL::Script::from_source(source, env, level, memoize);
+			auto result = script.run(engine, max_depth);
+			if(result.has_value() && !result->is<std::monostate>()) {
 				std::cout << result.value().to_string() << "\n";
 			}
 		} catch (CL::CLException &ex) {
@@ -53,16 +76,94 @@ void run_from_cli(const CL::RuntimeEnvPtr &env) {
 	}
 }
 
+void print_gc_stats() {
+	const auto &stats = CL::Collector::instance().stats();
+	std::cerr << "GC: " << stats.collections << " collections, "
+			  << stats.freed_objects << " objects freed, "
+			  << stats.total_pause.count() / 1000 << "us paused, "
+			  << CL::Collector::instance().live_objects() << " objects live\n";
+}
+
+void print_heap_stats() {
+	const auto &slabs = CL::SlabAllocator::instance();
+	std::cerr << "Heap: " << slabs.reserved_bytes() / 1024 << "KiB in slabs\n";
+	for (const auto &size_class : slabs.stats()) {
+		std::cerr << "  " << size_class.slot_size << " bytes: "
+				  << size_class.in_use << "/" << size_class.slots << " slots used\n";
+	}
+}
+
 int main(int argc, char **argv) {
-	auto env = std::make_shared<CL::StackedEnvironment>();
+	auto env = CL::make_ref<CL::StackedEnvironment>();
 	CL::inject_import_function(env);
 	CL::inject_math_functions(env);
 	CL::inject_stdlib_functions(env);
-	if(argc == 1) {
-		run_from_cli(env);
+
+	constexpr std::string_view ENGINE_FLAG = "--engine=";
+	constexpr std::string_view MAX_DEPTH_FLAG = "--max-depth=";
+	auto engine = CL::Engine::VM;
+	auto level = CL::OptimizationLevel::O1;
+	auto memoize = false;
+	auto gc_stats = false;
+	auto heap_stats = false;
+	auto stream = false;
+	auto max_depth = CL::DEFAULT_MAX_CALL_DEPTH;
+	std::vector<std::string> scripts;
+	for (int i = 1; i < argc; i++) {
+		std::string_view arg = argv[i];
+		if(arg.substr(0, ENGINE_FLAG.size()) == ENGINE_FLAG) {
+			auto name = arg.substr(ENGINE_FLAG.size());
+			if(name == "vm") {
+				engine = CL::Engine::VM;
+			} else if(name == "ast") {
+				engine = CL::Engine::AST;
+			} else if(name == "flat") {
+				engine = CL::Engine::Flat;
+			} else {
+				std::cerr << "Unknown engine " << name
+						  << ", expected vm, ast or flat\n";
+				return 1;
+			}
+		} else if(arg.substr(0, MAX_DEPTH_FLAG.size()) == MAX_DEPTH_FLAG) {
+			auto depth = std::string(arg.substr(MAX_DEPTH_FLAG.size()));
+			try {
+				max_depth = std::stoul(depth);
+			} catch (std::exception &) {
+				std::cerr << "Invalid maximum call depth " << depth << "\n";
+				return 1;
+			}
+		} else if(arg == "-O0") {
+			level = CL::OptimizationLevel::O0;
+		} else if(arg == "-O1") {
+			level = CL::OptimizationLevel::O1;
+		} else if(arg == "-O2") {
+			level = CL::OptimizationLevel::O2;
+		} else if(arg == "-Omemo") {
+			memoize = true;
+		} else if(arg == "--gc-stats") {
+			gc_stats = true;
+		} else if(arg == "--heap-stats") {
+			heap_stats = true;
+		} else if(arg == "--stream") {
+			stream = true;
+		} else {
+			scripts.emplace_back(arg);
+		}
+	}
+
+	if(scripts.empty()) {
+		run_from_cli(env, engine, level, memoize, max_depth);
 	} else
-		for (int i = 1; i < argc; i++) {
-			run_script(argv[i], env);
+		for (const auto &script : scripts) {
+			if(!run_script(script, env, engine, level, memoize, max_depth, stream)) {
+				return 1;
+			}
 		}
+	if(gc_stats) {
+		print_gc_stats();
+	}
+	if(heap_stats) {
+		print_heap_stats();
+	}
 	return 0;
 }
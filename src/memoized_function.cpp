@@ -0,0 +1,63 @@
+#include "memoized_function.hpp"
+
+#include <cmath>
+
+namespace CL {
+namespace {
+bool is_cacheable(const RuntimeValue &value) {
+	if(value.is<Number>()) {
+		// -0 equals 0 but can produce a different result (1 / -0)
+		auto n = value.as<Number>();
+		return !std::isnan(n) && !(n == 0 && std::signbit(n));
+	}
+	return value.is<String>() || value.is<bool>()
+		|| value.is<std::monostate>();
+}
+}
+
+size_t MemoizedFunction::ArgsHash::operator()(const Args &args) const noexcept {
+	size_t seed = args.size();
+	for (const auto &arg : args) {
+		seed ^= arg.hash() + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+	}
+	return seed;
+}
+
+const MemoizedFunction::Result *MemoizedFunction::lookup(const Args &args) {
+	auto it = m_index.find(args);
+	if(it == m_index.end()) {
+		return nullptr;
+	}
+	m_entries.splice(m_entries.begin(), m_entries, it->second);
+	return &it->second->second;
+}
+
+void MemoizedFunction::store(const Args &args, const Result &result) {
+	if(m_capacity == 0 || (result && !is_cacheable(*result))) {
+		return;
+	}
+	for (const auto &arg : args) {
+		if(!is_cacheable(arg)) {
+			return;
+		}
+	}
+	if(m_index.count(args) > 0) {
+		return;
+	}
+	if(m_entries.size() == m_capacity) {
+		m_index.erase(m_entries.back().first);
+		m_entries.pop_back();
+	}
+	m_entries.emplace_front(args, result);
+	m_index.emplace(args, m_entries.begin());
+}
+
+std::optional<RuntimeValue> MemoizedFunction::call(const Args &args) {
+	if(auto cached = lookup(args)) {
+		return *cached;
+	}
+	auto result = m_function->call(args);
+	store(args, result);
+	return result;
+}
+}
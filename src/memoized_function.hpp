@@ -0,0 +1,63 @@
+#pragma once
+
+#include "commons.hpp"
+#include "value.hpp"
+
+#include <list>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+namespace CL {
+constexpr size_t DEFAULT_MEMO_CAPACITY = 4096;
+
+/*
+ * Wraps a function the optimizer proved pure and caches its results,
+ * keyed on the argument values. Only calls whose arguments and result
+ * are numbers, strings, booleans or nil are cached, since containers and
+ * callables are compared by identity and can change between calls.
+ * The cache evicts the least recently used entry past its capacity.
+ */
+class MemoizedFunction : public Callable {
+private:
+	using Result = std::optional<RuntimeValue>;
+	using Entry = std::pair<Args, Result>;
+	struct ArgsHash {
+		size_t operator()(const Args &args) const noexcept;
+	};
+
+	CallablePtr m_function;
+	size_t m_capacity;
+	std::list<Entry> m_entries;
+	std::unordered_map<Args, std::list<Entry>::iterator, ArgsHash> m_index;
+
+public:
+	explicit MemoizedFunction(CallablePtr function,
+							  size_t capacity = DEFAULT_MEMO_CAPACITY)
+		: m_function(std::move(function)), m_capacity(capacity) {
+	}
+
+	[[nodiscard]]
+	const CallablePtr &function() const noexcept { return m_function; }
+
+	// The cached result of a call, or nullptr when it isn't cached
+	const Result *lookup(const Args &args);
+	void store(const Args &args, const Result &result);
+
+	void visit_references(GcVisitor &visitor) const override {
+		visitor.visit(m_function);
+	}
+	void clear_references() override { m_function.reset(); }
+
+	std::optional<RuntimeValue> call(const Args &args) override;
+	uint8_t arity() override { return m_function->arity(); }
+	[[nodiscard]]
+	std::string to_string() const noexcept override {
+		return m_function->to_string();
+	}
+	[[nodiscard]]
+	std::string string_repr() const noexcept override {
+		return m_function->string_repr();
+	}
+};
+}
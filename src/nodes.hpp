@@ -3,6 +3,7 @@
 #include "commons.hpp"
 #include "value.hpp"
 
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <utility>
@@ -10,10 +11,51 @@
 #include <variant>
 #include <vector>
 namespace CL {
+/*
+ * Filled in by the Resolver: locals live in the slot arrays of the
+ * enclosing SlotEnvironments, everything else is looked up by name.
+ */
+struct Slot {
+	static constexpr uint32_t DYNAMIC = UINT32_MAX;
+	uint32_t depth{0};
+	uint32_t index{DYNAMIC};
+
+	[[nodiscard]]
+	bool is_local() const noexcept { return index != DYNAMIC; }
+};
+
+/*
+ * The size of the slot array of a block or function call. Blocks that
+ * declare no locals are left at 0 by the Resolver, which doesn't count
+ * them in the depth of slots, and get no slot array at runtime.
+ * A scope is captured when a function is defined inside of it, closing
+ * over its slots; the slots of the other ones can't outlive them, so
+ * engines can keep them on a stack of their own.
+ */
+struct ScopeLayout {
+	uint32_t size{0};
+	bool captured{false};
+};
+
+/*
+ * Operand types seen by a binary expression under the tree-walking
+ * evaluator. A site specializes on the first operands it sees and falls
+ * back to Generic for good once a guard fails.
+ */
+struct TypeFeedback {
+	enum class State : uint8_t {
+		Uninitialized,
+		Numbers,
+		Strings,
+		Generic,
+	};
+	State state{State::Uninitialized};
+};
+
 class Evaluator {
 public:
 	virtual void visit_number_expression(Number n) = 0;
-	virtual void visit_string_expression(String s) = 0;
+	virtual void visit_string_expression(const RuntimeValue &s) = 0;
 	virtual void visit_dict_expression(const std::vector<std::pair<ExprPtr,
 																   ExprPtr>> &) = 0;
 	virtual void visit_list_expression(const ExprList &) = 0;
@@ -23,14 +65,25 @@ public:
 									 const ExprPtr &right) = 0;
 	virtual void visit_binary_expression(const ExprPtr &left,
 										 BinaryOp op,
-										 const ExprPtr &right) = 0;
+										 const ExprPtr &right,
+										 TypeFeedback &feedback) = 0;
 	virtual void visit_unary_expression(UnaryOp op, const ExprPtr &expr) = 0;
-	virtual void visit_var_expression(const std::string &var) = 0;
-	virtual void visit_assign_expression(const std::string &name,
+	virtual void visit_var_expression(const Symbol &var, Slot &slot) = 0;
+	virtual void visit_assign_expression(const Symbol &name,
+										 Slot &slot,
 										 const ExprPtr &value) = 0;
-	virtual void visit_fun_call(const ExprPtr &fun, const ExprList &args) = 0;
-	virtual void visit_fun_def_statement(const String& name, const Names &names, const StatementPtr &body) = 0;
-	virtual void visit_block_statement(const StatementList &block) = 0;
+	virtual void visit_fun_call(const ExprPtr &fun,
+								const ExprList &args,
+								bool tail_call) = 0;
+	virtual void visit_fun_def_statement(const Symbol &name,
+										 Slot &slot,
+										 const Names &names,
+										 ScopeLayout &layout,
+										 const StatementPtr &body,
+										 bool memoized) = 0;
+	virtual void visit_expression_statement(const ExprPtr &expr) = 0;
+	virtual void visit_block_statement(const StatementList &block,
+									   ScopeLayout &layout) = 0;
 	virtual void visit_return_expression(const ExprPtr &expr) = 0;
 	virtual void visit_break_expression() = 0;
 	virtual void visit_continue_expression() = 0;
@@ -39,7 +92,8 @@ public:
                                     const StatementPtr &else_branch) = 0;
 	virtual void visit_while_statement(const ExprPtr &cond,
                                        const StatementPtr &body) = 0;
-	virtual void visit_for_statement(const std::string &name,
+	virtual void visit_for_statement(const Symbol &name,
+									 Slot &slot,
                                      const ExprPtr &iterator,
                                      const StatementPtr &body) = 0;
 	virtual void visit_set_expression(const ExprPtr &obj,
@@ -73,12 +127,13 @@ public:
 	}
 };
 
+// The string is made when parsing, so that every evaluation shares it
 class StringExpression : public Expression {
 private:
-	String m_str;
+	RuntimeValue m_str;
 
 public:
-	explicit StringExpression(String s) noexcept
+	explicit StringExpression(RuntimeValue s) noexcept
 		: m_str(std::move(s)) {
 	}
 	void evaluate(Evaluator &evaluator) const override {
@@ -146,6 +201,7 @@ class BinaryExpression : public Expression {
 	ExprPtr m_left;
 	ExprPtr m_right;
 	BinaryOp m_op;
+	mutable TypeFeedback m_feedback;
 
 public:
 	explicit BinaryExpression(ExprPtr left, BinaryOp op, ExprPtr right) noexcept
@@ -154,7 +210,8 @@ public:
 	void evaluate(Evaluator &evaluator) const override {
 		evaluator.visit_binary_expression(m_left,
 										  m_op,
-										  m_right);
+										  m_right,
+										  m_feedback);
 	}
 };
 
@@ -173,28 +230,33 @@ public:
 
 class VarExpression : public Expression {
 private:
-	std::string m_name;
+	Symbol m_name;
+	mutable Slot m_slot;
 
 public:
-	explicit VarExpression(std::string name) noexcept
-		: m_name(std::move(name)) {
+	explicit VarExpression(Symbol name) noexcept
+		: m_name(name) {
 	}
+	[[nodiscard]]
+	const Symbol &name() const noexcept { return m_name; }
 	void evaluate(Evaluator &evaluator) const override {
-		evaluator.visit_var_expression(m_name);
+		evaluator.visit_var_expression(m_name, m_slot);
 	}
 };
 
 class AssignExpression : public Expression {
 private:
-	std::string m_name;
+	Symbol m_name;
+	mutable Slot m_slot;
 	ExprPtr m_val;
 
 public:
-	explicit AssignExpression(std::string name, ExprPtr val) noexcept
-		: m_name(std::move(name)), m_val(std::move(val)) {
+	explicit AssignExpression(Symbol name, ExprPtr val) noexcept
+		: m_name(name), m_val(std::move(val)) {
 	}
 	void evaluate(Evaluator &evaluator) const override {
 		evaluator.visit_assign_expression(m_name,
+										  m_slot,
 										  m_val);
 	}
 };
@@ -203,14 +265,18 @@ class FunCallExpression : public Expression {
     private:
         ExprPtr m_expr;
         const ExprList m_args;
+        bool m_tail_call{false};
 
     public:
         explicit FunCallExpression(ExprPtr expr, ExprList args) noexcept
                 : m_expr(std::move(expr)), m_args(std::move(args)) {
         }
+        // Set by the Resolver on calls whose value a function body returns
+        void mark_tail_call() noexcept { m_tail_call = true; }
         void evaluate(Evaluator &evaluator) const override {
             evaluator.visit_fun_call(m_expr,
-                                     m_args);
+                                     m_args,
+                                     m_tail_call);
         }
     };
 
@@ -264,6 +330,10 @@ public:
 	GetExpression(ExprPtr obj, ExprPtr name)
 		: m_obj(std::move(obj)), m_name(std::move(name)) {
 	}
+	[[nodiscard]]
+	ExprPtr object() const noexcept { return m_obj; }
+	[[nodiscard]]
+	ExprPtr key() const noexcept { return m_name; }
 	void evaluate(Evaluator &evaluator) const override {
 		evaluator.visit_get_expression(m_obj,
 									   m_name);
@@ -293,7 +363,7 @@ public:
         : expr(std::move(in_expr)) {}
 
     void execute(Evaluator& evaluator) const override {
-        expr->evaluate(evaluator);
+        evaluator.visit_expression_statement(expr);
     }
 };
 
@@ -334,18 +404,20 @@ public:
 
 class ForStatement : public Statement {
 private:
-    std::string m_name;
+    Symbol m_name;
+    mutable Slot m_slot;
     ExprPtr m_iterable;
     StatementPtr m_body;
 
 public:
-    explicit ForStatement(std::string name, ExprPtr iterable, StatementPtr body)
-            : m_name(std::move(name)),
+    explicit ForStatement(Symbol name, ExprPtr iterable, StatementPtr body)
+            : m_name(name),
               m_iterable(std::move(iterable)),
               m_body(std::move(body)) {
     }
     void execute(Evaluator &evaluator) const override {
         evaluator.visit_for_statement(m_name,
+                                      m_slot,
                                       m_iterable,
                                       m_body);
     }
@@ -354,31 +426,50 @@ public:
 
 class FunDefStatement : public Statement {
 private:
-    String m_name;
+    Symbol m_name;
+    mutable Slot m_slot;
     Names m_args;
+    mutable ScopeLayout m_layout;
     const StatementPtr m_body;
+    bool m_memoized;
 
 public:
-    explicit FunDefStatement(String name, Names arg_names, StatementPtr body)
-            : m_name(std::move(name)), m_args(std::move(arg_names)),m_body(std::move(body)) {
+    explicit FunDefStatement(Symbol name,
+                             Names arg_names,
+                             StatementPtr body,
+                             bool memoized = false)
+            : m_name(name), m_args(std::move(arg_names)),m_body(std::move(body)),
+              m_memoized(memoized) {
     }
+    [[nodiscard]]
+    const Symbol &name() const noexcept { return m_name; }
+    [[nodiscard]]
+    const Names &params() const noexcept { return m_args; }
+    [[nodiscard]]
+    StatementPtr body() const noexcept { return m_body; }
+    // Set by the optimizer on functions whose results can be cached
+    void mark_memoized() noexcept { m_memoized = true; }
     void execute(Evaluator &evaluator) const override {
         evaluator.visit_fun_def_statement(m_name,
+                                          m_slot,
                                           m_args,
-                                          m_body);
+                                          m_layout,
+                                          m_body,
+                                          m_memoized);
     }
 };
 
 class BlockStatement : public Statement {
 private:
     StatementList m_body;
+    mutable ScopeLayout m_layout;
 
 public:
     explicit BlockStatement(StatementList body)
             : m_body(std::move(body)) {
     }
     void execute(Evaluator &evaluator) const override {
-        evaluator.visit_block_statement(m_body);
+        evaluator.visit_block_statement(m_body, m_layout);
     }
 };
 
@@ -0,0 +1,748 @@
+#include "optimizer.hpp"
+#include "environment.hpp"
+#include "exceptions.hpp"
+
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace CL {
+void TreeWalker::walk(const ExprPtr &expr) {
+	if(expr) {
+		expr->evaluate(*this);
+	}
+}
+
+void TreeWalker::walk(const StatementPtr &statement) {
+	if(statement) {
+		statement->execute(*this);
+	}
+}
+
+void TreeWalker::visit_number_expression(Number) {
+}
+
+void TreeWalker::visit_string_expression(const RuntimeValue &) {
+}
+
+void TreeWalker::visit_dict_expression(const std::vector<std::pair<ExprPtr,
+																   ExprPtr>> &exprs) {
+	for (const auto &e : exprs) {
+		walk(e.first);
+		walk(e.second);
+	}
+}
+
+void TreeWalker::visit_list_expression(const ExprList &exprs) {
+	for (const auto &e : exprs) {
+		walk(e);
+	}
+}
+
+void TreeWalker::visit_and_expression(const ExprPtr &left,
+									  const ExprPtr &right) {
+	walk(left);
+	walk(right);
+}
+
+void TreeWalker::visit_or_expression(const ExprPtr &left,
+									 const ExprPtr &right) {
+	walk(left);
+	walk(right);
+}
+
+void TreeWalker::visit_binary_expression(const ExprPtr &left,
+										 BinaryOp,
+										 const ExprPtr &right,
+										 TypeFeedback &) {
+	walk(left);
+	walk(right);
+}
+
+void TreeWalker::visit_unary_expression(UnaryOp, const ExprPtr &expr) {
+	walk(expr);
+}
+
+void TreeWalker::visit_var_expression(const Symbol &, Slot &) {
+}
+
+void TreeWalker::visit_assign_expression(const Symbol &,
+										 Slot &,
+										 const ExprPtr &value) {
+	walk(value);
+}
+
+void TreeWalker::visit_fun_call(const ExprPtr &fun,
+								const ExprList &args,
+								bool tail_call) {
+	walk(fun);
+	for (const auto &arg : args) {
+		walk(arg);
+	}
+}
+
+void TreeWalker::visit_fun_def_statement(const Symbol &,
+										 Slot &,
+										 const Names &,
+										 ScopeLayout &,
+										 const StatementPtr &body,
+										 bool) {
+	walk(body);
+}
+
+void TreeWalker::visit_expression_statement(const ExprPtr &expr) {
+	walk(expr);
+}
+
+void TreeWalker::visit_block_statement(const StatementList &block,
+									   ScopeLayout &) {
+	for (const auto &statement : block) {
+		walk(statement);
+	}
+}
+
+void TreeWalker::visit_return_expression(const ExprPtr &expr) {
+	walk(expr);
+}
+
+void TreeWalker::visit_break_expression() {
+}
+
+void TreeWalker::visit_continue_expression() {
+}
+
+void TreeWalker::visit_if_statement(const ExprPtr &cond,
+									const StatementPtr &if_branch,
+									const StatementPtr &else_branch) {
+	walk(cond);
+	walk(if_branch);
+	walk(else_branch);
+}
+
+void TreeWalker::visit_while_statement(const ExprPtr &cond,
+									   const StatementPtr &body) {
+	walk(cond);
+	walk(body);
+}
+
+void TreeWalker::visit_for_statement(const Symbol &,
+									 Slot &,
+									 const ExprPtr &iterable,
+									 const StatementPtr &body) {
+	walk(iterable);
+	walk(body);
+}
+
+void TreeWalker::visit_set_expression(const ExprPtr &obj,
+									  const ExprPtr &name,
+									  const ExprPtr &val) {
+	walk(obj);
+	walk(name);
+	walk(val);
+}
+
+void TreeWalker::visit_get_expression(const ExprPtr &obj, const ExprPtr &name) {
+	walk(obj);
+	walk(name);
+}
+
+void TreeWalker::visit_module_definition(const ExprList &list) {
+	for (const auto &expr : list) {
+		walk(expr);
+	}
+}
+
+ExprPtr TreeRebuilder::rebuild(const ExprPtr &expr) {
+	if(!expr) {
+		return nullptr;
+	}
+	expr->evaluate(*this);
+	return m_expr;
+}
+
+StatementPtr TreeRebuilder::rebuild(const StatementPtr &statement) {
+	if(!statement) {
+		return nullptr;
+	}
+	statement->execute(*this);
+	return m_statement;
+}
+
+ExprList TreeRebuilder::rebuild(const ExprList &exprs) {
+	ExprList result;
+	result.reserve(exprs.size());
+	for (const auto &expr : exprs) {
+		result.push_back(rebuild(expr));
+	}
+	return result;
+}
+
+StatementList TreeRebuilder::rebuild(const StatementList &statements) {
+	StatementList result;
+	result.reserve(statements.size());
+	for (const auto &statement : statements) {
+		result.push_back(rebuild(statement));
+	}
+	return result;
+}
+
+void TreeRebuilder::visit_number_expression(Number n) {
+	m_expr = m_arena.make<NumberExpression>(n);
+}
+
+void TreeRebuilder::visit_string_expression(const RuntimeValue &s) {
+	m_expr = m_arena.make<StringExpression>(s);
+}
+
+void TreeRebuilder::visit_dict_expression(const std::vector<std::pair<ExprPtr,
+																	  ExprPtr>> &exprs) {
+	std::vector<std::pair<ExprPtr, ExprPtr>> pairs;
+	pairs.reserve(exprs.size());
+	for (const auto &e : exprs) {
+		auto key = rebuild(e.first);
+		pairs.emplace_back(key, rebuild(e.second));
+	}
+	m_expr = m_arena.make<DictExpression>(std::move(pairs));
+}
+
+void TreeRebuilder::visit_list_expression(const ExprList &exprs) {
+	m_expr = m_arena.make<ListExpression>(rebuild(exprs));
+}
+
+void TreeRebuilder::visit_and_expression(const ExprPtr &left,
+										 const ExprPtr &right) {
+	auto l = rebuild(left);
+	m_expr = m_arena.make<AndExpression>(l, rebuild(right));
+}
+
+void TreeRebuilder::visit_or_expression(const ExprPtr &left,
+										const ExprPtr &right) {
+	auto l = rebuild(left);
+	m_expr = m_arena.make<OrExpression>(l, rebuild(right));
+}
+
+void TreeRebuilder::visit_binary_expression(const ExprPtr &left,
+											BinaryOp op,
+											const ExprPtr &right,
+											TypeFeedback &feedback) {
+	auto l = rebuild(left);
+	m_expr = m_arena.make<BinaryExpression>(l, op, rebuild(right));
+}
+
+void TreeRebuilder::visit_unary_expression(UnaryOp op, const ExprPtr &expr) {
+	m_expr = m_arena.make<UnaryExpression>(rebuild(expr), op);
+}
+
+void TreeRebuilder::visit_var_expression(const Symbol &var, Slot &) {
+	m_expr = m_arena.make<VarExpression>(var);
+}
+
+void TreeRebuilder::visit_assign_expression(const Symbol &name,
+											Slot &,
+											const ExprPtr &value) {
+	m_expr = m_arena.make<AssignExpression>(name, rebuild(value));
+}
+
+void TreeRebuilder::visit_fun_call(const ExprPtr &fun,
+								   const ExprList &args,
+								   bool tail_call) {
+	auto f = rebuild(fun);
+	m_expr = m_arena.make<FunCallExpression>(f, rebuild(args));
+}
+
+void TreeRebuilder::visit_fun_def_statement(const Symbol &name,
+											Slot &,
+											const Names &names,
+											ScopeLayout &,
+											const StatementPtr &body,
+											bool memoized) {
+	m_statement = m_arena.make<FunDefStatement>(name,
+												names,
+												rebuild(body),
+												memoized);
+}
+
+void TreeRebuilder::visit_expression_statement(const ExprPtr &expr) {
+	m_statement = m_arena.make<ExpressionStatement>(rebuild(expr));
+}
+
+void TreeRebuilder::visit_block_statement(const StatementList &block,
+										  ScopeLayout &) {
+	m_statement = m_arena.make<BlockStatement>(rebuild(block));
+}
+
+void TreeRebuilder::visit_return_expression(const ExprPtr &expr) {
+	m_expr = m_arena.make<ReturnExpression>(rebuild(expr));
+}
+
+void TreeRebuilder::visit_break_expression() {
+	m_expr = m_arena.make<BreakExpression>();
+}
+
+void TreeRebuilder::visit_continue_expression() {
+	m_expr = m_arena.make<ContinueExpression>();
+}
+
+void TreeRebuilder::visit_if_statement(const ExprPtr &cond,
+									   const StatementPtr &if_branch,
+									   const StatementPtr &else_branch) {
+	auto c = rebuild(cond);
+	auto i = rebuild(if_branch);
+	m_statement = m_arena.make<IfStatement>(c, i, rebuild(else_branch));
+}
+
+void TreeRebuilder::visit_while_statement(const ExprPtr &cond,
+										  const StatementPtr &body) {
+	auto c = rebuild(cond);
+	m_statement = m_arena.make<WhileStatement>(c, rebuild(body));
+}
+
+void TreeRebuilder::visit_for_statement(const Symbol &name,
+										Slot &,
+										const ExprPtr &iterable,
+										const StatementPtr &body) {
+	auto i = rebuild(iterable);
+	m_statement = m_arena.make<ForStatement>(name, i, rebuild(body));
+}
+
+void TreeRebuilder::visit_set_expression(const ExprPtr &obj,
+										 const ExprPtr &name,
+										 const ExprPtr &val) {
+	auto o = rebuild(obj);
+	auto n = rebuild(name);
+	m_expr = m_arena.make<SetExpression>(o, n, rebuild(val));
+}
+
+void TreeRebuilder::visit_get_expression(const ExprPtr &obj,
+										 const ExprPtr &name) {
+	auto o = rebuild(obj);
+	m_expr = m_arena.make<GetExpression>(o, rebuild(name));
+}
+
+void TreeRebuilder::visit_module_definition(const ExprList &list) {
+	m_expr = m_arena.make<ModuleExpression>(rebuild(list));
+}
+
+namespace {
+/*
+ * Collects the names a script binds anywhere, and the names whose
+ * value is used other than by reading a literal key from it.
+ */
+class BindingAnalysis : public TreeWalker {
+private:
+	bool m_in_get_object{false};
+
+public:
+	std::unordered_set<std::string> bound;
+	std::unordered_set<std::string> escaping;
+
+	void run(const StatementList &statements) {
+		for (const auto &statement : statements) {
+			walk(statement);
+		}
+	}
+
+	void visit_var_expression(const Symbol &var, Slot &) override {
+		if(!m_in_get_object) {
+			escaping.insert(var);
+		}
+	}
+	void visit_assign_expression(const Symbol &name,
+								 Slot &slot,
+								 const ExprPtr &value) override {
+		bound.insert(name);
+		TreeWalker::visit_assign_expression(name, slot, value);
+	}
+	void visit_fun_def_statement(const Symbol &name,
+								 Slot &slot,
+								 const Names &names,
+								 ScopeLayout &layout,
+								 const StatementPtr &body,
+								 bool memoized) override {
+		bound.insert(name);
+		bound.insert(names.begin(), names.end());
+		TreeWalker::visit_fun_def_statement(name,
+											slot,
+											names,
+											layout,
+											body,
+											memoized);
+	}
+	void visit_for_statement(const Symbol &name,
+							 Slot &slot,
+							 const ExprPtr &iterable,
+							 const StatementPtr &body) override {
+		bound.insert(name);
+		TreeWalker::visit_for_statement(name, slot, iterable, body);
+	}
+	void visit_fun_call(const ExprPtr &fun,
+						const ExprList &args,
+						bool tail_call) override {
+		// The methods of a container, like append, may change it
+		if(const auto *get = dynamic_cast<GetExpression *>(fun)) {
+			if(const auto *var = dynamic_cast<VarExpression *>(get->object())) {
+				escaping.insert(var->name());
+			}
+		}
+		TreeWalker::visit_fun_call(fun, args, tail_call);
+	}
+	void visit_get_expression(const ExprPtr &obj, const ExprPtr &name) override {
+		// Only the variable read right away is kept from escaping, names
+		// used deeper in the object expression, like call arguments, escape
+		m_in_get_object = dynamic_cast<VarExpression *>(obj) != nullptr
+						  && dynamic_cast<StringExpression *>(name) != nullptr;
+		walk(obj);
+		m_in_get_object = false;
+		walk(name);
+	}
+};
+
+class ConstantFolder : public TreeRebuilder {
+private:
+	const RuntimeEnvPtr &m_env;
+	const BindingAnalysis &m_analysis;
+	bool m_propagate_members;
+	// The value of the last literal built, valid while m_expr is that literal
+	RuntimeValue m_constant;
+	ExprPtr m_constant_expr{nullptr};
+
+	void set_constant(const RuntimeValue &value) {
+		if(value.is<Number>()) {
+			m_expr = m_arena.make<NumberExpression>(value.as<Number>());
+		} else {
+			m_expr = m_arena.make<StringExpression>(value);
+		}
+		m_constant = value;
+		m_constant_expr = m_expr;
+	}
+
+	std::optional<RuntimeValue> constant_of(const ExprPtr &expr) {
+		if(rebuild(expr) != nullptr && m_expr == m_constant_expr) {
+			return m_constant;
+		}
+		return std::nullopt;
+	}
+
+	[[nodiscard]]
+	bool is_literal(const RuntimeValue &value) const {
+		return value.is<Number>() || value.is<String>();
+	}
+
+	[[nodiscard]]
+	bool is_propagable(const std::string &name) const {
+		return m_analysis.bound.find(name) == m_analysis.bound.end()
+			&& m_env->is_const(name);
+	}
+
+	static RuntimeValue fold(const RuntimeValue &left,
+							 BinaryOp op,
+							 const RuntimeValue &right) {
+		switch (op) {
+			case BinaryOp::Addition: return RuntimeValue(left) + right;
+			case BinaryOp::Subtraction: return left - right;
+			case BinaryOp::Multiplication: return left * right;
+			case BinaryOp::Division: return left / right;
+			case BinaryOp::Exponentiation: return left.to_power_of(right);
+			case BinaryOp::Modulo: return left.modulo(right);
+			default: return RuntimeValue();
+		}
+	}
+
+public:
+	ConstantFolder(AstArena &arena,
+				   const RuntimeEnvPtr &env,
+				   const BindingAnalysis &analysis,
+				   bool propagate_members)
+		: TreeRebuilder(arena),
+		  m_env(env),
+		  m_analysis(analysis),
+		  m_propagate_members(propagate_members) {
+	}
+
+	StatementList run(const StatementList &statements) {
+		return rebuild(statements);
+	}
+
+	void visit_number_expression(Number n) override {
+		set_constant(RuntimeValue(n));
+	}
+	void visit_string_expression(const RuntimeValue &s) override {
+		set_constant(RuntimeValue(s));
+	}
+
+	void visit_binary_expression(const ExprPtr &left,
+								 BinaryOp op,
+								 const ExprPtr &right,
+								 TypeFeedback &feedback) override {
+		auto l = constant_of(left);
+		auto left_expr = m_expr;
+		auto r = constant_of(right);
+		auto right_expr = m_expr;
+		if(l && r) {
+			try {
+				auto value = fold(*l, op, *r);
+				if(is_literal(value)) {
+					set_constant(value);
+					return;
+				}
+			} catch (const CLException &) {
+				// Left for the engine to report when it runs
+			}
+		}
+		m_expr = m_arena.make<BinaryExpression>(left_expr, op, right_expr);
+	}
+
+	void visit_unary_expression(UnaryOp op, const ExprPtr &expr) override {
+		auto value = constant_of(expr);
+		if(value && value->is<Number>()) {
+			if(op == UnaryOp::Negation) {
+				value->negate();
+			}
+			set_constant(*value);
+			return;
+		}
+		m_expr = m_arena.make<UnaryExpression>(m_expr, op);
+	}
+
+	void visit_var_expression(const Symbol &var, Slot &slot) override {
+		if(is_propagable(var)) {
+			const auto &value = m_env->get(var);
+			if(is_literal(value)) {
+				set_constant(value);
+				return;
+			}
+		}
+		TreeRebuilder::visit_var_expression(var, slot);
+	}
+
+	void visit_get_expression(const ExprPtr &obj, const ExprPtr &name) override {
+		auto *var = dynamic_cast<VarExpression *>(obj);
+		auto key = constant_of(name);
+		auto name_expr = m_expr;
+		if(m_propagate_members && var && key) {
+			const auto &var_name = var->name();
+			if(is_propagable(var_name)
+				&& m_analysis.escaping.find(var_name) == m_analysis.escaping.end()) {
+				try {
+					auto value = m_env->get(var_name).get_property(*key);
+					if(is_literal(value)) {
+						set_constant(value);
+						return;
+					}
+				} catch (const CLException &) {
+					// Missing keys are reported at run time
+				}
+			}
+		}
+		m_expr = m_arena.make<GetExpression>(rebuild(obj), name_expr);
+	}
+};
+}
+
+namespace {
+// Counts the bindings of every name a script makes, parameters included
+class BindingCounter : public TreeWalker {
+public:
+	std::unordered_map<std::string, size_t> counts;
+
+	void run(const StatementList &statements) {
+		for (const auto &statement : statements) {
+			walk(statement);
+		}
+	}
+
+	void visit_assign_expression(const Symbol &name,
+								 Slot &slot,
+								 const ExprPtr &value) override {
+		counts[name]++;
+		TreeWalker::visit_assign_expression(name, slot, value);
+	}
+	void visit_fun_def_statement(const Symbol &name,
+								 Slot &slot,
+								 const Names &names,
+								 ScopeLayout &layout,
+								 const StatementPtr &body,
+								 bool memoized) override {
+		counts[name]++;
+		for (const auto &param : names) {
+			counts[param]++;
+		}
+		TreeWalker::visit_fun_def_statement(name,
+											slot,
+											names,
+											layout,
+											body,
+											memoized);
+	}
+	void visit_for_statement(const Symbol &name,
+							 Slot &slot,
+							 const ExprPtr &iterable,
+							 const StatementPtr &body) override {
+		counts[name]++;
+		TreeWalker::visit_for_statement(name, slot, iterable, body);
+	}
+};
+
+class PurityChecker : public TreeWalker {
+private:
+	const std::unordered_set<std::string> &m_pure_functions;
+	const std::function<bool(const std::string &)> &m_is_const_global;
+	bool m_pure{true};
+
+	[[nodiscard]]
+	bool is_pure_global(const std::string &name) const {
+		return m_pure_functions.count(name) > 0 || m_is_const_global(name);
+	}
+
+public:
+	PurityChecker(const std::unordered_set<std::string> &pure_functions,
+				  const std::function<bool(const std::string &)> &is_const_global)
+		: m_pure_functions(pure_functions), m_is_const_global(is_const_global) {
+	}
+
+	bool check(const StatementPtr &body) {
+		walk(body);
+		return m_pure;
+	}
+
+	void visit_var_expression(const Symbol &var, Slot &slot) override {
+		m_pure &= slot.is_local() || is_pure_global(var);
+	}
+	void visit_assign_expression(const Symbol &name,
+								 Slot &slot,
+								 const ExprPtr &value) override {
+		m_pure &= slot.is_local();
+		TreeWalker::visit_assign_expression(name, slot, value);
+	}
+	void visit_for_statement(const Symbol &name,
+							 Slot &slot,
+							 const ExprPtr &iterable,
+							 const StatementPtr &body) override {
+		m_pure &= slot.is_local();
+		TreeWalker::visit_for_statement(name, slot, iterable, body);
+	}
+	void visit_fun_call(const ExprPtr &fun,
+						const ExprList &args,
+						bool tail_call) override {
+		if(auto *var = dynamic_cast<VarExpression *>(fun)) {
+			m_pure &= m_pure_functions.count(var->name()) > 0;
+		} else if(auto *get = dynamic_cast<GetExpression *>(fun)) {
+			auto *obj = dynamic_cast<VarExpression *>(get->object());
+			m_pure &= obj != nullptr && m_is_const_global(obj->name());
+			walk(get->key());
+		} else {
+			m_pure = false;
+		}
+		for (const auto &arg : args) {
+			walk(arg);
+		}
+	}
+	void visit_fun_def_statement(const Symbol &,
+								 Slot &,
+								 const Names &,
+								 ScopeLayout &,
+								 const StatementPtr &,
+								 bool) override {
+		m_pure = false;
+	}
+	void visit_set_expression(const ExprPtr &,
+							  const ExprPtr &,
+							  const ExprPtr &) override {
+		m_pure = false;
+	}
+	void visit_module_definition(const ExprList &) override {
+		m_pure = false;
+	}
+};
+
+bool is_bound_in(const RuntimeEnvPtr &env, const std::string &name) {
+	for (auto scope = env; scope != nullptr; scope = scope->parent()) {
+		if(scope->is_bound(name)) {
+			return true;
+		}
+	}
+	return false;
+}
+}
+
+void PurityAnalysis::run(const StatementList &statements) {
+	BindingCounter bindings;
+	bindings.run(statements);
+	BindingAnalysis uses;
+	uses.run(statements);
+	// A container stays the same only if the script can't reach it other
+	// than by reading its members, and no statement left to see can
+	std::function<bool(const std::string &)> is_const_global =
+		[&](const std::string &name) {
+			if(m_env == nullptr || bindings.counts.count(name) > 0
+				|| !m_env->is_const(name)) {
+				return false;
+			}
+			if(!m_env->get(name).is<IndexablePtr>()) {
+				return true;
+			}
+			return m_whole_script && uses.escaping.count(name) == 0;
+		};
+
+	// Start from every function whose name the script binds once, and drop
+	// the impure ones until the remaining ones only call each other
+	std::unordered_map<std::string, FunDefStatement *> candidates;
+	for (const auto &statement : statements) {
+		auto *function = dynamic_cast<FunDefStatement *>(statement);
+		if(function == nullptr || bindings.counts[function->name()] != 1
+			|| (m_env != nullptr && is_bound_in(m_env, function->name()))) {
+			continue;
+		}
+		candidates[function->name()] = function;
+	}
+	std::unordered_set<std::string> pure_functions;
+	for (const auto &candidate : candidates) {
+		pure_functions.insert(candidate.first);
+	}
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (const auto &candidate : candidates) {
+			if(pure_functions.count(candidate.first) == 0) {
+				continue;
+			}
+			PurityChecker checker(pure_functions, is_const_global);
+			if(!checker.check(candidate.second->body())) {
+				pure_functions.erase(candidate.first);
+				changed = true;
+			}
+		}
+	}
+	for (const auto &name : pure_functions) {
+		candidates[name]->mark_memoized();
+	}
+}
+
+StatementList ConstantFolding::run(const StatementList &statements,
+								   AstArena &arena) {
+	BindingAnalysis analysis;
+	analysis.run(statements);
+	return ConstantFolder(arena, m_env, analysis, m_propagate_members)
+		.run(statements);
+}
+
+PassManager::PassManager(OptimizationLevel level, const RuntimeEnvPtr &env) {
+	if(level == OptimizationLevel::O0) {
+		return;
+	}
+	add_pass(std::make_unique<ConstantFolding>(env,
+											   level == OptimizationLevel::O2));
+}
+
+void PassManager::add_pass(std::unique_ptr<OptimizationPass> pass) {
+	m_passes.push_back(std::move(pass));
+}
+
+StatementList PassManager::run(StatementList statements, AstArena &arena) {
+	for (const auto &pass : m_passes) {
+		statements = pass->run(statements, arena);
+	}
+	return statements;
+}
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include "ast_arena.hpp"
+#include "commons.hpp"
+#include "nodes.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace CL {
+/*
+ * Visits every node of a tree without doing anything, analyses override the
+ * visits they care about and call back into the walker for the children.
+ */
+class TreeWalker : public Evaluator {
+protected:
+	void walk(const ExprPtr &expr);
+	void walk(const StatementPtr &statement);
+
+	void visit_number_expression(Number n) override;
+	void visit_string_expression(const RuntimeValue &s) override;
+	void visit_dict_expression(const std::vector<std::pair<ExprPtr,
+														   ExprPtr>> &) override;
+	void visit_list_expression(const ExprList &) override;
+
+	void visit_and_expression(const ExprPtr &left,
+							  const ExprPtr &right) override;
+	void visit_or_expression(const ExprPtr &left,
+							 const ExprPtr &right) override;
+	void visit_binary_expression(const ExprPtr &left,
+								 BinaryOp op,
+								 const ExprPtr &right,
+								 TypeFeedback &feedback) override;
+
+	void visit_unary_expression(UnaryOp op, const ExprPtr &expr) override;
+
+	void visit_var_expression(const Symbol &var, Slot &slot) override;
+	void visit_assign_expression(const Symbol &name,
+								 Slot &slot,
+								 const ExprPtr &value) override;
+	void visit_fun_call(const ExprPtr &fun,
+						const ExprList &args,
+						bool tail_call) override;
+	void visit_fun_def_statement(const Symbol &name,
+								 Slot &slot,
+								 const Names &names,
+								 ScopeLayout &layout,
+								 const StatementPtr &body,
+								 bool memoized) override;
+	void visit_expression_statement(const ExprPtr &expr) override;
+	void visit_block_statement(const StatementList &block,
+							   ScopeLayout &layout) override;
+	void visit_return_expression(const ExprPtr &expr) override;
+	void visit_break_expression() override;
+	void visit_continue_expression() override;
+	void visit_if_statement(const ExprPtr &cond,
+							const StatementPtr &expr,
+							const StatementPtr &else_branch) override;
+	void visit_while_statement(const ExprPtr &cond,
+							   const StatementPtr &body) override;
+	void visit_for_statement(const Symbol &name,
+							 Slot &slot,
+							 const ExprPtr &iterable,
+							 const StatementPtr &body) override;
+	void visit_set_expression(const ExprPtr &obj,
+							  const ExprPtr &name,
+							  const ExprPtr &val) override;
+	void visit_get_expression(const ExprPtr &obj, const ExprPtr &name) override;
+	void visit_module_definition(const ExprList &list) override;
+};
+
+/*
+ * Rebuilds a tree node by node in an arena. Every visit stores the rebuilt
+ * node in m_expr or m_statement; a pass overrides the visits of the nodes
+ * it rewrites and keeps the copying behaviour for the others.
+ */
+class TreeRebuilder : public Evaluator {
+protected:
+	AstArena &m_arena;
+	ExprPtr m_expr{nullptr};
+	StatementPtr m_statement{nullptr};
+
+	ExprPtr rebuild(const ExprPtr &expr);
+	StatementPtr rebuild(const StatementPtr &statement);
+	ExprList rebuild(const ExprList &exprs);
+	StatementList rebuild(const StatementList &statements);
+
+	void visit_number_expression(Number n) override;
+	void visit_string_expression(const RuntimeValue &s) override;
+	void visit_dict_expression(const std::vector<std::pair<ExprPtr,
+														   ExprPtr>> &) override;
+	void visit_list_expression(const ExprList &) override;
+
+	void visit_and_expression(const ExprPtr &left,
+							  const ExprPtr &right) override;
+	void visit_or_expression(const ExprPtr &left,
+							 const ExprPtr &right) override;
+	void visit_binary_expression(const ExprPtr &left,
+								 BinaryOp op,
+								 const ExprPtr &right,
+								 TypeFeedback &feedback) override;
+
+	void visit_unary_expression(UnaryOp op, const ExprPtr &expr) override;
+
+	void visit_var_expression(const Symbol &var, Slot &slot) override;
+	void visit_assign_expression(const Symbol &name,
+								 Slot &slot,
+								 const ExprPtr &value) override;
+	void visit_fun_call(const ExprPtr &fun,
+						const ExprList &args,
+						bool tail_call) override;
+	void visit_fun_def_statement(const Symbol &name,
+								 Slot &slot,
+								 const Names &names,
+								 ScopeLayout &layout,
+								 const StatementPtr &body,
+								 bool memoized) override;
+	void visit_expression_statement(const ExprPtr &expr) override;
+	void visit_block_statement(const StatementList &block,
+							   ScopeLayout &layout) override;
+	void visit_return_expression(const ExprPtr &expr) override;
+	void visit_break_expression() override;
+	void visit_continue_expression() override;
+	void visit_if_statement(const ExprPtr &cond,
+							const StatementPtr &expr,
+							const StatementPtr &else_branch) override;
+	void visit_while_statement(const ExprPtr &cond,
+							   const StatementPtr &body) override;
+	void visit_for_statement(const Symbol &name,
+							 Slot &slot,
+							 const ExprPtr &iterable,
+							 const StatementPtr &body) override;
+	void visit_set_expression(const ExprPtr &obj,
+							  const ExprPtr &name,
+							  const ExprPtr &val) override;
+	void visit_get_expression(const ExprPtr &obj, const ExprPtr &name) override;
+	void visit_module_definition(const ExprList &list) override;
+
+public:
+	explicit TreeRebuilder(AstArena &arena)
+		: m_arena(arena) {
+	}
+};
+
+class OptimizationPass {
+public:
+	virtual ~OptimizationPass() = default;
+	virtual StatementList run(const StatementList &statements,
+							  AstArena &arena) = 0;
+};
+
+/*
+ * Folds arithmetic between number and string literals, and replaces reads
+ * of const globals holding a number or a string with their value.
+ * Globals are only propagated when the script never binds a name
+ * like theirs, so that no local or module member can shadow them.
+ * With propagate_members, reads of literal keys from a const global
+ * container (Math.PI) are propagated as well, assuming that nothing
+ * modifies the container behind the script's back.
+ */
+class ConstantFolding : public OptimizationPass {
+private:
+	RuntimeEnvPtr m_env;
+	bool m_propagate_members;
+
+public:
+	ConstantFolding(RuntimeEnvPtr env, bool propagate_members)
+		: m_env(std::move(env)), m_propagate_members(propagate_members) {
+	}
+
+	StatementList run(const StatementList &statements,
+					  AstArena &arena) override;
+};
+
+/*
+ * Marks the functions defined at the top level of a script whose result
+ * only depends on their arguments, for the engines to memoize them.
+ * Such a function only assigns its own locals, only reads them, const
+ * globals and other pure functions, and only calls pure functions and
+ * members of const globals (Math.sin). It sets no properties and defines
+ * no functions or modules, so nothing outlives a call.
+ * It runs on resolved trees, whose slots tell locals from globals, and
+ * like member propagation it assumes that nothing modifies const globals
+ * behind the script's back.
+ * A const container only counts when the script does nothing but read its
+ * members, so that it can't set them. Without whole_script, when the
+ * statements are only part of a script, containers never count.
+ */
+class PurityAnalysis {
+private:
+	RuntimeEnvPtr m_env;
+	bool m_whole_script;
+
+public:
+	explicit PurityAnalysis(RuntimeEnvPtr env, bool whole_script = true)
+		: m_env(std::move(env)), m_whole_script(whole_script) {
+	}
+
+	void run(const StatementList &statements);
+};
+
+/*
+ * Runs the passes enabled by an optimization level, in order, between
+ * parsing and resolving a script.
+ */
+class PassManager {
+private:
+	std::vector<std::unique_ptr<OptimizationPass>> m_passes;
+
+public:
+	PassManager(OptimizationLevel level, const RuntimeEnvPtr &env);
+
+	void add_pass(std::unique_ptr<OptimizationPass> pass);
+	StatementList run(StatementList statements, AstArena &arena);
+};
+}
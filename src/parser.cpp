@@ -3,6 +3,7 @@
 #include "exceptions.hpp"
 #include "nodes.hpp"
 #include "tokens.hpp"
+#include <array>
 #include <memory>
 #include <sstream>
 #include <utility>
@@ -39,19 +40,73 @@ UnaryOp token_type_to_unary_opcode(TokenType type) {
 	NOT_REACHED();
 }
 
+namespace {
+struct InfixOperator {
+	uint8_t power{0};
+	bool right_associative{false};
+};
+
+constexpr size_t TOKEN_TYPES = static_cast<size_t>(TokenType::Expose) + 1;
+
+/*
+ * How tightly each token binds as an infix operator, 0 when it is not one.
+ * The levels are the ones of the grammar, from "and" up to "^".
+ */
+constexpr std::array<InfixOperator, TOKEN_TYPES> make_infix_operators() noexcept {
+	std::array<InfixOperator, TOKEN_TYPES> table{};
+	auto set = [&table](TokenType type, uint8_t power, bool right = false) {
+		table[static_cast<size_t>(type)] = {power, right};
+	};
+	set(TokenType::And, 1);
+	set(TokenType::Or, 2);
+	set(TokenType::Equals, 3);
+	set(TokenType::Not_Equals, 3);
+	set(TokenType::Less, 4);
+	set(TokenType::Less_Or_Equals, 4);
+	set(TokenType::Greater, 4);
+	set(TokenType::Greater_Or_Equals, 4);
+	set(TokenType::Plus, 5);
+	set(TokenType::Minus, 5);
+	set(TokenType::Star, 6);
+	set(TokenType::Slash, 6);
+	set(TokenType::Percent, 6);
+	set(TokenType::Xor, 7, true);
+	return table;
+}
+constexpr auto INFIX_OPERATORS = make_infix_operators();
+constexpr uint8_t LOWEST_POWER = 1;
+// Unary operators take exponentiations, but nothing looser
+constexpr uint8_t PREFIX_POWER = 7;
+
+// Counts how deep the parsing functions recursed
+class NestingGuard {
+private:
+	size_t &m_depth;
+
+public:
+	explicit NestingGuard(size_t &depth) noexcept
+		: m_depth(depth) {
+		m_depth++;
+	}
+	~NestingGuard() { m_depth--; }
+	NestingGuard(const NestingGuard &) = delete;
+	NestingGuard &operator=(const NestingGuard &) = delete;
+};
+}
+
 class ParsingException : public CLException {
 private:
 	Token m_error_token;
 
 public:
 	ParsingException(Token error_token, std::string_view error_message)
-		: m_error_token(std::move(std::move(error_token))),
+		: m_error_token(error_token),
 		  CLException(std::string(error_message)) {
 	}
 };
 
-Parser::Parser(Lexer lexer)
-	: m_lexer(std::move(lexer)), m_current_token(0) {
+Parser::Parser(Lexer lexer, AstArena &arena)
+	: m_lexer(std::move(lexer)), m_arena(&arena) {
 }
 
 template<typename T, typename... Tokens>
@@ -93,47 +148,55 @@ Token Parser::next() {
 }
 
 Token &Parser::peek() {
-	if(m_current_token == m_parsed_tokens.size()) {
-		auto token = m_lexer.next();
-		m_parsed_tokens.push_back(token);
+	if(m_current_token == m_lexed_tokens) {
+		m_tokens[m_lexed_tokens++ % TOKEN_WINDOW] = m_lexer.next();
 	}
-	return m_parsed_tokens[m_current_token];
+	return m_tokens[m_current_token % TOKEN_WINDOW];
 }
 
 Token Parser::previous() {
 	if(m_current_token == 0) {
 		throw_exception("No tokens have been parsed yet in the stream",
-						Token(TokenType::Eof, 0, 0, "<Empty stream so far>"));
+						Token(TokenType::Eof, 0, 0));
 	}
 
-	return m_parsed_tokens[m_current_token - 1];
+	return m_tokens[(m_current_token - 1) % TOKEN_WINDOW];
 }
 
-void Parser::throw_exception(const std::string &why, const Token &cause) {
+void Parser::throw_exception(const std::string &why, const Token &cause) const {
+	auto location = m_lexer.location(cause);
 	std::stringstream stream;
-	stream << "Syntax error at " << cause.get_line() << ":"
-		   << cause.get_column() - 1 << ":\n";
+	stream << "Syntax error at " << location.line << ":"
+		   << location.column - 1 << ":\n";
 	stream << "\t" << why << "\n";
 	std::string dashes = std::string(
-		cause.get_source_line().size() > cause.get_column() ?
-		cause.get_source_line().size() : cause.get_column(), '-');
-	dashes[cause.get_column() - 1] = '^';
-	stream << "│ " << cause.get_source_line() << "\n";
+		location.text.size() > location.column ?
+		location.text.size() : location.column, '-');
+	dashes[location.column - 1] = '^';
+	stream << "│ " << location.text << "\n";
 	stream << "└>" << dashes << "\n";
 	throw ParsingException(cause, stream.str());
 }
 
 StatementList Parser::parse_all() {
 	auto list = StatementList();
-	while (!m_lexer.is_at_end()
-		&& m_lexer.peek().get_type() != TokenType::Eof) {
-		auto next_statement = statement();
-		list.push_back(std::move(next_statement));
+	while (auto next_statement = parse_next(*m_arena)) {
+		list.push_back(next_statement);
 	}
 	return list;
 }
 
+StatementPtr Parser::parse_next(AstArena &arena) {
+	m_arena = &arena;
+	if(peek().get_type() == TokenType::Eof) {
+		return nullptr;
+	}
+	return statement();
+}
+
 StatementPtr Parser::statement() {
+    NestingGuard guard(m_depth);
+    check_depth();
     if (match(TokenType::Left_Curly_Brace)) {
         return block_statement();
     } else if (match(TokenType::While)) {
@@ -145,7 +208,7 @@ StatementPtr Parser::statement() {
     } else if(match(TokenType::Fun)) {
         return fun_statement();
     }
-    return std::make_unique<ExpressionStatement>(expression());
+    return m_arena->make<ExpressionStatement>(expression());
 }
 
 ExprPtr Parser::expression() {
@@ -154,11 +217,11 @@ ExprPtr Parser::expression() {
     } else if(match(TokenType::Module)) {
         return module_expression();
     } else if(match(TokenType::Continue)) {
-		return std::make_shared<ContinueExpression>();
+		return m_arena->make<ContinueExpression>();
 	} else if(match(TokenType::Break)) {
-		return std::make_shared<BreakExpression>();
+		return m_arena->make<BreakExpression>();
 	}
-	return and_expr();
+	return binary(LOWEST_POWER);
 }
 
 StatementPtr Parser::if_statement() {
@@ -168,7 +231,7 @@ StatementPtr Parser::if_statement() {
 	if(match(TokenType::Else)) {
 		else_block = statement();
 	}
-	return std::make_unique<IfStatement>(std::move(cond),
+	return m_arena->make<IfStatement>(std::move(cond),
 										  std::move(body),
 										  std::move(else_block));
 }
@@ -180,23 +243,23 @@ ExprPtr Parser::module_expression() {
 	while (!match(TokenType::Right_Curly_Brace)) {
 		list.push_back(expression());
 	}
-	return std::make_unique<ModuleExpression>(list);
+	return m_arena->make<ModuleExpression>(list);
 }
 
 StatementPtr Parser::while_statement() {
 	auto cond = expression();
 	auto body = statement();
-	return std::make_unique<WhileStatement>(cond, body);
+	return m_arena->make<WhileStatement>(cond, body);
 }
 
 StatementPtr Parser::for_statement() {
 	auto name = consume("For expressions start with an identifier",
-						TokenType::Identifier).get<String>();
+						TokenType::Identifier).get_symbol();
 	consume("For expressions must have an \"in\" after the identifier",
 			TokenType::In);
 	auto iterator = expression();
 	auto body = statement();
-	return std::make_unique<ForStatement>(name, iterator, body);
+	return m_arena->make<ForStatement>(name, iterator, body);
 }
 
 StatementPtr Parser::block_statement() {
@@ -204,7 +267,7 @@ StatementPtr Parser::block_statement() {
 	while (!match(TokenType::Right_Curly_Brace)) {
 		list.push_back(statement());
 	}
-	return std::make_unique<BlockStatement>(std::move(list));
+	return m_arena->make<BlockStatement>(std::move(list));
 }
 
 Names Parser::arg_names() {
@@ -214,7 +277,7 @@ Names Parser::arg_names() {
 		do {
 			auto tok = consume("Arguments can only be identifiers",
 							   TokenType::Identifier);
-			args.push_back(tok.get<std::string>());
+			args.push_back(tok.get_symbol().str());
 			match(TokenType::Comma);
 		} while (!match(TokenType::Right_Brace));
 	}
@@ -223,119 +286,53 @@ Names Parser::arg_names() {
 
 ExprPtr Parser::return_expression() {
 	if(match_expression_begin()) {
-		return std::make_unique<ReturnExpression>(expression());
-	}
-	return std::make_unique<ReturnExpression>(nullptr);
-}
-
-ExprPtr Parser::and_expr() {
-	auto left_expr = or_expr();
-	while (match(TokenType::And)) {
-		auto right = or_expr();
-		left_expr = std::make_unique<AndExpression>(std::move(left_expr),
-													std::move(right));
-	}
-	return left_expr;
-}
-
-ExprPtr Parser::or_expr() {
-	auto left_expr = equality_expression();
-	while (match(TokenType::Or)) {
-		auto right = equality_expression();
-		left_expr = std::make_unique<OrExpression>(std::move(left_expr),
-												   std::move(right));
-	}
-	return left_expr;
-}
-
-ExprPtr Parser::equality_expression() {
-	auto left_expr = comparison();
-	while (match(TokenType::Not_Equals, TokenType::Equals)) {
-		auto type = previous().get_type();
-		auto right = comparison();
-		left_expr = std::make_unique<BinaryExpression>(std::move(left_expr),
-													   token_type_to_binary_opcode(
-														   type),
-													   std::move(right));
-	}
-	return left_expr;
-}
-
-ExprPtr Parser::comparison() {
-	auto left_expr = shift();
-	while (match(TokenType::Less_Or_Equals,
-				 TokenType::Greater_Or_Equals,
-				 TokenType::Less,
-				 TokenType::Greater)) {
-		auto type = previous().get_type();
-		auto right = shift();
-		left_expr = std::make_unique<BinaryExpression>(std::move(left_expr),
-													   (token_type_to_binary_opcode(
-														   type)),
-													   std::move(right));
-	}
-	return left_expr;
-}
-
-ExprPtr Parser::shift() {
-	auto left_expr = sum();
-	while (match(TokenType::Right_Shift, TokenType::Left_Shift)) {
-		auto type = previous().get_type();
-		auto right = sum();
-		left_expr = std::make_unique<BinaryExpression>(std::move(left_expr),
-													   (token_type_to_binary_opcode(
-														   type)),
-													   std::move(right));
+		return m_arena->make<ReturnExpression>(expression());
 	}
-	return left_expr;
+	return m_arena->make<ReturnExpression>(nullptr);
 }
 
-ExprPtr Parser::sum() {
-	auto left_expr = multiplication();
-	while (match(TokenType::Plus, TokenType::Minus)) {
-		auto type = previous().get_type();
-		auto right = multiplication();
-		left_expr = std::make_unique<BinaryExpression>(std::move(left_expr),
-													   token_type_to_binary_opcode(
-														   type),
-													   std::move(right));
+void Parser::check_depth() {
+	if(m_depth > MAX_PARSE_DEPTH) {
+		throw_exception("Too many nested expressions or blocks", peek());
 	}
-	return left_expr;
 }
 
-ExprPtr Parser::multiplication() {
-	auto left_expr = unary();
-	while (match(TokenType::Star, TokenType::Slash, TokenType::Percent)) {
-		auto type = previous().get_type();
-		auto right = unary();
-		left_expr = std::make_unique<BinaryExpression>(std::move(left_expr),
-													   (token_type_to_binary_opcode(
-														   type)),
-													   std::move(right));
+ExprPtr Parser::binary(uint8_t min_power) {
+	NestingGuard guard(m_depth);
+	check_depth();
+	auto left = prefix();
+	while (true) {
+		auto type = peek().get_type();
+		auto op = INFIX_OPERATORS[static_cast<size_t>(type)];
+		if(op.power == 0 || op.power < min_power) {
+			return left;
+		}
+		next();
+		auto right = binary(op.right_associative ? op.power : op.power + 1);
+		if(type == TokenType::And) {
+			left = m_arena->make<AndExpression>(left, right);
+		} else if(type == TokenType::Or) {
+			left = m_arena->make<OrExpression>(left, right);
+		} else if(type == TokenType::Xor) {
+			left = m_arena->make<BinaryExpression>(left,
+												  BinaryOp::Exponentiation,
+												  right);
+		} else {
+			left = m_arena->make<BinaryExpression>(left,
+												  token_type_to_binary_opcode(type),
+												  right);
+		}
 	}
-	return left_expr;
 }
 
-ExprPtr Parser::unary() {
-	while (match(TokenType::Plus, TokenType::Minus, TokenType::Not)) {
+ExprPtr Parser::prefix() {
+	if(match(TokenType::Plus, TokenType::Minus, TokenType::Not)) {
 		auto type = previous().get_type();
-		auto expr = unary();
-		return std::make_unique<UnaryExpression>(std::move(expr),
-												 token_type_to_unary_opcode(type));
-	}
-	auto left_expr = exponentiation();
-	return left_expr;
-}
-
-ExprPtr Parser::exponentiation() {
-	auto left = assign();
-	while (match(TokenType::Xor)) {
-		auto exponent = unary();
-		left = std::make_unique<BinaryExpression>(std::move(left),
-												  BinaryOp::Exponentiation,
-												  std::move(exponent));
+		auto expr = binary(PREFIX_POWER);
+		return m_arena->make<UnaryExpression>(expr,
+											 token_type_to_unary_opcode(type));
 	}
-	return left;
+	return assign();
 }
 
 ExprPtr Parser::assign() {
@@ -350,14 +347,19 @@ ExprPtr Parser::assign() {
 			} else {
 				auto next =
 					consume("Named indexing expressions expect an identifier",
-							TokenType::Identifier).get<std::string>();
-				what = std::make_unique<StringExpression>(next);
+							TokenType::Identifier).get_symbol();
+				what = m_arena->make<StringExpression>(next);
 			}
 			if(match(TokenType::Assign)) {
 				expr =
-					std::make_unique<SetExpression>(expr, what, expression());
+					m_arena->make<SetExpression>(expr, what, expression());
 			} else {
-				expr = std::make_unique<GetExpression>(expr, what);
+				expr = m_arena->make<GetExpression>(expr, what);
+				// Methods are called right away, as in list.append(x)
+				while (match(TokenType::Left_Brace)) {
+					expr = m_arena->make<FunCallExpression>(std::move(expr),
+															get_arguments());
+				}
 			}
 		} while (match(TokenType::Dot, TokenType::Left_Square_Brace));
 		return expr;
@@ -368,9 +370,9 @@ ExprPtr Parser::assign() {
 		if(p.get_type() != TokenType::Identifier) {
 			throw_exception("Invalid assign target!", p);
 		}
-		auto id = previous().get<String>();
+		auto id = previous().get_symbol();
 		next();
-		expr = std::make_unique<AssignExpression>(id, std::move(expression()));
+		expr = m_arena->make<AssignExpression>(id, std::move(expression()));
 	}
 	return expr;
 }
@@ -381,7 +383,7 @@ ExprPtr Parser::call() {
     while (match(TokenType::Left_Brace)) {
         ExprList args = get_arguments();
 
-        left = std::make_unique<FunCallExpression>(
+        left = m_arena->make<FunCallExpression>(
                 std::move(left),
                 std::move(args));
     }
@@ -400,12 +402,12 @@ ExprList Parser::get_arguments() {
 ExprPtr Parser::literal() {
 	auto next_token = peek();
 	if(match(TokenType::Number)) {
-		return std::make_unique<NumberExpression>(next_token.get<Number>());
+		return m_arena->make<NumberExpression>(m_lexer.number(next_token));
 	} else if(match(TokenType::String)) {
-		return std::make_unique<StringExpression>(next_token.get<String>());
+		return m_arena->make<StringExpression>(m_lexer.string(next_token));
 	} else if(match(TokenType::Identifier)) {
-		auto name = next_token.get<std::string>();
-		return std::make_unique<VarExpression>(name);
+		auto name = next_token.get_symbol();
+		return m_arena->make<VarExpression>(name);
 	} else if(match(TokenType::Left_Brace)) {
 		auto expr = expression();
 		consume("Grouping expressions must end with a )",
@@ -430,10 +432,10 @@ StatementPtr Parser::fun_statement() {
         throw ParsingException(peek(), "Functions can only be defined in the global scope");
 
     auto function_name = consume("Functions are followed by an identifier", TokenType::Identifier)
-            .get<String>();
+            .get_symbol();
 	auto names = arg_names();
 	auto body = statement();
-	return std::make_unique<FunDefStatement>(function_name, names, std::move(body));
+	return m_arena->make<FunDefStatement>(function_name, names, std::move(body));
 }
 
 ExprPtr Parser::dict_expression() {
@@ -448,7 +450,7 @@ ExprPtr Parser::dict_expression() {
 		expressions.emplace_back(l, r);
 	}
 
-	return std::make_unique<DictExpression>(expressions);
+	return m_arena->make<DictExpression>(expressions);
 }
 
 ExprPtr Parser::list_expression() {
@@ -460,7 +462,7 @@ ExprPtr Parser::list_expression() {
 		match(TokenType::Comma);
 	}
 
-	return std::make_unique<ListExpression>(expressions);
+	return m_arena->make<ListExpression>(expressions);
 }
 
 bool Parser::match_expression_begin() {
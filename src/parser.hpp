@@ -1,7 +1,8 @@
 #pragma once
 
-#include <deque>
+#include <array>
 
+#include "ast_arena.hpp"
 #include "commons.hpp"
 #include "lexer.hpp"
 #include "nodes.hpp"
@@ -21,16 +22,16 @@ FUN_DEF := IDENTIFIER "(" ARGS ")"  "=" EXPRESSION
 ARGS := [ IDENTIFIER ]*
 RETURN := RETURN [EXPRESSION]
 
-BINARY := AND ["and" AND]*
-AND := OR ["or" OR]*
-OR := EQUALITY ["||" EQUALITY]
-EQUALITY:=  COMPARISON [ ("!= " | "==" ) COMPARISON]* 
-COMPARISON := MODULO [("<" | "<=" | ">" | ">=") MODULO]*
-MODULO := SUM ["%" SUM]*
-SUM := MULTIPLICATION [  "-" | "+"  ) MULTIPLICATION] *
-MULTIPLICATION := UNARY [("*" | "/") UNARY]*
-UNARY := ("+" |"-" | "!") UNARY | EXPONENTIATION
-EXPONENTIATION = ASSIGN ["^" ASSIGN]*
+BINARY := UNARY [ INFIX_OP UNARY ]*
+UNARY := ("+" |"-" | "!") UNARY | ASSIGN
+INFIX_OP, from the loosest to the tightest:
+	"and"
+	"or"
+	"==" "!="
+	"<" "<=" ">" ">="
+	"+" "-"
+	"*" "/" "%"
+	"^" (right associative, binds tighter than the unary operators)
 ASSIGN := CALL ["=" EXPRESSION]
 CALL := LITERAL ["( [ CALL_ARGS ] )"]
 LITERAL := NUMBER | IDENTIFIER  | "(" EXPRESSION ")"
@@ -38,15 +39,22 @@ CALL_ARGS := EXPRESSION | EXPRESSION "," CALL_ARGS
 */
 
 namespace CL {
+// Deeper nesting is reported as a syntax error instead of overflowing the stack
+constexpr size_t MAX_PARSE_DEPTH = 256;
 
 class Parser {
 private:
 
     int lexical_scope = 0;
 
-	std::vector<Token> m_parsed_tokens;
-	size_t m_current_token;
+	// The parser looks one token ahead and one behind, older ones are dropped
+	static constexpr size_t TOKEN_WINDOW = 4;
+	std::array<Token, TOKEN_WINDOW> m_tokens;
+	size_t m_lexed_tokens{0};
+	size_t m_current_token{0};
+	size_t m_depth{0};
 	Lexer m_lexer;
+	AstArena *m_arena;
 
 	template<typename T, typename... Tokens>
 	bool match(T t, Tokens... ts);
@@ -64,16 +72,9 @@ private:
 	StatementPtr if_statement();
 	StatementPtr while_statement();
 	StatementPtr for_statement();
-	ExprPtr and_expr();
-	ExprPtr or_expr();
-	ExprPtr bitwise();
-	ExprPtr equality_expression();
-	ExprPtr comparison();
-	ExprPtr shift();
-	ExprPtr sum();
-	ExprPtr multiplication();
-	ExprPtr unary();
-	ExprPtr exponentiation();
+	// Parses the operators binding at least as tight as min_power
+	ExprPtr binary(uint8_t min_power);
+	ExprPtr prefix();
 	ExprPtr assign();
 	ExprPtr get();
 	ExprPtr call();
@@ -91,11 +92,15 @@ private:
 	Token next();
 	Token &peek();
 	Token previous();
-	static void throw_exception(const std::string &why, const Token &cause);
+	// Throws once the parsing functions recurse deeper than MAX_PARSE_DEPTH
+	void check_depth();
+	void throw_exception(const std::string &why, const Token &cause) const;
 
 public:
-	explicit Parser(Lexer lexer);
+	Parser(Lexer lexer, AstArena &arena);
 
 	StatementList parse_all();
+	// The next top-level statement, allocated in arena, or nullptr at the end
+	StatementPtr parse_next(AstArena &arena);
 };
 } // namespace CL
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+namespace CL {
+/*
+ * Base of the heap objects of the interpreter, which count their own
+ * references. The count isn't atomic: an object belongs to the thread
+ * that created it, and a value handed to another thread has to be
+ * converted to plain data first, numbers or strings.
+ */
+class RefCounted {
+private:
+	mutable uint32_t m_refs{0};
+
+	template<class T>
+	friend class Ref;
+
+public:
+	RefCounted() = default;
+	// Copies are new objects, nothing refers to them yet
+	RefCounted(const RefCounted &) noexcept {}
+	RefCounted &operator=(const RefCounted &) noexcept { return *this; }
+	virtual ~RefCounted() = default;
+
+	[[nodiscard]]
+	uint32_t use_count() const noexcept { return m_refs; }
+};
+
+/*
+ * An owning handle to a RefCounted object, used like a shared_ptr but
+ * without the atomic operations and the separate control block.
+ */
+template<class T>
+class Ref {
+private:
+	T *m_object{nullptr};
+
+	template<class U>
+	friend class Ref;
+
+	void retain() const noexcept {
+		if(m_object != nullptr) {
+			m_object->m_refs++;
+		}
+	}
+
+public:
+	using element_type = T;
+
+	Ref() noexcept = default;
+	Ref(std::nullptr_t) noexcept {}
+	explicit Ref(T *object) noexcept
+		: m_object(object) {
+		retain();
+	}
+	Ref(const Ref &other) noexcept
+		: m_object(other.m_object) {
+		retain();
+	}
+	Ref(Ref &&other) noexcept
+		: m_object(std::exchange(other.m_object, nullptr)) {
+	}
+	template<class U, class = std::enable_if_t<std::is_convertible_v<U *, T *>>>
+	Ref(const Ref<U> &other) noexcept
+		: m_object(other.m_object) {
+		retain();
+	}
+	template<class U, class = std::enable_if_t<std::is_convertible_v<U *, T *>>>
+	Ref(Ref<U> &&other) noexcept
+		: m_object(std::exchange(other.m_object, nullptr)) {
+	}
+	~Ref() { reset(); }
+
+	Ref &operator=(const Ref &other) noexcept {
+		Ref(other).swap(*this);
+		return *this;
+	}
+	Ref &operator=(Ref &&other) noexcept {
+		Ref(std::move(other)).swap(*this);
+		return *this;
+	}
+	Ref &operator=(std::nullptr_t) noexcept {
+		reset();
+		return *this;
+	}
+
+	void reset() noexcept {
+		// Cleared first, the destructor may reach this handle again
+		auto *object = std::exchange(m_object, nullptr);
+		if(object != nullptr && --object->m_refs == 0) {
+			delete object;
+		}
+	}
+	void swap(Ref &other) noexcept { std::swap(m_object, other.m_object); }
+
+	[[nodiscard]]
+	T *get() const noexcept { return m_object; }
+	T &operator*() const noexcept { return *m_object; }
+	T *operator->() const noexcept { return m_object; }
+	explicit operator bool() const noexcept { return m_object != nullptr; }
+
+	template<class U>
+	bool operator==(const Ref<U> &other) const noexcept {
+		return m_object == other.get();
+	}
+	template<class U>
+	bool operator!=(const Ref<U> &other) const noexcept {
+		return m_object != other.get();
+	}
+	bool operator==(std::nullptr_t) const noexcept { return m_object == nullptr; }
+	bool operator!=(std::nullptr_t) const noexcept { return m_object != nullptr; }
+};
+
+}
+
+template<class T>
+struct std::hash<CL::Ref<T>> {
+	size_t operator()(const CL::Ref<T> &ref) const noexcept {
+		return std::hash<T *>()(ref.get());
+	}
+};
+
+namespace CL {
+template<class T, class... Args>
+Ref<T> make_ref(Args &&... args) {
+	return Ref<T>(new T(std::forward<Args>(args)...));
+}
+
+template<class T, class U>
+Ref<T> static_ref_cast(const Ref<U> &ref) noexcept {
+	return Ref<T>(static_cast<T *>(ref.get()));
+}
+
+template<class T, class U>
+Ref<T> dynamic_ref_cast(const Ref<U> &ref) noexcept {
+	return Ref<T>(dynamic_cast<T *>(ref.get()));
+}
+}
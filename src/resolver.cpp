@@ -0,0 +1,319 @@
+#include "resolver.hpp"
+#include "environment.hpp"
+#include "optimizer.hpp"
+
+namespace CL {
+namespace {
+/*
+ * Collects the names that resolving some statements declares in their own
+ * scope: the assignments, loop variables and function definitions outside
+ * of nested blocks, functions and modules, which get scopes of their own.
+ */
+class ScopeDeclarations : public TreeWalker {
+public:
+	std::unordered_set<Symbol, Symbol::Hash> names;
+
+	void run(const StatementList &statements) {
+		for (const auto &statement : statements) {
+			walk(statement);
+		}
+	}
+
+	void visit_assign_expression(const Symbol &name,
+								 Slot &slot,
+								 const ExprPtr &value) override {
+		names.insert(name);
+		TreeWalker::visit_assign_expression(name, slot, value);
+	}
+	void visit_for_statement(const Symbol &name,
+							 Slot &slot,
+							 const ExprPtr &iterable,
+							 const StatementPtr &body) override {
+		names.insert(name);
+		TreeWalker::visit_for_statement(name, slot, iterable, body);
+	}
+	void visit_fun_def_statement(const Symbol &name,
+								 Slot &,
+								 const Names &,
+								 ScopeLayout &,
+								 const StatementPtr &,
+								 bool) override {
+		names.insert(name);
+	}
+	void visit_block_statement(const StatementList &, ScopeLayout &) override {}
+	void visit_module_definition(const ExprList &) override {}
+};
+
+std::unordered_set<Symbol, Symbol::Hash> declared_later(const StatementList &statements) {
+	ScopeDeclarations declarations;
+	declarations.run(statements);
+	return std::move(declarations.names);
+}
+}
+
+void Resolver::resolve(const StatementList &statements) {
+	// The first walk only collects the names assigned at the top level,
+	// so that functions defined before those assignments see them as globals.
+	// The second one finds the blocks declaring no locals, which the last
+	// one elides while assigning the final slots.
+	for (int pass = 0; pass < 3; pass++) {
+		m_elide_empty_blocks = pass == 2;
+		m_scopes.clear();
+		m_scopes.push_back(Scope{ScopeKind::Global, {}});
+		for (const auto &statement : statements) {
+			statement->execute(*this);
+		}
+	}
+}
+
+bool Resolver::is_global(const Symbol &name) const {
+	if(m_globals.find(name) != m_globals.end()) {
+		return true;
+	}
+	for (auto env = m_env; env; env = env->parent()) {
+		if(env->is_bound(name)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+std::optional<Slot> Resolver::lookup(const Symbol &name) {
+	uint32_t depth = 0;
+	// Whether the lookup left the function it started from
+	bool outside_function = false;
+	for (auto scope = m_scopes.rbegin(); scope != m_scopes.rend(); scope++) {
+		auto it = scope->names.find(name);
+		switch (scope->kind) {
+			case ScopeKind::Local:
+				if(it != scope->names.end()) {
+					return Slot{depth, it->second};
+				}
+				if(outside_function && scope->later.count(name) > 0) {
+					auto index = static_cast<uint32_t>(scope->names.size());
+					scope->names[name] = index;
+					return Slot{depth, index};
+				}
+				outside_function = outside_function || scope->function;
+				depth++;
+				break;
+			case ScopeKind::Module:
+				if(it != scope->names.end()) {
+					return Slot{};
+				}
+				break;
+			case ScopeKind::Global:
+				if(is_global(name)) {
+					return Slot{};
+				}
+				break;
+			case ScopeKind::Elided:
+				break;
+		}
+	}
+	return std::nullopt;
+}
+
+uint32_t Resolver::scope_size() const {
+	return m_scopes.back().names.size();
+}
+
+Slot Resolver::declare(const Symbol &name) {
+	auto &scope = m_scopes.back();
+	switch (scope.kind) {
+		case ScopeKind::Local: {
+			auto it = scope.names.find(name);
+			if(it != scope.names.end()) {
+				return Slot{0, it->second};
+			}
+			auto index = scope_size();
+			scope.names[name] = index;
+			return Slot{0, index};
+		}
+		case ScopeKind::Module: scope.names[name] = 0;
+			break;
+		case ScopeKind::Global: m_globals.insert(name);
+			break;
+		case ScopeKind::Elided:
+			// The previous walk found no declarations in this block
+			NOT_REACHED()
+	}
+	return Slot{};
+}
+
+Slot Resolver::resolve_assignment(const Symbol &name) {
+	auto slot = lookup(name);
+	if(slot.has_value()) {
+		return slot.value();
+	}
+	return declare(name);
+}
+
+void Resolver::visit_number_expression(Number n) {}
+
+void Resolver::visit_string_expression(const RuntimeValue &s) {}
+
+void Resolver::visit_dict_expression(const std::vector<std::pair<ExprPtr,
+																 ExprPtr>> &exprs) {
+	for (const auto &e : exprs) {
+		e.first->evaluate(*this);
+		e.second->evaluate(*this);
+	}
+}
+
+void Resolver::visit_list_expression(const ExprList &exprs) {
+	for (const auto &e : exprs) {
+		e->evaluate(*this);
+	}
+}
+
+void Resolver::visit_and_expression(const ExprPtr &left,
+									const ExprPtr &right) {
+	left->evaluate(*this);
+	right->evaluate(*this);
+}
+
+void Resolver::visit_or_expression(const ExprPtr &left,
+								   const ExprPtr &right) {
+	left->evaluate(*this);
+	right->evaluate(*this);
+}
+
+void Resolver::visit_binary_expression(const ExprPtr &left,
+									   BinaryOp op,
+									   const ExprPtr &right,
+									   TypeFeedback &feedback) {
+	left->evaluate(*this);
+	right->evaluate(*this);
+}
+
+void Resolver::visit_unary_expression(UnaryOp op, const ExprPtr &expr) {
+	expr->evaluate(*this);
+}
+
+void Resolver::visit_var_expression(const Symbol &var, Slot &slot) {
+	slot = lookup(var).value_or(Slot{});
+}
+
+void Resolver::visit_assign_expression(const Symbol &name,
+									   Slot &slot,
+									   const ExprPtr &value) {
+	value->evaluate(*this);
+	slot = resolve_assignment(name);
+}
+
+void Resolver::visit_fun_call(const ExprPtr &fun,
+							  const ExprList &args,
+							  bool tail_call) {
+	fun->evaluate(*this);
+	for (const auto &arg : args) {
+		arg->evaluate(*this);
+	}
+}
+
+void Resolver::visit_fun_def_statement(const Symbol &name,
+									   Slot &slot,
+									   const Names &names,
+									   ScopeLayout &layout,
+									   const StatementPtr &body,
+									   bool memoized) {
+	// Functions are bound in the innermost scope, like StackedEnvironment::bind
+	slot = declare(name);
+	for (auto &scope : m_scopes) {
+		scope.captured = true;
+	}
+
+	m_scopes.push_back(Scope{ScopeKind::Local, {}, declared_later({body}), true});
+	for (const auto &param : names) {
+		declare(Symbol(param));
+	}
+	m_function_depth++;
+	body->execute(*this);
+	m_function_depth--;
+	layout.size = scope_size();
+	layout.captured = m_scopes.back().captured;
+	m_scopes.pop_back();
+}
+
+void Resolver::visit_expression_statement(const ExprPtr &expr) {
+	expr->evaluate(*this);
+}
+
+void Resolver::visit_block_statement(const StatementList &block,
+									 ScopeLayout &layout) {
+	auto kind = m_elide_empty_blocks && layout.size == 0
+				? ScopeKind::Elided
+				: ScopeKind::Local;
+	m_scopes.push_back(Scope{kind, {}, declared_later(block)});
+	for (const auto &statement : block) {
+		statement->execute(*this);
+	}
+	layout.size = scope_size();
+	layout.captured = m_scopes.back().captured;
+	m_scopes.pop_back();
+}
+
+void Resolver::visit_return_expression(const ExprPtr &expr) {
+	if(!expr)
+		return;
+	if(m_function_depth > 0) {
+		if(auto *call = dynamic_cast<FunCallExpression *>(expr)) {
+			call->mark_tail_call();
+		}
+	}
+	expr->evaluate(*this);
+}
+
+void Resolver::visit_break_expression() {}
+
+void Resolver::visit_continue_expression() {}
+
+void Resolver::visit_if_statement(const ExprPtr &cond,
+								  const StatementPtr &if_branch,
+								  const StatementPtr &else_branch) {
+	cond->evaluate(*this);
+	if_branch->execute(*this);
+	if(else_branch)
+		else_branch->execute(*this);
+}
+
+void Resolver::visit_while_statement(const ExprPtr &cond,
+									 const StatementPtr &body) {
+	cond->evaluate(*this);
+	body->execute(*this);
+}
+
+void Resolver::visit_for_statement(const Symbol &name,
+								   Slot &slot,
+								   const ExprPtr &iterable,
+								   const StatementPtr &body) {
+	iterable->evaluate(*this);
+	slot = resolve_assignment(name);
+	body->execute(*this);
+}
+
+void Resolver::visit_set_expression(const ExprPtr &obj,
+									const ExprPtr &name,
+									const ExprPtr &val) {
+	obj->evaluate(*this);
+	val->evaluate(*this);
+	name->evaluate(*this);
+}
+
+void Resolver::visit_get_expression(const ExprPtr &obj, const ExprPtr &name) {
+	obj->evaluate(*this);
+	name->evaluate(*this);
+}
+
+void Resolver::visit_module_definition(const ExprList &list) {
+	// A module body runs on an evaluator of its own, even inside a function
+	auto function_depth = m_function_depth;
+	m_function_depth = 0;
+	m_scopes.push_back(Scope{ScopeKind::Module, {}});
+	for (const auto &expr : list) {
+		expr->evaluate(*this);
+	}
+	m_scopes.pop_back();
+	m_function_depth = function_depth;
+}
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "commons.hpp"
+#include "nodes.hpp"
+
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace CL {
+/*
+ * Assigns a (depth, index) Slot to every local variable of a parsed script.
+ * Blocks and function calls get a slot array each, while names living in
+ * the global environment or in a module stay dynamic and are looked up by
+ * name at runtime.
+ * An assignment to a name that isn't visible yet declares it in the
+ * innermost scope, unless the name is a global: one already bound in the
+ * execution environment or assigned anywhere at the top level of the script.
+ * Blocks that declare no locals are elided, they get no slot array and
+ * don't count in the depth of the slots of their children.
+ * Functions see the whole of the scopes enclosing them: a name that one of
+ * those assigns, or a function it defines, after the function definition
+ * is still resolved to the slot it gets there.
+ * Calls whose value is returned right away by a function are marked as
+ * tail calls.
+ */
+class Resolver : public Evaluator {
+private:
+	enum class ScopeKind {
+		Global,
+		Module,
+		Local,
+		Elided,
+	};
+	struct Scope {
+		ScopeKind kind;
+		std::unordered_map<Symbol, uint32_t, Symbol::Hash> names;
+		// Names the scope declares further on, for the functions defined in it
+		std::unordered_set<Symbol, Symbol::Hash> later{};
+		// The scope of the parameters of a function
+		bool function{false};
+		// A function is defined in the scope
+		bool captured{false};
+	};
+
+	RuntimeEnvPtr m_env;
+	std::vector<Scope> m_scopes;
+	std::unordered_set<Symbol, Symbol::Hash> m_globals;
+	bool m_elide_empty_blocks{false};
+	uint32_t m_function_depth{0};
+
+	std::optional<Slot> lookup(const Symbol &name);
+	Slot resolve_assignment(const Symbol &name);
+	Slot declare(const Symbol &name);
+	bool is_global(const Symbol &name) const;
+	uint32_t scope_size() const;
+
+	void visit_number_expression(Number n) override;
+	void visit_string_expression(const RuntimeValue &s) override;
+	void visit_dict_expression(const std::vector<std::pair<ExprPtr,
+														   ExprPtr>> &) override;
+	void visit_list_expression(const ExprList &) override;
+
+	void visit_and_expression(const ExprPtr &left,
+							  const ExprPtr &right) override;
+	void visit_or_expression(const ExprPtr &left,
+							 const ExprPtr &right) override;
+	void visit_binary_expression(const ExprPtr &left,
+								 BinaryOp op,
+								 const ExprPtr &right,
+								 TypeFeedback &feedback) override;
+
+	void visit_unary_expression(UnaryOp op, const ExprPtr &expr) override;
+
+	void visit_var_expression(const Symbol &var, Slot &slot) override;
+	void visit_assign_expression(const Symbol &name,
+								 Slot &slot,
+								 const ExprPtr &value) override;
+	void visit_fun_call(const ExprPtr &fun,
+						const ExprList &args,
+						bool tail_call) override;
+	void visit_fun_def_statement(const Symbol &name,
+								 Slot &slot,
+								 const Names &names,
+								 ScopeLayout &layout,
+								 const StatementPtr &body,
+								 bool memoized) override;
+	void visit_expression_statement(const ExprPtr &expr) override;
+	void visit_block_statement(const StatementList &block,
+							   ScopeLayout &layout) override;
+	void visit_return_expression(const ExprPtr &expr) override;
+	void visit_break_expression() override;
+	void visit_continue_expression() override;
+	void visit_if_statement(const ExprPtr &cond,
+							const StatementPtr &expr,
+							const StatementPtr &else_branch) override;
+	void visit_while_statement(const ExprPtr &cond,
+							   const StatementPtr &body) override;
+	void visit_for_statement(const Symbol &name,
+							 Slot &slot,
+							 const ExprPtr &iterable,
+							 const StatementPtr &body) override;
+	void visit_set_expression(const ExprPtr &obj,
+							  const ExprPtr &name,
+							  const ExprPtr &val) override;
+	void visit_get_expression(const ExprPtr &obj, const ExprPtr &name) override;
+	void visit_module_definition(const ExprList &list) override;
+
+public:
+	explicit Resolver(RuntimeEnvPtr env)
+		: m_env(std::move(env)) {
+	}
+
+	void resolve(const StatementList &statements);
+};
+}
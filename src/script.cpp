@@ -3,42 +3,102 @@
 //
 
 #include "script.h"
+#include "ast_arena.hpp"
 #include "environment.hpp"
 #include "exceptions.hpp"
+#include "flat_ast.hpp"
+#include "flat_evaluator.hpp"
 #include "lexer.hpp"
+#include "optimizer.hpp"
 #include "parser.hpp"
+#include "resolver.hpp"
+#include "source_buffer.hpp"
 #include "ast_evaluator.hpp"
+#include "virtual_machine.h"
+#include "vm_ast_evaluator.h"
 
-#include <fstream>
 #include <memory>
 
 namespace CL {
-Script Script::from_file(const std::string &path, RuntimeEnvPtr env) {
-	if(env == nullptr) env = std::make_shared<StackedEnvironment>();
-	auto file_stream = std::ifstream(path);
-	if(!file_stream.is_open()) {
-		throw FileNotFoundException(path);
+Script Script::from_file(const std::string &path,
+						 RuntimeEnvPtr env,
+						 OptimizationLevel level,
+						 bool memoize) {
+	if(env == nullptr) env = make_ref<StackedEnvironment>();
+	auto source = SourceBuffer::from_file(path);
+	auto lexer = Lexer(source.text());
+	auto arena = std::make_shared<AstArena>();
+	auto parser = Parser(lexer, *arena);
+
+	auto exprs = PassManager(level, env).run(parser.parse_all(), *arena);
+	Resolver(env).resolve(exprs);
+	if(memoize) {
+		PurityAnalysis(env).run(exprs);
 	}
+	return Script(exprs, env, arena);
+}
 
-	auto lexer = Lexer(file_stream);
-	auto parser = Parser(lexer);
+Script Script::from_source(const std::string &source,
+						   RuntimeEnvPtr env,
+						   OptimizationLevel level,
+						   bool memoize) {
+	if(env == nullptr) env = make_ref<StackedEnvironment>();
+	auto lexer = Lexer(source);
+	auto arena = std::make_shared<AstArena>();
+	auto parser = Parser(lexer, *arena);
 
-	auto exprs = parser.parse_all();
-	return Script(exprs, env);
+	auto exprs = PassManager(level, env).run(parser.parse_all(), *arena);
+	Resolver(env).resolve(exprs);
+	if(memoize) {
+		PurityAnalysis(env).run(exprs);
+	}
+	return Script(exprs, env, arena);
 }
 
-Script Script::from_source(const std::string &source, RuntimeEnvPtr env) {
-	if(env == nullptr) env = std::make_shared<StackedEnvironment>();
-	auto stream = std::stringstream(source);
-	auto lexer = Lexer(stream);
-	auto parser = Parser(lexer);
+std::optional<RuntimeValue> Script::stream_file(const std::string &path,
+												RuntimeEnvPtr env,
+												OptimizationLevel level,
+												bool memoize,
+												Engine engine,
+												size_t max_call_depth) {
+	if(env == nullptr) env = make_ref<StackedEnvironment>();
+	auto source = SourceBuffer::from_file(path);
+	auto arena = std::make_shared<AstArena>();
+	auto parser = Parser(Lexer(source.text()), *arena);
+	auto passes = PassManager(level, env);
 
-	auto exprs = parser.parse_all();
-	return Script(exprs, env);
+	std::optional<RuntimeValue> result;
+	while (auto statement = parser.parse_next(*arena)) {
+		auto exprs = passes.run({statement}, *arena);
+		Resolver(env).resolve(exprs);
+		if(memoize) {
+			// Later statements may still set the members of const containers
+			PurityAnalysis(env, false).run(exprs);
+		}
+		result = Script(exprs, env, arena).run(engine, max_call_depth);
+		// Functions defined by the statement keep its arena alive
+		if(arena.use_count() == 1) {
+			arena->clear();
+		} else {
+			arena = std::make_shared<AstArena>();
+		}
+	}
+	return result;
 }
 
-std::optional<RuntimeValue> Script::run() {
-	auto evaluator = ASTEvaluator(m_execution_env);
+std::optional<RuntimeValue> Script::run(Engine engine, size_t max_call_depth) {
+	CallDepthGuard::Limit limit(max_call_depth);
+	if(engine == Engine::VM) {
+		VirtualMachine vm;
+		return vm.run(VMASTEvaluator::compile(m_script_statements, m_arena),
+					  m_execution_env);
+	}
+	if(engine == Engine::Flat) {
+		FlatEvaluator evaluator(FlatTree::build(m_script_statements, m_arena),
+								m_execution_env);
+		return evaluator.run();
+	}
+	auto evaluator = ASTEvaluator(m_execution_env, m_arena);
 	for (const auto &expr : m_script_statements) {
 		expr->execute(evaluator);
 	}
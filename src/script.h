@@ -7,21 +7,52 @@
 #include <sstream>
 
 namespace CL {
+enum class Engine {
+	AST,
+	VM,
+	Flat,
+};
+
 class Script {
 private:
 	RuntimeEnvPtr m_execution_env;
+	AstArenaPtr m_arena;
     StatementList m_script_statements;
 private:
-	explicit Script(StatementList list, RuntimeEnvPtr env) :
-        m_script_statements(std::move(list)),
-		m_execution_env(std::move(env)) {}
+	explicit Script(StatementList list, RuntimeEnvPtr env, AstArenaPtr arena) :
+		m_execution_env(std::move(env)),
+		m_arena(std::move(arena)),
+		m_script_statements(std::move(list)) {}
 public:
 	static Script from_file(const std::string &path,
-							RuntimeEnvPtr env = nullptr);
+							RuntimeEnvPtr env = nullptr,
+							OptimizationLevel level = OptimizationLevel::O1,
+							bool memoize = false);
 	static Script from_source(const std::string &source,
-							  RuntimeEnvPtr env = nullptr);
+							  RuntimeEnvPtr env = nullptr,
+							  OptimizationLevel level = OptimizationLevel::O1,
+							  bool memoize = false);
+
+	/*
+	 * Runs the script at path one top-level statement at a time, each one
+	 * parsed, optimized, resolved and run before the next one is read.
+	 * The tree of a statement is freed once it ran, unless it defined a
+	 * function, so memory doesn't grow with the length of the script.
+	 * Like in the REPL, a name is global only once a top-level statement
+	 * assigning it ran, and -Omemo only sees the functions defined so far.
+	 * Returns the value of the last statement.
+	 */
+	static std::optional<RuntimeValue> stream_file(const std::string &path,
+												   RuntimeEnvPtr env = nullptr,
+												   OptimizationLevel level = OptimizationLevel::O1,
+												   bool memoize = false,
+												   Engine engine = Engine::VM,
+												   size_t max_call_depth = DEFAULT_MAX_CALL_DEPTH);
 
-	std::optional<RuntimeValue> run();
+	// max_call_depth bounds the nested calls on every engine, the tree walking
+	// ones recurse on the C++ stack and may stop earlier when it runs out
+	std::optional<RuntimeValue> run(Engine engine = Engine::VM,
+									size_t max_call_depth = DEFAULT_MAX_CALL_DEPTH);
 };
 }
 
@@ -0,0 +1,36 @@
+#include "slab.hpp"
+
+namespace CL {
+SlabAllocator &SlabAllocator::instance() noexcept {
+	// Never destroyed, so objects outliving main can still give back their slots
+	static auto *allocator = new SlabAllocator();
+	return *allocator;
+}
+
+void SlabAllocator::refill(size_t index) {
+	auto slot_size = (index + 1) * SLAB_ALIGNMENT;
+	auto *chunk = static_cast<char *>(::operator new(SLAB_CHUNK_SIZE));
+	m_chunks.push_back(chunk);
+
+	auto &size_class = m_classes[index];
+	auto count = SLAB_CHUNK_SIZE / slot_size;
+	// Thread the slots in address order, so fresh allocations are contiguous
+	for(size_t i = count; i > 0; i--) {
+		auto *slot = reinterpret_cast<FreeSlot *>(chunk + (i - 1) * slot_size);
+		slot->next = size_class.free;
+		size_class.free = slot;
+	}
+	size_class.slots += count;
+}
+
+std::vector<SlabClassStats> SlabAllocator::stats() const {
+	std::vector<SlabClassStats> result;
+	for(size_t i = 0; i < SLAB_CLASSES; i++) {
+		if(m_classes[i].slots > 0) {
+			result.push_back({(i + 1) * SLAB_ALIGNMENT, m_classes[i].slots,
+							  m_classes[i].in_use});
+		}
+	}
+	return result;
+}
+}
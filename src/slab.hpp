@@ -0,0 +1,116 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace CL {
+// Granularity and number of the size classes served by the slabs
+constexpr size_t SLAB_ALIGNMENT = 16;
+constexpr size_t SLAB_CLASSES = 16;
+constexpr size_t SLAB_MAX_SIZE = SLAB_ALIGNMENT * SLAB_CLASSES;
+// Bytes requested from operator new whenever a size class runs out of slots
+constexpr size_t SLAB_CHUNK_SIZE = 64 * 1024;
+
+struct SlabClassStats {
+	size_t slot_size{0};
+	size_t slots{0};
+	size_t in_use{0};
+};
+
+/*
+ * A pool allocator for the small objects of the runtime: containers,
+ * environments, functions and the nodes of their hash maps.
+ * Sizes are rounded up to a multiple of SLAB_ALIGNMENT, and every size class
+ * carves its slots out of chunks of SLAB_CHUNK_SIZE bytes, keeping freed
+ * slots in a free list; bigger requests go straight to operator new.
+ * Like the Refs it serves it isn't thread safe: it belongs to the isolate,
+ * and its chunks are kept until the process exits.
+ */
+class SlabAllocator {
+private:
+	struct FreeSlot {
+		FreeSlot *next;
+	};
+
+	struct SizeClass {
+		FreeSlot *free{nullptr};
+		size_t slots{0};
+		size_t in_use{0};
+	};
+
+	std::array<SizeClass, SLAB_CLASSES> m_classes{};
+	std::vector<void *> m_chunks;
+
+	static constexpr size_t class_of(size_t size) noexcept {
+		return size == 0 ? 0 : (size - 1) / SLAB_ALIGNMENT;
+	}
+
+	void refill(size_t index);
+
+public:
+	static SlabAllocator &instance() noexcept;
+
+	void *allocate(size_t size) {
+		if(size > SLAB_MAX_SIZE) {
+			return ::operator new(size);
+		}
+		auto &size_class = m_classes[class_of(size)];
+		if(size_class.free == nullptr) {
+			refill(class_of(size));
+		}
+		auto *slot = size_class.free;
+		size_class.free = slot->next;
+		size_class.in_use++;
+		return slot;
+	}
+
+	void deallocate(void *pointer, size_t size) noexcept {
+		if(size > SLAB_MAX_SIZE) {
+			::operator delete(pointer);
+			return;
+		}
+		auto &size_class = m_classes[class_of(size)];
+		auto *slot = static_cast<FreeSlot *>(pointer);
+		slot->next = size_class.free;
+		size_class.free = slot;
+		size_class.in_use--;
+	}
+
+	// The occupancy of the size classes that allocated at least one chunk
+	[[nodiscard]]
+	std::vector<SlabClassStats> stats() const;
+	[[nodiscard]]
+	size_t reserved_bytes() const noexcept {
+		return m_chunks.size() * SLAB_CHUNK_SIZE;
+	}
+};
+
+/*
+ * Standard allocator over the SlabAllocator, for the node based containers
+ * of the runtime objects.
+ */
+template<class T>
+class PoolAllocator {
+public:
+	using value_type = T;
+
+	PoolAllocator() noexcept = default;
+	template<class U>
+	PoolAllocator(const PoolAllocator<U> &) noexcept {}
+
+	T *allocate(size_t count) {
+		static_assert(alignof(T) <= SLAB_ALIGNMENT);
+		return static_cast<T *>(SlabAllocator::instance().allocate(count * sizeof(T)));
+	}
+	void deallocate(T *pointer, size_t count) noexcept {
+		SlabAllocator::instance().deallocate(pointer, count * sizeof(T));
+	}
+
+	template<class U>
+	bool operator==(const PoolAllocator<U> &) const noexcept { return true; }
+	template<class U>
+	bool operator!=(const PoolAllocator<U> &) const noexcept { return false; }
+};
+}
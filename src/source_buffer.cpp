@@ -0,0 +1,80 @@
+#include "source_buffer.hpp"
+#include "exceptions.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <utility>
+
+namespace CL {
+SourceBuffer SourceBuffer::from_file(const std::string &path) {
+	auto fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0) {
+		throw FileNotFoundException(path);
+	}
+	struct stat info{};
+	if(fstat(fd, &info) < 0) {
+		::close(fd);
+		throw FileNotFoundException(path);
+	}
+	SourceBuffer buffer;
+	auto size = static_cast<size_t>(info.st_size);
+	// Empty files can't be mapped, and have nothing to lex anyway
+	if(S_ISREG(info.st_mode) && size > 0) {
+		auto *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(mapping != MAP_FAILED) {
+			::close(fd);
+			buffer.m_mapping = mapping;
+			buffer.m_mapped_size = size;
+			buffer.m_text = std::string_view(static_cast<const char *>(mapping), size);
+			return buffer;
+		}
+	}
+	// Pipes, terminals and files that can't be mapped are read whole
+	char chunk[65536];
+	ssize_t count;
+	while ((count = ::read(fd, chunk, sizeof(chunk))) != 0) {
+		if(count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			::close(fd);
+			throw FileNotFoundException(path);
+		}
+		buffer.m_owned.append(chunk, static_cast<size_t>(count));
+	}
+	::close(fd);
+	buffer.m_text = buffer.m_owned;
+	return buffer;
+}
+
+SourceBuffer::SourceBuffer(SourceBuffer &&other) noexcept {
+	*this = std::move(other);
+}
+
+SourceBuffer &SourceBuffer::operator=(SourceBuffer &&other) noexcept {
+	if(this == &other) {
+		return *this;
+	}
+	if(m_mapping != nullptr) {
+		munmap(m_mapping, m_mapped_size);
+	}
+	// A moved string may keep its characters in place or not
+	auto owned = other.m_mapping == nullptr && other.m_text.data() == other.m_owned.data();
+	m_owned = std::move(other.m_owned);
+	m_mapping = std::exchange(other.m_mapping, nullptr);
+	m_mapped_size = std::exchange(other.m_mapped_size, 0);
+	m_text = owned ? std::string_view(m_owned) : other.m_text;
+	other.m_text = {};
+	return *this;
+}
+
+SourceBuffer::~SourceBuffer() {
+	if(m_mapping != nullptr) {
+		munmap(m_mapping, m_mapped_size);
+	}
+}
+}
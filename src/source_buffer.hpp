@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace CL {
+/*
+ * The contiguous text of a script, which the Lexer reads in place.
+ * Regular files are mapped in memory instead of being read, sources given
+ * as a string are moved in. Tokens refer to the buffer, so it has to
+ * outlive the parsing of the script.
+ */
+class SourceBuffer {
+private:
+	std::string m_owned;
+	void *m_mapping{nullptr};
+	size_t m_mapped_size{0};
+	std::string_view m_text;
+
+	SourceBuffer() = default;
+
+public:
+	explicit SourceBuffer(std::string source)
+		: m_owned(std::move(source)), m_text(m_owned) {
+	}
+	// Throws a FileNotFoundException when the file can't be opened or read,
+	// files that aren't regular, like pipes, are read instead of mapped
+	static SourceBuffer from_file(const std::string &path);
+
+	SourceBuffer(SourceBuffer &&other) noexcept;
+	SourceBuffer &operator=(SourceBuffer &&other) noexcept;
+	SourceBuffer(const SourceBuffer &) = delete;
+	SourceBuffer &operator=(const SourceBuffer &) = delete;
+	~SourceBuffer();
+
+	[[nodiscard]]
+	std::string_view text() const noexcept { return m_text; }
+};
+}
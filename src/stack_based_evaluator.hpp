@@ -1,21 +1,113 @@
 #pragma once
 
+#include "commons.hpp"
 #include "exceptions.hpp"
-#include <stack>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace CL {
+constexpr size_t DEFAULT_STACK_CAPACITY = 64;
+
+/*
+ * Held for the duration of a script function call that recurses on the
+ * C++ stack, by the tree walking evaluators and by natives calling back
+ * into the VM. Throws a RuntimeException once the calls nest deeper than
+ * the configured maximum, or before they use more than seven eighths of
+ * the native stack, which leaves the rest to the natives and the unwinding.
+ * The VM counts its heap frames in the same depth with enter and leave, so
+ * nested VMs share the limit of the script that started them.
+ */
+class CallDepthGuard {
+private:
+	static inline thread_local size_t s_depth = 0;
+	static inline thread_local size_t s_max_depth = DEFAULT_MAX_CALL_DEPTH;
+	// Guards alive on this thread, the outermost sets the stack base
+	static inline thread_local size_t s_guards = 0;
+	// Where the outermost guarded call started, the usage is measured from there
+	static inline thread_local uintptr_t s_stack_base = 0;
+
+	static size_t stack_budget() {
+		static const size_t budget = native_stack_size() / 8 * 7;
+		return budget;
+	}
+
+public:
+	// Sets the maximum depth of the calls made while it's alive
+	class Limit {
+	private:
+		size_t m_previous;
+
+	public:
+		explicit Limit(size_t max_depth)
+			: m_previous(std::exchange(s_max_depth, max_depth)) {
+		}
+		Limit(const Limit &) = delete;
+		Limit &operator=(const Limit &) = delete;
+		~Limit() { s_max_depth = m_previous; }
+	};
+
+	// Counts a call that doesn't recurse on the C++ stack
+	static void enter() {
+		if(s_depth >= s_max_depth) {
+			throw RuntimeException("Maximum call depth of "
+									   + std::to_string(s_max_depth)
+									   + " exceeded");
+		}
+		s_depth++;
+	}
+	static void leave(size_t calls = 1) noexcept { s_depth -= calls; }
+
+	CallDepthGuard() {
+		char marker{};
+		auto here = reinterpret_cast<uintptr_t>(&marker);
+		if(s_guards == 0) {
+			s_stack_base = here;
+		}
+		auto used = here > s_stack_base ? here - s_stack_base : s_stack_base - here;
+		if(used > stack_budget()) {
+			throw RuntimeException("Native stack exhausted after "
+									   + std::to_string(s_depth)
+									   + " nested calls");
+		}
+		enter();
+		s_guards++;
+	}
+	CallDepthGuard(const CallDepthGuard &) = delete;
+	CallDepthGuard &operator=(const CallDepthGuard &) = delete;
+	~CallDepthGuard() {
+		s_guards--;
+		leave();
+	}
+};
+
+/*
+ * Operand stack shared by the tree walking evaluators.
+ * Values live in a contiguous buffer reserved up front and are moved in and
+ * out of it, so pushing and popping never copies and only allocates when an
+ * expression nests deeper than the reserved capacity.
+ */
 template<class T>
 class StackMachine {
 protected:
-	std::stack<T> m_stack;
-	void push(T el) noexcept { m_stack.push(el); }
-	T &peek() { return m_stack.top(); }
+	std::vector<T> m_stack;
+
+	explicit StackMachine(size_t capacity = DEFAULT_STACK_CAPACITY) {
+		m_stack.reserve(capacity);
+	}
+
+	void push(T &&el) { m_stack.push_back(std::move(el)); }
+	void push(const T &el) { m_stack.push_back(el); }
+	T &peek() { return m_stack.back(); }
 	T pop() {
-		if(m_stack.size() == 0) {
+		if(m_stack.empty()) {
 			throw RuntimeException("Tried popping on an empty stack");
 		}
-		auto t = m_stack.top();
-		m_stack.pop();
+		auto t = std::move(m_stack.back());
+		m_stack.pop_back();
 		return t;
 	}
 };
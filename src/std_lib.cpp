@@ -52,26 +52,36 @@ private:
 	bool is_readable() { return mode & std::iostream::in; };
 	bool is_writable() { return mode & std::iostream::out; };
 	bool is_appendable() { return mode & std::iostream::app; };
-	void build_lambdas() {
-		std::function
-			write_lam = [this](const std::string &str) {
-			this->write(str);
+	static const MethodTable &file_methods() {
+		static const MethodTable table{
+			{"write", {[](Indexable &self, const Args &args) -> std::optional<RuntimeValue> {
+				static_cast<FileObject &>(self).write(args[0].as<String>());
+				return std::nullopt;
+			}, 1}},
+			{"readline", {[](Indexable &self, const Args &) -> std::optional<RuntimeValue> {
+				return RuntimeValue(static_cast<FileObject &>(self).readline());
+			}, 0}},
+			{"close", {[](Indexable &self, const Args &) -> std::optional<RuntimeValue> {
+				static_cast<FileObject &>(self).close();
+				return std::nullopt;
+			}, 0}},
+			{"flush", {[](Indexable &self, const Args &) -> std::optional<RuntimeValue> {
+				auto &file = static_cast<FileObject &>(self);
+				if(!file.m_stream.is_open())
+					throw RuntimeException("This file is not open");
+				file.m_stream.flush();
+				return std::nullopt;
+			}, 0}},
 		};
-		std::function readline_lam = [this]() {
-			return this->readline();
-		};
-		std::function close_lam = [this]() {
-			return this->close();
-		};
-		std::function flush_lam = [this]() {
-			if(!this->m_stream.is_open())
-				throw RuntimeException("This file is not open");
-			this->m_stream.flush();
-		};
-		set_named("write", CL::make_function(write_lam));
-		set_named("readline", CL::make_function(readline_lam));
-		set_named("close", CL::make_function(close_lam));
-		set_named("flush", CL::make_function(flush_lam));
+		return table;
+	}
+
+protected:
+	RuntimeValue *method(const RuntimeValue &name) override {
+		if(auto *m = Iterable::method(name)) {
+			return m;
+		}
+		return file_methods().bind(*this, name, m_bound_methods);
 	}
 public:
 
@@ -89,11 +99,9 @@ public:
 		if(!m_stream.is_open())
 			throw RuntimeException(
 				"Could not open or create file located at: " + path);
-
-		build_lambdas();
 	}
 
-	void write(const std::string &line) {
+	void write(std::string_view line) {
 		if(!m_stream.is_open())
 			throw RuntimeException("This file is not open");
 		if(is_writable()) {
@@ -143,6 +151,50 @@ public:
 	}
 };
 
+// Accumulates text in a single buffer, for scripts building long strings
+class StringBuilder : public Dictionary {
+private:
+	String m_text;
+
+	static const MethodTable &builder_methods() {
+		static const MethodTable table{
+			{"append", {[](Indexable &self, const Args &args) -> std::optional<RuntimeValue> {
+				auto &text = static_cast<StringBuilder &>(self).m_text;
+				if(args[0].is<String>()) {
+					text.append(args[0].as<String>());
+				} else {
+					text.append(args[0].to_string());
+				}
+				return std::nullopt;
+			}, 1}},
+			{"build", {[](Indexable &self, const Args &) -> std::optional<RuntimeValue> {
+				return RuntimeValue(static_cast<StringBuilder &>(self).m_text);
+			}, 0}},
+			{"length", {[](Indexable &self, const Args &) -> std::optional<RuntimeValue> {
+				return RuntimeValue(static_cast<Number>(
+					static_cast<StringBuilder &>(self).m_text.size()));
+			}, 0}},
+		};
+		return table;
+	}
+
+protected:
+	RuntimeValue *method(const RuntimeValue &name) override {
+		if(auto *m = Dictionary::method(name)) {
+			return m;
+		}
+		return builder_methods().bind(*this, name, m_bound_methods);
+	}
+
+public:
+	std::string to_string() const override {
+		return "StringBuilder " + addr_to_hex_str(*this);
+	}
+	std::string string_repr() const override {
+		return "StringBuilder " + addr_to_hex_str(*this);
+	}
+};
+
 std::optional<RuntimeValue> import_impl(const std::string &path,
 										const RuntimeEnvPtr &env) {
 	auto script = Script::from_file(path, env);
@@ -150,12 +202,12 @@ std::optional<RuntimeValue> import_impl(const std::string &path,
 }
 
 std::optional<RuntimeValue> range(Number begin, Number end, Number step) {
-	return RuntimeValue(std::make_shared<RangeIterator>(begin, end, step));
+	return RuntimeValue(make_ref<RangeIterator>(begin, end, step));
 }
 
 std::optional<RuntimeValue> open(const std::string &file_path,
 								 const std::string &openmode) {
-	auto file_it = std::make_shared<FileObject>(file_path, openmode);
+	auto file_it = make_ref<FileObject>(file_path, openmode);
 	return RuntimeValue(file_it);
 }
 Number deg2rad(double deg) {
@@ -182,14 +234,14 @@ void inject_stdlib_functions(const RuntimeEnvPtr &env) {
 	auto range_impl = CL::make_function(range);
 	auto open_impl = CL::make_function(open);
 	static auto input_impl =
-		std::make_shared<LambdaStyleFunction>([](const auto &_args) {
+		make_ref<LambdaStyleFunction>([](const auto &_args) {
 												  String line;
 												  std::getline(std::cin, line);
 												  return RuntimeValue(line);
 											  },
 											  0);
 	static auto
-		print_impl = std::make_shared<VoidFunction>([](const Args &args) {
+		print_impl = make_ref<VoidFunction>([](const Args &args) {
 														for (const auto &arg : args) {
 															std::cout << arg.to_string() << " ";
 														}
@@ -198,10 +250,35 @@ void inject_stdlib_functions(const RuntimeEnvPtr &env) {
 													VAR_ARGS);
 
 	static auto
-		repr_impl = std::make_shared<LambdaStyleFunction>([](const Args &args) {
+		repr_impl = make_ref<LambdaStyleFunction>([](const Args &args) {
 															  return args[0].string_representation();
 														  },
 														  1);
+	static auto
+		length_impl = make_ref<LambdaStyleFunction>([](const Args &args) {
+														return RuntimeValue(static_cast<Number>(
+															args[0].as<String>().size()));
+													},
+													1);
+	// Substrings share the text of the string they are cut from
+	static auto
+		substring_impl = make_ref<LambdaStyleFunction>([](const Args &args) {
+														   auto start = args[1].as<Number>();
+														   auto count = args[2].as<Number>();
+														   if(start < 0 || count < 0) {
+															   throw RuntimeException(
+																   "substring expects a positive start and count");
+														   }
+														   return args[0].slice(static_cast<size_t>(start),
+																				static_cast<size_t>(count));
+													   },
+													   3);
+	static auto
+		builder_impl = make_ref<LambdaStyleFunction>([](const Args &) {
+														 return RuntimeValue(IndexablePtr(
+															 make_ref<StringBuilder>()));
+													 },
+													 0);
 	env->assign("exit", exit_impl);
 	env->assign("input", RuntimeValue(input_impl));
 	env->assign("print", RuntimeValue(print_impl));
@@ -209,10 +286,13 @@ void inject_stdlib_functions(const RuntimeEnvPtr &env) {
 	env->assign("random", CL::make_function(random));
 	env->assign("range", range_impl);
 	env->assign("open", open_impl);
+	env->assign("length", RuntimeValue(length_impl));
+	env->assign("substring", RuntimeValue(substring_impl));
+	env->assign("StringBuilder", RuntimeValue(builder_impl));
 }
 
 void inject_math_functions(const RuntimeEnvPtr &env) {
-	auto dict_object = std::make_shared<Dictionary>();
+	auto dict_object = make_ref<Dictionary>();
 
 	dict_object->set_named("sin", CL::make_function(sin));
 	dict_object->set_named("cos", CL::make_function(cos));
@@ -4,16 +4,10 @@
 
 namespace CL {
 void StringVisitor::visit_number_expression(Number n) {
-	auto str_repr_of_number = std::to_string(n);
-	auto last_index_of_dot = str_repr_of_number.find_last_not_of('0') + 1;
-	str_repr_of_number.erase(last_index_of_dot, str_repr_of_number.size());
-	if(str_repr_of_number[str_repr_of_number.size() - 1] == '.') {
-		str_repr_of_number.pop_back();
-	}
-	push(str_repr_of_number);
+	push(number_to_string(n));
 }
-void StringVisitor::visit_string_expression(String s) {
-	push("\"" + s + "\"");
+void StringVisitor::visit_string_expression(const RuntimeValue &s) {
+	push("\"" + String(s.as<String>()) + "\"");
 }
 void StringVisitor::visit_dict_expression(const std::vector<std::pair<ExprPtr,
 																	  ExprPtr>> &exprs) {
@@ -55,7 +49,8 @@ void StringVisitor::visit_or_expression(const ExprPtr &left,
 }
 void StringVisitor::visit_binary_expression(const ExprPtr &left,
 											BinaryOp op,
-											const ExprPtr &right) {
+											const ExprPtr &right,
+											TypeFeedback &feedback) {
 	left->evaluate(*this);
 	right->evaluate(*this);
 	push(pop() + " " + binary_op_to_string(op) + " " + pop());
@@ -64,15 +59,18 @@ void StringVisitor::visit_unary_expression(UnaryOp op, const ExprPtr &expr) {
 	expr->evaluate(*this);
 	push(unary_op_to_string(op) + pop());
 }
-void StringVisitor::visit_var_expression(const std::string &var) {
+void StringVisitor::visit_var_expression(const Symbol &var, Slot &slot) {
 	push(var);
 }
-void StringVisitor::visit_assign_expression(const std::string &name,
+void StringVisitor::visit_assign_expression(const Symbol &name,
+											Slot &slot,
 											const ExprPtr &value) {
 	value->evaluate(*this);
-	push(name + " = " + pop());
+	push(name.str() + " = " + pop());
 }
-void StringVisitor::visit_fun_call(const ExprPtr &fun, const ExprList &args) {
+void StringVisitor::visit_fun_call(const ExprPtr &fun,
+								   const ExprList &args,
+								   bool tail_call) {
 	std::string arg_str = " ";
 	std::for_each(args.begin(), args.end(), [&arg_str, this](const auto &ex) {
 		ex->evaluate(*this);
@@ -81,7 +79,12 @@ void StringVisitor::visit_fun_call(const ExprPtr &fun, const ExprList &args) {
 	fun->evaluate(*this);
 	push(pop() + "(" + arg_str + ")");
 }
-void StringVisitor::visit_fun_def_statement(const String& name, const Names &names, const StatementPtr &body) {
+void StringVisitor::visit_fun_def_statement(const Symbol &name,
+											Slot &slot,
+											const Names &names,
+											ScopeLayout &layout,
+											const StatementPtr &body,
+											bool memoized) {
 	m_scope++;
 	body->execute(*this);
 
@@ -91,10 +94,14 @@ void StringVisitor::visit_fun_def_statement(const String& name, const Names &nam
 				  [&name_string](const auto &name) {
 					  name_string.append(name + " ");
 				  });
-	push("function " + name + "(" + name_string + ")\n" + pop());
+	push("function " + name.str() + "(" + name_string + ")\n" + pop());
 	m_scope--;
 }
-void StringVisitor::visit_block_statement(const StatementList &block) {
+void StringVisitor::visit_expression_statement(const ExprPtr &expr) {
+	expr->evaluate(*this);
+}
+void StringVisitor::visit_block_statement(const StatementList &block,
+										  ScopeLayout &layout) {
 	std::string result;
 	std::for_each(block.begin(),
 				  block.end(),
@@ -139,7 +146,8 @@ void StringVisitor::visit_while_statement(const ExprPtr &cond,
 
 	push("while " + pop() + " " + body_str);
 }
-void StringVisitor::visit_for_statement(const std::string &name,
+void StringVisitor::visit_for_statement(const Symbol &name,
+                                        Slot &slot,
                                         const ExprPtr &iterable,
                                         const StatementPtr &body) {
 	iterable->evaluate(*this);
@@ -148,7 +156,7 @@ void StringVisitor::visit_for_statement(const std::string &name,
 	auto body_str = pop();
 	auto iterable_str = pop();
 
-	push("for " + name + " in " + iterable_str + " " + body_str);
+	push("for " + name.str() + " in " + iterable_str + " " + body_str);
 }
 void StringVisitor::visit_set_expression(const ExprPtr &obj,
 										 const ExprPtr &name,
@@ -13,10 +13,14 @@ private:
 	std::string get_tabs() const noexcept;
 
 public:
+	explicit StringVisitor(size_t stack_capacity = DEFAULT_STACK_CAPACITY)
+		: StackMachine(stack_capacity) {
+	}
+
 	std::string get_result() noexcept { return pop(); }
 
 	void visit_number_expression(Number n) override;
-	void visit_string_expression(String s) override;
+	void visit_string_expression(const RuntimeValue &s) override;
 	void visit_dict_expression(const std::vector<std::pair<ExprPtr,
 														   ExprPtr>> &) override;
 	void visit_list_expression(const ExprList &) override;
@@ -27,14 +31,25 @@ public:
 							 const ExprPtr &right) override;
 	void visit_binary_expression(const ExprPtr &left,
 								 BinaryOp op,
-								 const ExprPtr &right) override;
+								 const ExprPtr &right,
+								 TypeFeedback &feedback) override;
 	void visit_unary_expression(UnaryOp op, const ExprPtr &expr) override;
-	void visit_var_expression(const std::string &var) override;
-	void visit_assign_expression(const std::string &name,
+	void visit_var_expression(const Symbol &var, Slot &slot) override;
+	void visit_assign_expression(const Symbol &name,
+								 Slot &slot,
 								 const ExprPtr &value) override;
-	void visit_fun_call(const ExprPtr &fun, const ExprList &args) override;
-	void visit_fun_def_statement(const String& name, const Names &names, const StatementPtr &body) override;
-	void visit_block_statement(const StatementList &block) override;
+	void visit_fun_call(const ExprPtr &fun,
+						const ExprList &args,
+						bool tail_call) override;
+	void visit_fun_def_statement(const Symbol &name,
+								 Slot &slot,
+								 const Names &names,
+								 ScopeLayout &layout,
+								 const StatementPtr &body,
+								 bool memoized) override;
+	void visit_expression_statement(const ExprPtr &expr) override;
+	void visit_block_statement(const StatementList &block,
+							   ScopeLayout &layout) override;
 	void visit_break_expression() override;
 	void visit_continue_expression() override;
 	void visit_return_expression(const ExprPtr &expr) override;
@@ -43,7 +58,8 @@ public:
                             const StatementPtr &else_branch) override;
 	void visit_while_statement(const ExprPtr &cond,
                                const StatementPtr &body) override;
-	void visit_for_statement(const std::string &name,
+	void visit_for_statement(const Symbol &name,
+                             Slot &slot,
                              const ExprPtr &iterable,
                              const StatementPtr &body) override;
 	void visit_set_expression(const ExprPtr &obj,
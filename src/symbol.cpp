@@ -0,0 +1,43 @@
+#include "symbol.hpp"
+
+#include <memory>
+#include <unordered_map>
+
+namespace CL {
+std::vector<const Symbol::Entry *> &Symbol::entries() {
+	// Indexed by id, leaked like the table
+	static auto *entries = new std::vector<const Entry *>();
+	return *entries;
+}
+
+Symbol::Table &Symbol::table() {
+	// Never destroyed, so symbols held by statics stay valid until exit
+	static auto *table = new Table();
+	return *table;
+}
+
+std::optional<Symbol> Symbol::find(std::string_view text) {
+	auto &symbols = table();
+	auto found = symbols.find(text);
+	if(found == symbols.end()) {
+		return std::nullopt;
+	}
+	return Symbol(found->second.get());
+}
+
+const Symbol::Entry *Symbol::intern(std::string_view text) {
+	auto &symbols = table();
+	auto found = symbols.find(text);
+	if(found != symbols.end()) {
+		return found->second.get();
+	}
+	auto entry = std::make_unique<Entry>();
+	entry->text = std::string(text);
+	entry->hash = std::hash<std::string>()(entry->text);
+	entry->id = static_cast<uint32_t>(entries().size());
+	auto *result = entry.get();
+	entries().push_back(result);
+	symbols.emplace(result->text, std::move(entry));
+	return result;
+}
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace CL {
+/*
+ * An interned string: the identifiers and string literals of the scripts,
+ * and the names of globals and module members.
+ * Every distinct text is stored once, with its hash, in a symbol table that
+ * lives as long as the process, so symbols are copied as a pointer, hashed
+ * without reading the text and compared by address.
+ * Symbols are also numbered in the order they are interned, so that they can
+ * be stored as a 32-bit id, as the tokens do.
+ */
+class Symbol {
+private:
+	struct Entry {
+		std::string text;
+		size_t hash;
+		uint32_t id;
+		// The string cell of the RuntimeValues made from this symbol
+		mutable const void *cell{nullptr};
+	};
+
+	const Entry *m_entry;
+
+	explicit Symbol(const Entry *entry)
+		: m_entry(entry) {
+	}
+
+	using Table = std::unordered_map<std::string_view, std::unique_ptr<Entry>>;
+
+	static Table &table();
+	static const Entry *intern(std::string_view text);
+	static std::vector<const Entry *> &entries();
+
+	friend class RuntimeValue;
+
+public:
+	explicit Symbol(std::string_view text)
+		: m_entry(intern(text)) {
+	}
+
+	// The symbol of text if it was interned before, without interning it
+	static std::optional<Symbol> find(std::string_view text);
+
+	// The id has to come from a symbol interned before
+	static Symbol from_id(uint32_t id) noexcept {
+		return Symbol(entries()[id]);
+	}
+
+	[[nodiscard]]
+	uint32_t id() const noexcept { return m_entry->id; }
+	[[nodiscard]]
+	const std::string &str() const noexcept { return m_entry->text; }
+	[[nodiscard]]
+	size_t hash() const noexcept { return m_entry->hash; }
+
+	// Symbols can be passed wherever a name is expected
+	operator const std::string &() const noexcept { return m_entry->text; }
+
+	bool operator==(const Symbol &other) const noexcept {
+		return m_entry == other.m_entry;
+	}
+	bool operator!=(const Symbol &other) const noexcept {
+		return m_entry != other.m_entry;
+	}
+
+	struct Hash {
+		size_t operator()(const Symbol &symbol) const noexcept {
+			return symbol.hash();
+		}
+	};
+};
+
+inline std::ostream &operator<<(std::ostream &stream, const Symbol &symbol) {
+	return stream << symbol.str();
+}
+}
+
+template<>
+struct std::hash<CL::Symbol> {
+	size_t operator()(const CL::Symbol &symbol) const noexcept {
+		return symbol.hash();
+	}
+};
@@ -0,0 +1,187 @@
+#include "doctest.h"
+
+#include <optional>
+#include <memory>
+
+#include "script.h"
+#include "value.hpp"
+#include "environment.hpp"
+#include "std_lib.hpp"
+
+TEST_CASE("Testing language constructs with the flat evaluator") {
+    SUBCASE("Testing simple expression") {
+        auto source = "value = (8 - 1 + 3) * 6 - ((3 + 7) * 2)";
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::Flat);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == (8 - 1 + 3) * 6 - ((3 + 7) * 2));
+    }
+
+    SUBCASE("Testing for with break and continue") {
+        auto source = std::string(R"source(
+        value = 0
+        for i in range(0, 100, 1) {
+            if i == 10 {
+                break
+            }
+            if i % 2 == 1 {
+                continue
+            }
+            value = value + i
+        }
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::inject_stdlib_functions(env);
+        CL::Script::from_source(source, env).run(CL::Engine::Flat);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 0 + 2 + 4 + 6 + 8);
+    }
+
+    SUBCASE("Testing while with continue") {
+        auto source = std::string(R"source(
+        value = 0
+        i = 0
+        while i < 10 {
+            i = i + 1
+            if i == 5 {
+                continue
+            }
+            value = value + 1
+        }
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::Flat);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 9);
+    }
+
+    SUBCASE("Testing return from a loop") {
+        auto source = std::string(R"source(
+        function first_above(limit) {
+            for i in range(0, 100, 1) {
+                if i * i > limit {
+                    return i
+                }
+            }
+            return -1
+        }
+        value = first_above(50)
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::inject_stdlib_functions(env);
+        CL::Script::from_source(source, env).run(CL::Engine::Flat);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 8);
+    }
+
+    SUBCASE("Testing recursion") {
+        auto source = std::string(R"source(
+        function fibo(n) {
+            if n < 2 {
+                return n
+            }
+            return fibo(n - 1) + fibo(n - 2)
+        }
+        value = fibo(15)
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::Flat);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 610);
+    }
+
+    SUBCASE("Testing containers and modules") {
+        auto source = std::string(R"source(
+        l = list [1, 2, 3, 4]
+        d = dict { "a" : 1 "b" : 2 }
+        d["c"] = 3
+        m = module { x = 42 }
+        value = l[3] + d["c"] + m.x
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::Flat);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 4 + 3 + 42);
+    }
+
+    SUBCASE("Testing functions called from native code") {
+        auto source = std::string(R"source(
+        function divide(x, y) {
+            return x / y
+        }
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::Flat);
+        auto function = env->get("divide");
+        CHECK(function.as<CL::CallablePtr>()->call({10, 5}) == 2);
+    }
+
+    SUBCASE("Testing script result") {
+        auto source = std::string(R"source(
+        x = 20
+        x * 2 + 2
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        auto result = CL::Script::from_source(source, env).run(CL::Engine::Flat);
+        REQUIRE(result.has_value());
+        CHECK(result->as<CL::Number>() == 42);
+    }
+
+    SUBCASE("Testing closures and scoping") {
+        auto source = std::string(R"source(
+        function make_adder(n) {
+            function add(x) {
+                return x + n
+            }
+            return add
+        }
+        function bump() {
+            count = count + 1
+        }
+        function shadow(x) {
+            return x * 2
+        }
+        count = 0
+        x = 100
+        add_two = make_adder(2)
+        bump()
+        bump()
+        value = add_two(3) + shadow(4) + x + count
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::Flat);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 5 + 8 + 100 + 2);
+    }
+
+    SUBCASE("Testing blocks without locals") {
+        auto source = std::string(R"source(
+        function sum_even(n) {
+            total = 0
+            i = 0
+            while i < n {
+                if i % 2 == 0 {
+                    total = total + i
+                } else {
+                    odd = i
+                    total = total + odd * 0
+                }
+                i = i + 1
+            }
+            result = 0
+            {
+                function get() {
+                    return total
+                }
+                result = get()
+            }
+            return result
+        }
+        value = sum_even(10)
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::Flat);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 0 + 2 + 4 + 6 + 8);
+    }
+}
@@ -0,0 +1,176 @@
+#include "doctest.h"
+
+#include <memory>
+
+#include "gc.hpp"
+#include "slab.hpp"
+#include "script.h"
+#include "value.hpp"
+#include "environment.hpp"
+#include "std_lib.hpp"
+
+TEST_CASE("Testing the cycle collector") {
+    auto &collector = CL::Collector::instance();
+
+    SUBCASE("Testing lists containing themselves") {
+        auto source = std::string(R"source(
+        l = list [1, 2]
+        append = l.append
+        append(l)
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run();
+        collector.collect();
+        auto live = collector.live_objects();
+        env->bind("l", CL::RuntimeValue());
+        CHECK(collector.live_objects() == live);
+        CHECK(collector.collect() > 0);
+        CHECK(collector.live_objects() < live);
+    }
+
+    SUBCASE("Testing closures referenced by their own locals") {
+        auto source = std::string(R"source(
+        function make() {
+            function inner(x) {
+                return inner
+            }
+            return inner
+        }
+        f = make()
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::Script::from_source(source, env).run(engine);
+            auto live = collector.live_objects();
+            env->bind("f", CL::RuntimeValue());
+            CHECK(collector.live_objects() == live);
+            CHECK(collector.collect() > 0);
+            CHECK(collector.live_objects() < live);
+        }
+    }
+
+    SUBCASE("Testing collections triggered by allocations") {
+        auto source = std::string(R"source(
+        i = 0
+        d = 0
+        while i < 5000 {
+            d = dict { "i" : i }
+            d["self"] = d
+            i = i + 1
+        }
+        )source");
+        collector.collect();
+        auto live = collector.live_objects();
+        auto collections = collector.stats().collections;
+        collector.set_threshold(100);
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::Script::from_source(source, env).run(engine);
+            CHECK(env->get("d").get_named("i").as<CL::Number>() == 4999);
+        }
+        collector.set_threshold(CL::DEFAULT_GC_THRESHOLD);
+        CHECK(collector.stats().collections > collections);
+        CHECK(collector.stats().freed_objects > 0);
+        collector.collect();
+        CHECK(collector.live_objects() <= live);
+    }
+
+    SUBCASE("Testing statement values don't outlive the statement") {
+        auto source = std::string(R"source(
+        i = 0
+        while i < 5000 {
+            d = dict { "i" : i }
+            d["self"] = d
+            i = i + 1
+        }
+        d = 0
+        )source");
+        collector.set_threshold(100);
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            collector.collect();
+            auto live = collector.live_objects();
+            auto freed = collector.stats().freed_objects;
+            {
+                auto env = CL::make_ref<CL::StackedEnvironment>();
+                CL::Script::from_source(source, env).run(engine);
+            }
+            CHECK(collector.stats().freed_objects - freed > 4000);
+            collector.collect();
+            CHECK(collector.live_objects() <= live);
+        }
+        collector.set_threshold(CL::DEFAULT_GC_THRESHOLD);
+    }
+
+    SUBCASE("Testing methods outliving their object") {
+        auto source = std::string(R"source(
+        function get_append() {
+            l = list []
+            return l.append
+        }
+        append = get_append()
+        append(1)
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CHECK_THROWS_AS(CL::Script::from_source(source, env).run(engine),
+                            CL::RuntimeException);
+        }
+    }
+}
+
+TEST_CASE("Testing refs") {
+    auto list = CL::make_ref<CL::List>();
+    CHECK(list->use_count() == 1);
+    CL::IndexablePtr copy = list;
+    CHECK(list->use_count() == 2);
+    CHECK(copy == list);
+    auto value = CL::RuntimeValue(std::move(copy));
+    CHECK(copy == nullptr);
+    CHECK(list->use_count() == 2);
+    auto other = value;
+    CHECK(list->use_count() == 2);
+    CHECK(CL::dynamic_ref_cast<CL::List>(value.as<CL::IndexablePtr>()) == list);
+    CHECK(CL::dynamic_ref_cast<CL::Dictionary>(value.as<CL::IndexablePtr>()) == nullptr);
+}
+
+
+TEST_CASE("Testing the slab allocator") {
+    auto &slabs = CL::SlabAllocator::instance();
+    auto in_use = [&](size_t size) -> size_t {
+        for (const auto &size_class : slabs.stats()) {
+            if(size_class.slot_size == size) {
+                return size_class.in_use;
+            }
+        }
+        return 0;
+    };
+
+    SUBCASE("Testing slots are reused") {
+        auto *first = slabs.allocate(40);
+        auto used = in_use(48);
+        CHECK(used > 0);
+        slabs.deallocate(first, 40);
+        CHECK(in_use(48) == used - 1);
+        auto *second = slabs.allocate(33);
+        CHECK(second == first);
+        slabs.deallocate(second, 33);
+    }
+
+    SUBCASE("Testing runtime objects come from the slabs") {
+        auto size = (sizeof(CL::List) + CL::SLAB_ALIGNMENT - 1)
+                    / CL::SLAB_ALIGNMENT * CL::SLAB_ALIGNMENT;
+        auto used = in_use(size);
+        {
+            auto list = CL::make_ref<CL::List>();
+            CHECK(in_use(size) == used + 1);
+        }
+        CHECK(in_use(size) == used);
+    }
+
+    SUBCASE("Testing large allocations bypass the slabs") {
+        auto reserved = slabs.reserved_bytes();
+        auto *block = slabs.allocate(CL::SLAB_MAX_SIZE + 1);
+        CHECK(slabs.reserved_bytes() == reserved);
+        slabs.deallocate(block, CL::SLAB_MAX_SIZE + 1);
+    }
+}
@@ -4,10 +4,17 @@
 
 #include "doctest.h"
 
+#include <cmath>
+#include <cstdio>
+#include <fstream>
 #include <optional>
 #include <memory>
 
+#include "exceptions.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
 #include "script.h"
+#include "tokens.hpp"
 #include "value.hpp"
 #include "environment.hpp"
 #include "std_lib.hpp"
@@ -15,8 +22,8 @@
 TEST_CASE("Testing language constructs with the AST evaluator") {
     SUBCASE("Testing simple expression") {
         auto source = "value = (8 - 1 + 3) * 6 - ((3 + 7) * 2)";
-        auto env = std::make_shared<CL::StackedEnvironment>();
-        CL::Script::from_source(source, env).run();
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
         auto value = env->get("value");
         CHECK(value.as<CL::Number>() == (8 - 1 + 3) * 6 - ((3 + 7) * 2));
     }
@@ -29,9 +36,9 @@ TEST_CASE("Testing language constructs with the AST evaluator") {
         }
         value
         )source");
-        auto env = std::make_shared<CL::StackedEnvironment>();
+        auto env = CL::make_ref<CL::StackedEnvironment>();
         CL::inject_stdlib_functions(env);
-        CL::Script::from_source(source, env).run();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
         auto value = env->get("value");
             CHECK(value.as<CL::Number>() == 9 * 10 / 2);
     }
@@ -46,9 +53,9 @@ TEST_CASE("Testing language constructs with the AST evaluator") {
         }
         value
         )source");
-        auto env = std::make_shared<CL::StackedEnvironment>();
+        auto env = CL::make_ref<CL::StackedEnvironment>();
         CL::inject_stdlib_functions(env);
-        CL::Script::from_source(source, env).run();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
         auto value = env->get("value");
             CHECK(value.as<CL::Number>() == 9 * 10 / 2);
     }
@@ -63,9 +70,9 @@ TEST_CASE("Testing language constructs with the AST evaluator") {
         } else {
             value = "no"
         })source");
-        auto env = std::make_shared<CL::StackedEnvironment>();
+        auto env = CL::make_ref<CL::StackedEnvironment>();
         CL::inject_stdlib_functions(env);
-        CL::Script::from_source(source, env).run();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
         auto value = env->get("value");
         CHECK(value.as<CL::String>() == "yes");
     }
@@ -80,9 +87,9 @@ TEST_CASE("Testing language constructs with the AST evaluator") {
         } else {
             value = "no"
         })source");
-        auto env = std::make_shared<CL::StackedEnvironment>();
+        auto env = CL::make_ref<CL::StackedEnvironment>();
         CL::inject_stdlib_functions(env);
-        CL::Script::from_source(source, env).run();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
         auto value = env->get("value");
                 CHECK(value.as<CL::String>() == "no");
     }
@@ -94,9 +101,9 @@ TEST_CASE("Testing language constructs with the AST evaluator") {
         }
         value = forty_two()
         )source");
-        auto env = std::make_shared<CL::StackedEnvironment>();
+        auto env = CL::make_ref<CL::StackedEnvironment>();
         CL::inject_stdlib_functions(env);
-        CL::Script::from_source(source, env).run();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
         auto value = env->get("value");
         CHECK(value.as<CL::Number>() == 42);
     }
@@ -107,10 +114,452 @@ TEST_CASE("Testing language constructs with the AST evaluator") {
             return x / y
         }
         )source");
-        auto env = std::make_shared<CL::StackedEnvironment>();
+        auto env = CL::make_ref<CL::StackedEnvironment>();
         CL::inject_stdlib_functions(env);
-        CL::Script::from_source(source, env).run();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
         auto function = env->get("divide");
         CHECK(function.as<CL::CallablePtr>()->call({10, 5}) == 2);
     }
-}
\ No newline at end of file
+
+    SUBCASE("Testing closures and scoping") {
+        auto source = std::string(R"source(
+        function make_adder(n) {
+            function add(x) {
+                return x + n
+            }
+            return add
+        }
+        function bump() {
+            count = count + 1
+        }
+        function shadow(x) {
+            return x * 2
+        }
+        count = 0
+        x = 100
+        add_two = make_adder(2)
+        bump()
+        bump()
+        value = add_two(3) + shadow(4) + x + count
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 5 + 8 + 100 + 2);
+    }
+
+    SUBCASE("Testing operators seeing different operand types") {
+        auto source = std::string(R"source(
+        function join(a, b) {
+            return a + b
+        }
+        function less(a, b) {
+            return a < b
+        }
+        numbers = join(1, 2)
+        strings = join("a", "b")
+        mixed = join("a", 1)
+        value = less(1, 2) and less("a", "b") and less(3, 4)
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
+        CHECK(env->get("numbers").as<CL::Number>() == 3);
+        CHECK(env->get("strings").as<CL::String>() == "ab");
+        CHECK(env->get("mixed").as<CL::String>() == "a1");
+        CHECK(env->get("value").as<bool>());
+    }
+
+    SUBCASE("Testing recursion and calls from native code") {
+        auto source = std::string(R"source(
+        function fibo(n) {
+            if n < 2 {
+                return n
+            }
+            return fibo(n - 1) + fibo(n - 2)
+        }
+        value = fibo(15)
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
+        CHECK(env->get("value").as<CL::Number>() == 610);
+        auto fibo = env->get("fibo").as<CL::CallablePtr>();
+        CHECK(fibo->call({10}).value() == 55);
+        CHECK(fibo->call({1}).value() == 1);
+    }
+
+    SUBCASE("Testing blocks without locals") {
+        auto source = std::string(R"source(
+        function sum_even(n) {
+            total = 0
+            i = 0
+            while i < n {
+                if i % 2 == 0 {
+                    total = total + i
+                } else {
+                    odd = i
+                    total = total + odd * 0
+                }
+                i = i + 1
+            }
+            result = 0
+            {
+                function get() {
+                    return total
+                }
+                result = get()
+            }
+            return result
+        }
+        value = sum_even(10)
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 0 + 2 + 4 + 6 + 8);
+    }
+
+    SUBCASE("Testing tail calls") {
+        auto source = std::string(R"source(
+        function count(n, acc) {
+            if n == 0 {
+                return acc
+            }
+            return count(n - 1, acc + 1)
+        }
+        function is_even(n) {
+            while n > 0 {
+                return is_odd(n - 1)
+            }
+            return 1
+        }
+        function is_odd(n) {
+            if n == 0 {
+                return 0
+            }
+            return is_even(n - 1)
+        }
+        value = count(200000, 0)
+        even = is_even(100001)
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::Script::from_source(source, env).run(engine);
+            CHECK(env->get("value").as<CL::Number>() == 200000);
+            CHECK(env->get("even").as<CL::Number>() == 0);
+            auto count = env->get("count").as<CL::CallablePtr>();
+            CHECK(count->call({100000, 1}).value() == 100001);
+        }
+    }
+
+    SUBCASE("Testing maximum call depth") {
+        auto source = std::string(R"source(
+        function depth(n) {
+            if n == 0 {
+                return 0
+            }
+            return 1 + depth(n - 1)
+        }
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
+        auto depth = env->get("depth").as<CL::CallablePtr>();
+        CHECK_THROWS_AS(depth->call({100000}), CL::RuntimeException);
+        CHECK(depth->call({500}).value() == 500);
+    }
+}
+
+TEST_CASE("Testing runtime values") {
+    SUBCASE("Testing immediates") {
+        CHECK(sizeof(CL::RuntimeValue) == 8);
+        CHECK(CL::RuntimeValue().is<std::monostate>());
+        CHECK(CL::RuntimeValue(true).as<bool>());
+        CHECK(CL::RuntimeValue(-2.5).as<CL::Number>() == -2.5);
+        auto nan = CL::RuntimeValue(std::nan(""));
+        CHECK(nan.is<CL::Number>());
+        CHECK(nan != nan);
+    }
+
+    SUBCASE("Testing heap values") {
+        auto hello = CL::RuntimeValue(CL::String("hello"));
+        auto copy = hello;
+        CHECK(copy.as<CL::String>() == "hello");
+        CHECK(copy == CL::RuntimeValue(CL::String("hello")));
+        CHECK((hello + CL::RuntimeValue(1.0)).as<CL::String>() == "hello1");
+        CHECK(!hello.is<CL::Number>());
+        CHECK(!hello.is<CL::CallablePtr>());
+        CL::Dict dict;
+        dict[hello] = 42;
+        CHECK(dict.at(CL::RuntimeValue(CL::String("hello"))) == 42);
+    }
+
+    SUBCASE("Testing container methods") {
+        auto source = std::string(R"source(
+        l = list [1, 2, 3]
+        append = l.append
+        append(4)
+        find = l.find
+        index = find(3)
+        d = dict { "a" : 1 }
+        contains = d.contains
+        has_a = contains("a")
+        has_b = contains("b")
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::AST);
+        auto l = env->get("l");
+        CHECK(l.get_property(CL::RuntimeValue(CL::Number(3))).as<CL::Number>() == 4);
+        CHECK(env->get("index").as<CL::Number>() == 2);
+        CHECK(env->get("has_a").is_truthy());
+        CHECK(!env->get("has_b").is_truthy());
+        // Methods are bound once per instance
+        CHECK(l.get_named("append") == env->get("append"));
+    }
+
+    SUBCASE("Testing interned strings") {
+        auto name = CL::Symbol("name");
+        CHECK(name == CL::Symbol(std::string("na") + "me"));
+        CHECK(name != CL::Symbol("other"));
+        CHECK(name.hash() == std::hash<std::string>()("name"));
+        auto interned = CL::RuntimeValue(name);
+        auto copy = CL::RuntimeValue(CL::String("name"));
+        CHECK(interned == CL::RuntimeValue(name));
+        CHECK(interned == copy);
+        CHECK(interned.hash() == copy.hash());
+        CHECK(interned != CL::RuntimeValue(CL::Symbol("other")));
+
+        auto source = std::string(R"source(
+        prefix = "ke"
+        d = dict { "key" : 1 }
+        d[prefix + "y"] = 2
+        value = d.key
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::Script::from_source(source, env).run(engine);
+            CHECK(env->get("value").as<CL::Number>() == 2);
+            CHECK(env->get(CL::Symbol("value")).as<CL::Number>() == 2);
+        }
+    }
+
+    SUBCASE("Testing string slices") {
+        auto slice = CL::RuntimeValue();
+        const char *text = nullptr;
+        {
+            auto line = CL::RuntimeValue(CL::String("2024-01-01 ERROR disk full"));
+            text = line.as<CL::String>().data();
+            slice = line.slice(11, 5);
+            CHECK(line.as<CL::String>() == "2024-01-01 ERROR disk full");
+        }
+        // The slice keeps the text of the line alive and shares it
+        CHECK(slice.as<CL::String>() == "ERROR");
+        CHECK(slice.as<CL::String>().data() == text + 11);
+        auto inner = slice.slice(1, 100);
+        CHECK(inner.as<CL::String>() == "RROR");
+        CHECK(inner.as<CL::String>().data() == text + 12);
+        CHECK(slice == CL::RuntimeValue(CL::String("ERROR")));
+        CHECK(slice.hash() == CL::RuntimeValue(CL::String("ERROR")).hash());
+        CHECK_THROWS_AS((void)slice.slice(6, 1), CL::RuntimeException);
+
+        auto source = std::string(R"source(
+        line = "level=warn"
+        level = substring(line, 6, length(line) - 6)
+        is_warn = level == "warn"
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::inject_stdlib_functions(env);
+            CL::Script::from_source(source, env).run(engine);
+            CHECK(env->get("level").as<CL::String>() == "warn");
+            CHECK(env->get("is_warn").is_truthy());
+        }
+    }
+
+    SUBCASE("Testing ropes") {
+        auto source = std::string(R"source(
+        out = ""
+        i = 0
+        while i < 100000 {
+            out = out + "ab"
+            i = i + 1
+        }
+        prefix = out + "!"
+        size = length(out)
+        tail = substring(prefix, 199998, 3)
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::inject_stdlib_functions(env);
+            CL::Script::from_source(source, env).run(engine);
+            CHECK(env->get("size").as<CL::Number>() == 200000);
+            CHECK(env->get("tail").as<CL::String>() == "ab!");
+            CHECK(env->get("out") != env->get("prefix"));
+        }
+    }
+
+    SUBCASE("Testing string builders") {
+        auto source = std::string(R"source(
+        builder = StringBuilder()
+        builder.append("total: ")
+        builder.append(42)
+        text = builder.build()
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::inject_stdlib_functions(env);
+        CL::Script::from_source(source, env).run();
+        CHECK(env->get("text").as<CL::String>() == "total: 42");
+    }
+
+    SUBCASE("Testing number formatting") {
+        CHECK(CL::number_to_string(30) == "30");
+        CHECK(CL::number_to_string(-12) == "-12");
+        CHECK(CL::number_to_string(3.5) == "3.5");
+        CHECK(CL::number_to_string(0.1 + 0.2) == "0.30000000000000004");
+        CHECK(CL::number_to_string(-0.0) == "-0");
+        CHECK(CL::number_to_string(9007199254740991) == "9007199254740991");
+        CHECK(CL::number_to_string(1e21) == "1e+21");
+        CHECK(CL::number_to_string(1e-7) == "1e-07");
+        for (auto n : {1.0 / 3, 2.0 / 3, 1e300, 5e-324, 123456.789}) {
+            CHECK(std::strtod(CL::number_to_string(n).c_str(), nullptr) == n);
+        }
+        CHECK(CL::RuntimeValue(2.25).string_representation() == "2.25");
+
+        auto source = std::string(R"source(
+        row = "x," + 1 / 2 + "," + 7
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::Script::from_source(source, env, CL::OptimizationLevel::O0).run(engine);
+            CHECK(env->get("row").as<CL::String>() == "x,0.5,7");
+        }
+    }
+}
+
+TEST_CASE("Testing the lexer") {
+    SUBCASE("Testing tokens read in place") {
+        auto source = std::string("value = 12.5\nname = \"a\\tb\" + 'plain'");
+        auto lexer = CL::Lexer(source);
+        auto value = lexer.next();
+        CHECK(value.get_type() == CL::TokenType::Identifier);
+        CHECK(value.get_symbol() == CL::Symbol("value"));
+        CHECK(lexer.text(value) == "value");
+        CHECK(lexer.location(value).text == "value = 12.5");
+        CHECK(lexer.next().get_type() == CL::TokenType::Assign);
+        CHECK(lexer.number(lexer.next()) == 12.5);
+        auto name = lexer.next();
+        CHECK(lexer.location(name).line == 2);
+        CHECK(lexer.location(name).text == "name = \"a\\tb\" + 'plain'");
+        lexer.next();
+        auto escaped = lexer.next();
+        CHECK_FALSE(escaped.has_symbol());
+        CHECK(lexer.string(escaped) == "a\tb");
+        CHECK(lexer.text(escaped) == "\"a\\tb\"");
+        auto plus = lexer.next();
+        CHECK(lexer.location(plus).column == 15);
+        CHECK(lexer.string(lexer.next()) == "plain");
+        CHECK(lexer.next().get_type() == CL::TokenType::Eof);
+    }
+
+    SUBCASE("Testing keywords") {
+        auto source = std::string("if iff while whilst function fun list lists in i");
+        auto lexer = CL::Lexer(source);
+        CHECK(lexer.next().get_type() == CL::TokenType::If);
+        CHECK(lexer.next().get_type() == CL::TokenType::Identifier);
+        CHECK(lexer.next().get_type() == CL::TokenType::While);
+        CHECK(lexer.next().get_type() == CL::TokenType::Identifier);
+        CHECK(lexer.next().get_type() == CL::TokenType::Fun);
+        CHECK(lexer.next().get_type() == CL::TokenType::Identifier);
+        CHECK(lexer.next().get_type() == CL::TokenType::List);
+        CHECK(lexer.next().get_type() == CL::TokenType::Identifier);
+        CHECK(lexer.next().get_type() == CL::TokenType::In);
+        CHECK(lexer.next().get_symbol().str() == "i");
+    }
+
+    SUBCASE("Testing numbers out of range") {
+        auto huge = std::string(401, '9');
+        CHECK_THROWS_AS(CL::Lexer(huge).next(), CL::CLException);
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CHECK_THROWS_AS(CL::Script::from_source("value = " + huge, env), CL::CLException);
+    }
+
+    SUBCASE("Testing scripts read from files") {
+        auto path = std::string("lexer_test_script.calc");
+        {
+            std::ofstream file(path);
+            file << "total = 0\nfor i in range(0, 4, 1) {\n    total = total + i\n}\n";
+        }
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::inject_stdlib_functions(env);
+        CL::Script::from_file(path, env).run();
+        std::remove(path.c_str());
+        CHECK(env->get("total").as<CL::Number>() == 6);
+        CHECK_THROWS_AS(CL::Script::from_file(path, env), CL::FileNotFoundException);
+        // Devices and pipes can't be mapped, they are read instead
+        CHECK_NOTHROW(CL::Script::from_file("/dev/null", env).run());
+    }
+}
+
+TEST_CASE("Testing the parser") {
+    SUBCASE("Testing operator precedence") {
+        auto source = std::string(R"source(
+        a = 2 + 3 * 4 ^ 2 - 10 / 5
+        b = -2 ^ 2
+        c = 2 ^ 3 ^ 2
+        d = 1 < 2 and 3 == 3 or 0 > 1
+        e = 20 - 5 - 3 % 2
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::Script::from_source(source, env, CL::OptimizationLevel::O0).run(engine);
+            CHECK(env->get("a").as<CL::Number>() == 48);
+            CHECK(env->get("b").as<CL::Number>() == -4);
+            CHECK(env->get("c").as<CL::Number>() == 512);
+            CHECK(env->get("d").as<bool>());
+            CHECK(env->get("e").as<CL::Number>() == 14);
+        }
+    }
+
+    SUBCASE("Testing deeply nested expressions") {
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        auto nested = [](size_t depth) {
+            return "x = " + std::string(depth, '(') + "1" + std::string(depth, ')');
+        };
+        CL::Script::from_source(nested(CL::MAX_PARSE_DEPTH / 2), env).run();
+        CHECK(env->get("x").as<CL::Number>() == 1);
+        CHECK_THROWS_AS(CL::Script::from_source(nested(100000), env), CL::CLException);
+        CHECK_THROWS_AS(CL::Script::from_source("x = " + std::string(100000, '-') + "1", env),
+                        CL::CLException);
+    }
+}
+
+TEST_CASE("Testing streamed scripts") {
+    auto path = std::string("stream_test_script.calc");
+    {
+        std::ofstream file(path);
+        file << "function square(x) { return x * x }\n";
+        for (int i = 0; i < 1000; i++) {
+            file << "total = " << (i == 0 ? "0" : "total") << " + square(" << i % 10 << ")\n";
+        }
+        file << "total\n";
+    }
+
+    SUBCASE("Testing statements run as they are parsed") {
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            auto result = CL::Script::stream_file(path, env, CL::OptimizationLevel::O1, false, engine);
+            CHECK(env->get("total").as<CL::Number>() == 28500);
+            REQUIRE(result.has_value());
+            CHECK(result->as<CL::Number>() == 28500);
+        }
+    }
+
+    SUBCASE("Testing statements before a syntax error") {
+        {
+            std::ofstream file(path, std::ios::app);
+            file << "after = 1\nbroken = (\n";
+        }
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CHECK_THROWS_AS(CL::Script::stream_file(path, env), CL::CLException);
+        CHECK(env->get("after").as<CL::Number>() == 1);
+    }
+    std::remove(path.c_str());
+}
@@ -0,0 +1,189 @@
+#include "doctest.h"
+
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include <memory>
+
+#include "script.h"
+#include "value.hpp"
+#include "environment.hpp"
+#include "std_lib.hpp"
+
+TEST_CASE("Testing the optimizer") {
+    SUBCASE("Testing folded arithmetic") {
+        auto source = std::string(R"source(
+        value = 0
+        i = 0
+        while i < 10 {
+            value = value + (2 * 3 + 4) / 5 - -1
+            i = i + 1
+        }
+        text = "a" + "b" + 3
+        )source");
+        for (auto level : {CL::OptimizationLevel::O0,
+                           CL::OptimizationLevel::O1,
+                           CL::OptimizationLevel::O2}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::Script::from_source(source, env, level).run();
+            CHECK(env->get("value").as<CL::Number>() == 30);
+            CHECK(env->get("text").as<CL::String>() == "ab3");
+        }
+    }
+
+    SUBCASE("Testing propagated const globals") {
+        auto source = std::string(R"source(
+        value = LIMIT * 2
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        env->assign("LIMIT", CL::RuntimeValue(CL::Number(21)), true);
+        CL::Script::from_source(source, env, CL::OptimizationLevel::O1).run();
+        CHECK(env->get("value").as<CL::Number>() == 42);
+    }
+
+    SUBCASE("Testing shadowed const globals") {
+        auto source = std::string(R"source(
+        function twice(LIMIT) {
+            return LIMIT * 2
+        }
+        value = twice(5)
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        env->assign("LIMIT", CL::RuntimeValue(CL::Number(21)), true);
+        CL::Script::from_source(source, env, CL::OptimizationLevel::O2).run();
+        CHECK(env->get("value").as<CL::Number>() == 10);
+    }
+
+    SUBCASE("Testing propagated const members") {
+        auto source = std::string(R"source(
+        value = Math.PI * 2
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::inject_math_functions(env);
+        CL::Script::from_source(source, env, CL::OptimizationLevel::O2).run();
+        auto pi = env->get("Math").get_property(CL::String("PI"));
+        CHECK(env->get("value").as<CL::Number>() == pi.as<CL::Number>() * 2);
+    }
+
+    SUBCASE("Testing const members of containers passed to functions") {
+        auto source = std::string(R"source(
+        function g(m) {
+            m.PI = 3
+            return m
+        }
+        first = g(Math).PI
+        second = Math.PI
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::inject_math_functions(env);
+            CL::Script::from_source(source, env, CL::OptimizationLevel::O2).run(engine);
+            CHECK(env->get("first").as<CL::Number>() == 3);
+            CHECK(env->get("second").as<CL::Number>() == 3);
+        }
+    }
+
+    SUBCASE("Testing memoized pure functions") {
+        auto source = std::string(R"source(
+        function fibo(n) {
+            if n < 2 {
+                return n
+            }
+            return fibo(n - 1) + fibo(n - 2)
+        }
+        function hypot(a, b) {
+            return (Math.pow)(a * a + b * b, 1 / 2)
+        }
+        value = fibo(80)
+        side = hypot(3, 4)
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::inject_math_functions(env);
+            CL::Script::from_source(source, env, CL::OptimizationLevel::O1, true)
+                .run(engine);
+            CHECK(env->get("value").as<CL::Number>() == 23416728348467685);
+            CHECK(env->get("side").as<CL::Number>() == 5);
+        }
+    }
+
+    SUBCASE("Testing impure functions are not memoized") {
+        auto source = std::string(R"source(
+        calls = 0
+        scale = 1
+        function counted(n) {
+            calls = calls + 1
+            return n
+        }
+        function scaled(n) {
+            return n * scale
+        }
+        counted(1)
+        counted(1)
+        first = scaled(2)
+        scale = 10
+        second = scaled(2)
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::Script::from_source(source, env, CL::OptimizationLevel::O1, true)
+                .run(engine);
+            CHECK(env->get("calls").as<CL::Number>() == 2);
+            CHECK(env->get("first").as<CL::Number>() == 2);
+            CHECK(env->get("second").as<CL::Number>() == 20);
+        }
+    }
+
+    SUBCASE("Testing functions reading mutated const containers are not memoized") {
+        auto source = std::string(R"source(
+        function circle(r) {
+            return Math.PI * r
+        }
+        before = circle(1)
+        Math.PI = 7
+        after = circle(1)
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::inject_math_functions(env);
+            CL::Script::from_source(source, env, CL::OptimizationLevel::O1, true)
+                .run(engine);
+            CHECK(env->get("before").as<CL::Number>() == doctest::Approx(3.14159265));
+            CHECK(env->get("after").as<CL::Number>() == 7);
+        }
+
+        auto path = std::string("memo_stream_test_script.calc");
+        {
+            std::ofstream file(path);
+            file << source;
+        }
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::inject_math_functions(env);
+        CL::Script::stream_file(path, env, CL::OptimizationLevel::O1, true);
+        std::remove(path.c_str());
+        CHECK(env->get("after").as<CL::Number>() == 7);
+    }
+
+    SUBCASE("Testing functions reading const containers mutated through an alias are not memoized") {
+        auto source = std::string(R"source(
+        function area(r) {
+            return Math.PI * r * r
+        }
+        function g(m) {
+            m.PI = 3
+            return m
+        }
+        before = area(1)
+        g(Math)
+        after = area(1)
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::inject_math_functions(env);
+            CL::Script::from_source(source, env, CL::OptimizationLevel::O1, true)
+                .run(engine);
+            CHECK(env->get("before").as<CL::Number>() == doctest::Approx(3.14159265));
+            CHECK(env->get("after").as<CL::Number>() == 3);
+        }
+    }
+}
@@ -0,0 +1,394 @@
+#include "doctest.h"
+
+#include <optional>
+#include <memory>
+
+#include "script.h"
+#include "value.hpp"
+#include "environment.hpp"
+#include "gc.hpp"
+#include "std_lib.hpp"
+
+TEST_CASE("Testing language constructs with the VM") {
+    SUBCASE("Testing simple expression") {
+        auto source = "value = (8 - 1 + 3) * 6 - ((3 + 7) * 2)";
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::VM);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == (8 - 1 + 3) * 6 - ((3 + 7) * 2));
+    }
+
+    SUBCASE("Testing for with break and continue") {
+        auto source = std::string(R"source(
+        value = 0
+        for i in range(0, 100, 1) {
+            if i == 10 {
+                break
+            }
+            if i % 2 == 1 {
+                continue
+            }
+            value = value + i
+        }
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::inject_stdlib_functions(env);
+        CL::Script::from_source(source, env).run(CL::Engine::VM);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 0 + 2 + 4 + 6 + 8);
+    }
+
+    SUBCASE("Testing while with continue") {
+        auto source = std::string(R"source(
+        value = 0
+        i = 0
+        while i < 10 {
+            i = i + 1
+            if i == 5 {
+                continue
+            }
+            value = value + 1
+        }
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::VM);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 9);
+    }
+
+    SUBCASE("Testing return from a loop") {
+        auto source = std::string(R"source(
+        function first_above(limit) {
+            for i in range(0, 100, 1) {
+                if i * i > limit {
+                    return i
+                }
+            }
+            return -1
+        }
+        value = first_above(50)
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::inject_stdlib_functions(env);
+        CL::Script::from_source(source, env).run(CL::Engine::VM);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 8);
+    }
+
+    SUBCASE("Testing recursion") {
+        auto source = std::string(R"source(
+        function fibo(n) {
+            if n < 2 {
+                return n
+            }
+            return fibo(n - 1) + fibo(n - 2)
+        }
+        value = fibo(15)
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::VM);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 610);
+    }
+
+    SUBCASE("Testing containers and modules") {
+        auto source = std::string(R"source(
+        l = list [1, 2, 3, 4]
+        d = dict { "a" : 1 "b" : 2 }
+        d["c"] = 3
+        m = module { x = 42 }
+        value = l[3] + d["c"] + m.x
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::VM);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 4 + 3 + 42);
+
+        auto lookup = CL::Script::from_source("m[\"never_bound_\" + \"key\"]", env);
+        CHECK_THROWS_AS(lookup.run(CL::Engine::VM), CL::RuntimeException);
+        CHECK_FALSE(CL::Symbol::find("never_bound_key").has_value());
+    }
+
+    SUBCASE("Testing functions called from native code") {
+        auto source = std::string(R"source(
+        function divide(x, y) {
+            return x / y
+        }
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::VM);
+        auto function = env->get("divide");
+        CHECK(function.as<CL::CallablePtr>()->call({10, 5}) == 2);
+    }
+
+    SUBCASE("Testing script result") {
+        auto source = std::string(R"source(
+        x = 20
+        x * 2 + 2
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        auto result = CL::Script::from_source(source, env).run(CL::Engine::VM);
+        REQUIRE(result.has_value());
+        CHECK(result->as<CL::Number>() == 42);
+    }
+
+    SUBCASE("Testing closures and scoping") {
+        auto source = std::string(R"source(
+        function make_adder(n) {
+            function add(x) {
+                return x + n
+            }
+            return add
+        }
+        function bump() {
+            count = count + 1
+        }
+        function shadow(x) {
+            return x * 2
+        }
+        count = 0
+        x = 100
+        add_two = make_adder(2)
+        bump()
+        bump()
+        value = add_two(3) + shadow(4) + x + count
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::VM);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 5 + 8 + 100 + 2);
+    }
+
+    SUBCASE("Testing locals assigned after nested functions") {
+        auto source = std::string(R"source(
+        function make(n) {
+            function clo() {
+                return n + total
+            }
+            total = n * 10
+            return clo
+        }
+        function outer() {
+            function a(n) {
+                if n == 0 {
+                    return 0
+                }
+                return b(n - 1)
+            }
+            function b(n) {
+                return a(n) + 1
+            }
+            return a(6)
+        }
+        clo = make(2)
+        value = clo() + outer()
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::Script::from_source(source, env).run(engine);
+            CHECK(env->get("value").as<CL::Number>() == 22 + 6);
+        }
+    }
+
+    SUBCASE("Testing blocks without locals") {
+        auto source = std::string(R"source(
+        function sum_even(n) {
+            total = 0
+            i = 0
+            while i < n {
+                if i % 2 == 0 {
+                    total = total + i
+                } else {
+                    odd = i
+                    total = total + odd * 0
+                }
+                i = i + 1
+            }
+            result = 0
+            {
+                function get() {
+                    return total
+                }
+                result = get()
+            }
+            return result
+        }
+        value = sum_even(10)
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::VM);
+        auto value = env->get("value");
+        CHECK(value.as<CL::Number>() == 0 + 2 + 4 + 6 + 8);
+    }
+
+    SUBCASE("Testing locals kept on the stack") {
+        auto source = std::string(R"source(
+        function leaf(a, b) {
+            t = a * 2
+            if a > 0 {
+                u = t + b
+                return leaf(a - 1, u)
+            }
+            return t + b
+        }
+        function outer(n) {
+            k = n + 1
+            function inner(m) {
+                return m + k
+            }
+            total = 0
+            i = 0
+            while i < n {
+                j = i * 2
+                if j > 6 {
+                    break
+                }
+                total = total + inner(j)
+                i = i + 1
+            }
+            return total
+        }
+        getters = list []
+        i = 0
+        while i < 3 {
+            v = i * 3
+            function get() {
+                return v
+            }
+            getters.append(get)
+            i = i + 1
+        }
+        value = leaf(5, 1) + outer(10) + getters[0]() + getters[2]()
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            CL::Script::from_source(source, env).run(engine);
+            CHECK(env->get("value").as<CL::Number>() == 31 + 56 + 0 + 6);
+        }
+    }
+
+    SUBCASE("Testing cached global lookups") {
+        auto source = std::string(R"source(
+        g = 1
+        function read() {
+            return g
+        }
+        first = read()
+        g = 2
+        second = read()
+        m = module { g = 5 inner = g }
+        third = read() + g
+        total = 0
+        i = 0
+        while i < 3 {
+            n = module { k = i * 2 total = total + k }
+            i = i + 1
+        }
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        CL::Script::from_source(source, env).run(CL::Engine::VM);
+        CHECK(env->get("first").as<CL::Number>() == 1);
+        CHECK(env->get("second").as<CL::Number>() == 2);
+        CHECK(env->get("m").get_named("inner").as<CL::Number>() == 5);
+        CHECK(env->get("third").as<CL::Number>() == 10);
+        CHECK(env->get("total").as<CL::Number>() == 0 + 2 + 4);
+
+        env->assign("limit", 10, true);
+        auto store = CL::Script::from_source("x = limit\nlimit = 3", env);
+        CHECK_THROWS_AS(store.run(CL::Engine::VM), CL::RuntimeException);
+        CHECK(env->get("limit").as<CL::Number>() == 10);
+    }
+
+    SUBCASE("Testing maximum call depth") {
+        auto source = std::string(R"source(
+        function depth(n) {
+            if n == 0 {
+                return 0
+            }
+            return 1 + depth(n - 1)
+        }
+        value = depth(200000)
+        )source");
+        auto env = CL::make_ref<CL::StackedEnvironment>();
+        auto script = CL::Script::from_source(source, env);
+        CHECK_THROWS_AS(script.run(CL::Engine::VM, 1000), CL::RuntimeException);
+        env->assign("value", CL::RuntimeValue());
+        CHECK_NOTHROW(script.run(CL::Engine::VM, 300000));
+        CHECK(env->get("value").as<CL::Number>() == 200000);
+        // The function and the environment it's defined in reference each other
+        env->assign("depth", CL::RuntimeValue());
+    }
+
+    SUBCASE("Testing maximum call depth through native calls") {
+        // __next is called by the engine, each level nests another loop
+        auto source = std::string(R"source(
+        function make(n) {
+            it = dict { "i": 0 }
+            function has() {
+                return it["i"] < 1
+            }
+            function nxt() {
+                it["i"] = it["i"] + 1
+                total = 0
+                for x in make(n + 1) {
+                    total = total + x
+                }
+                return total + 1
+            }
+            it["__has_next"] = has
+            it["__next"] = nxt
+            return it
+        }
+        for v in make(0) {
+            value = v
+        }
+        )source");
+        for (auto engine : {CL::Engine::VM, CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            auto script = CL::Script::from_source(source, env);
+            CHECK_THROWS_AS(script.run(engine, 500), CL::RuntimeException);
+            env->assign("make", CL::RuntimeValue());
+        }
+        // Every level left a dict and the functions reading it in a cycle
+        CL::Collector::instance().collect();
+    }
+
+    SUBCASE("Testing maximum call depth on the tree walking engines") {
+        auto source = std::string(R"source(
+        function depth(n) {
+            if n == 0 {
+                return 0
+            }
+            return 1 + depth(n - 1)
+        }
+        value = depth(200)
+        )source");
+        for (auto engine : {CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            auto script = CL::Script::from_source(source, env);
+            CHECK_THROWS_AS(script.run(engine, 100), CL::RuntimeException);
+            env->assign("value", CL::RuntimeValue());
+            CHECK_NOTHROW(script.run(engine));
+            CHECK(env->get("value").as<CL::Number>() == 200);
+            env->assign("depth", CL::RuntimeValue());
+        }
+    }
+
+    SUBCASE("Testing the native stack bounds the tree walking engines") {
+        auto source = std::string(R"source(
+        function depth(n) {
+            if n == 0 {
+                return 0
+            }
+            return 1 + depth(n - 1)
+        }
+        value = depth(10000000)
+        )source");
+        for (auto engine : {CL::Engine::AST, CL::Engine::Flat}) {
+            auto env = CL::make_ref<CL::StackedEnvironment>();
+            auto script = CL::Script::from_source(source, env);
+            CHECK_THROWS_AS(script.run(engine, 100000000), CL::RuntimeException);
+            env->assign("depth", CL::RuntimeValue());
+        }
+    }
+}
@@ -1,24 +1,7 @@
 #include "tokens.hpp"
 #include "commons.hpp"
 
-#include <optional>
 #include <string>
-#include <utility>
-
-template<typename... Ts>
-struct make_overload : Ts ... {
-	using Ts::operator()...;
-};
-template<typename... Ts>
-make_overload(Ts...) -> make_overload<Ts...>;
-
-template<typename Variant, typename... Alternatives>
-decltype(auto) visit_variant(Variant &&variant,
-							 Alternatives &&... alternatives) {
-	return std::visit(make_overload{
-						  std::forward<Alternatives>(alternatives)...},
-					  std::forward<Variant>(variant));
-}
 
 namespace CL {
 
@@ -75,45 +58,12 @@ std::string token_type_to_string(TokenType type) noexcept {
 	}
 }
 
-Token::Token(TokenType type, CarriedValue value, uint16_t column, uint16_t line,
-			 std::string_view source_line) noexcept
-	: m_type(type),
-	  m_value(std::move(std::move(value))),
-	  m_line(line),
-	  m_column(column),
-	  m_source_line(source_line) {
-}
-
-Token::Token(Number number, uint16_t column, uint16_t line,
-			 std::string_view source_line) noexcept
-	: Token(TokenType::Number, number, column, line, source_line) {
-}
-
-Token::Token(TokenType type, uint16_t column, uint16_t line,
-			 std::string_view source_line) noexcept
-	: m_type(type),
-	  m_line(line),
-	  m_column(column),
-	  m_source_line(source_line),
-	  m_value(std::nullopt) {
-}
-Token::Token(TokenType type, std::string value, uint16_t column, uint16_t line,
-			 std::string_view source_line) noexcept
-	: m_type(type),
-	  m_value(value),
-	  m_line(line),
-	  m_column(column),
-	  m_source_line(source_line) {
-}
 std::string Token::to_string() const noexcept {
 	auto str = std::string("");
 	str.append(token_type_to_string(m_type));
-	if(m_value.has_value()) {
+	if(has_symbol()) {
 		str.append(" with value ");
-		visit_variant(
-			m_value.value(),
-			[&str](Number i) { str.append(std::to_string(i)); },
-			[&str](const std::string &id) { str.append(id); });
+		str.append(get_symbol().str());
 	}
 	return str;
 }
@@ -2,44 +2,50 @@
 
 #include "commons.hpp"
 
-#include <optional>
-#include <string_view>
-#include <variant>
+#include <cstdint>
+#include <string>
+#include <type_traits>
 namespace CL {
+/*
+ * A span of the source: its kind, where it starts and how many chars it
+ * covers. Identifiers also carry the id of their symbol. Numbers, string
+ * literals, lines and columns are read back from the source by the Lexer,
+ * so tokens are 16 bytes that are copied around like integers.
+ */
 class Token {
+public:
+	static constexpr uint32_t NO_SYMBOL = UINT32_MAX;
+
 private:
-	using CarriedValue = std::optional<std::variant<Number, std::string>>;
+	uint32_t m_offset;
+	uint32_t m_length;
+	uint32_t m_symbol;
 	TokenType m_type;
-	CarriedValue m_value;
-	std::string_view m_source_line;
-	uint16_t m_line;
-	uint16_t m_column;
 
 public:
-	Token(TokenType type, CarriedValue value, uint16_t column,
-		  uint16_t line, std::string_view source_line) noexcept;
-	Token(Number number,
-		  uint16_t column,
-		  uint16_t line,
-		  std::string_view source_line) noexcept;
-	Token(TokenType type,
-		  uint16_t column,
-		  uint16_t line,
-		  std::string_view source_line) noexcept;
-	Token(TokenType type,
-		  std::string string,
-		  uint16_t columtn,
-		  uint16_t line,
-		  std::string_view source_line) noexcept;
+	constexpr Token() noexcept
+		: Token(TokenType::Eof, 0, 0) {
+	}
+	constexpr Token(TokenType type,
+					uint32_t offset,
+					uint32_t length,
+					uint32_t symbol = NO_SYMBOL) noexcept
+		: m_offset(offset), m_length(length), m_symbol(symbol), m_type(type) {
+	}
+
 	[[nodiscard]] TokenType get_type() const noexcept { return m_type; }
-	[[nodiscard]] uint16_t get_line() const noexcept { return m_line; }
-	[[nodiscard]] uint16_t get_column() const noexcept { return m_column; }
-	[[nodiscard]] std::string_view get_source_line() const noexcept { return m_source_line; }
+	[[nodiscard]] uint32_t get_offset() const noexcept { return m_offset; }
+	[[nodiscard]] uint32_t get_length() const noexcept { return m_length; }
+	[[nodiscard]] bool has_symbol() const noexcept {
+		return m_symbol != NO_SYMBOL;
+	}
+	[[nodiscard]] Symbol get_symbol() const noexcept {
+		return Symbol::from_id(m_symbol);
+	}
 
 	[[nodiscard]] std::string to_string() const noexcept;
-	template<class T>
-	T get() {
-		return std::get<T>(m_value.value());
-	}
 };
+static_assert(sizeof(Token) == 16, "Tokens are meant to be two words wide");
+static_assert(std::is_trivially_copyable_v<Token>,
+			  "Tokens are meant to be copied as plain bytes");
 } // namespace CL
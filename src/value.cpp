@@ -9,162 +9,153 @@
 #include <memory>
 #include <optional>
 #include <sstream>
-#include <variant>
-
-std::string num_to_str_pretty_formatted(double n) {
-	std::string repr = std::to_string(n);
-	auto last_index_of = repr.find_last_not_of('0');
-	repr.erase(last_index_of, repr.size());
-	if(repr[repr.size() - 1] == '.')
-		repr.pop_back();
-	return repr;
-}
+#include <vector>
 
 namespace CL {
-struct NegateVisitor {
-	RawValue operator()(bool b) { return !b; }
-	RawValue operator()(const Number v) { return -v; }
-	template<class T>
-	RawValue operator()(const T &_v) {
-		throw RuntimeException("Cannot negate this value");
+void RuntimeValue::destroy_cell() noexcept {
+	switch (kind_of_cell()) {
+		case String_Cell: destroy_string(cell<String>());
+			break;
+		case Indexable_Cell: delete cell<IndexablePtr>();
+			break;
+		case Callable_Cell: delete cell<CallablePtr>();
+			break;
 	}
-};
+}
 
-struct StringVisitor {
-	std::string operator()(const std::monostate) { return "nool"; }
-	std::string operator()(bool b) { return std::to_string(b); }
-	std::string operator()(const Number v) {
-		return num_to_str_pretty_formatted(v);
-	}
-	std::string operator()(const Module &mod) {
-		return "Module " + addr_to_hex_str(mod);
-	}
-	std::string operator()(const IndexablePtr &ptr) { return ptr->to_string(); }
-	std::string operator()(const CallablePtr &call) {
-		return call->to_string();
+void RuntimeValue::destroy_string(StringCell *string) noexcept {
+	if(!string->is_rope()) {
+		delete string;
+		return;
 	}
-	std::string operator()(const String &str) {
-		return str;
+	// Ropes built in a loop are as deep as its iterations, don't recurse
+	std::vector<StringCell *> pending{string};
+	while (!pending.empty()) {
+		auto *current = pending.back();
+		pending.pop_back();
+		for (auto *half : {current->left, current->right}) {
+			if(half != nullptr && --half->refs == 0) {
+				pending.push_back(static_cast<StringCell *>(half));
+			}
+		}
+		delete current;
 	}
-};
-
-struct StringRepresentationVisitor {
-	std::string operator()(const std::monostate) { return "nool"; }
-	std::string operator()(bool b) { return std::to_string(b); }
-	std::string operator()(const Number v) {
-		return std::to_string(v);
-	}
-	std::string operator()(const CallablePtr &call) { return call->string_repr(); }
-	std::string operator()(const String &str) { return "\"" + str + "\""; }
-	std::string operator()(const IndexablePtr &ptr) { return ptr->string_repr(); }
-};
-
-struct TruthinessVisitor {
-	bool operator()(bool b) { return b; }
-	bool operator()(const Number v) { return v == 1.0; }
-	template<class T>
-	bool operator()(const T &_v) { return false; }
-};
+}
 
-struct EqualityOperator {
-	bool operator()(bool b, bool l) { return b == l; }
-	bool operator()(const Number v, const Number o) { return v == o; }
-	bool operator()(const std::monostate, const std::monostate) { return true; }
-	bool operator()(const CallablePtr &l, const CallablePtr &r) {
-		return l == r;
+void RuntimeValue::flatten(const StringCell *rope) {
+	String text;
+	text.reserve(rope->length);
+	std::vector<const StringCell *> pending{rope};
+	while (!pending.empty()) {
+		const auto *current = pending.back();
+		pending.pop_back();
+		if(current->is_rope()) {
+			pending.push_back(static_cast<const StringCell *>(current->right));
+			pending.push_back(static_cast<const StringCell *>(current->left));
+		} else {
+			text.append(current->value);
+		}
 	}
-	bool operator()(const IndexablePtr &l, const IndexablePtr &r) {
-		return l == r;
+	rope->text = std::move(text);
+	rope->value = rope->text;
+	for (auto *half : {rope->left, rope->right}) {
+		if(--half->refs == 0) {
+			destroy_string(static_cast<StringCell *>(half));
+		}
 	}
-	bool operator()(const String &l, const String &r) { return l == r; }
-	template<class T, class V>
-	bool operator()(const T &_t, const V &_v) { return false; }
-};
-struct NegatedEqualityOperator {
-	bool operator()(bool b, bool l) { return b != l; }
-	bool operator()(const Number v, const Number o) { return v != o; }
-	bool operator()(const std::monostate,
-					const std::monostate) { return false; }
-	bool operator()(const CallablePtr &l, const CallablePtr &r) {
-		return l != r;
-	}
-	bool operator()(const IndexablePtr &l, const IndexablePtr &r) {
-		return l != r;
-	}
-	bool operator()(const String &l, const String &r) { return l != r; }
-	template<class T, class V>
-	bool operator()(const T &_t, const V &_v) { return false; }
-};
+	rope->left = nullptr;
+	rope->right = nullptr;
+}
 
-struct LessThanOperator {
-	bool operator()(const Number v, const Number o) { return v < o; }
-	bool operator()(const std::monostate,
-					const std::monostate) { return false; }
-	bool operator()(const String &l, const String &r) { return l < r; }
-	template<class T, class V>
-	bool operator()(const T &_t, const V &_v) {
-		return reinterpret_cast<uint64_t>(&_t)
-			< reinterpret_cast<uint64_t>(&_v);
+RuntimeValue::RuntimeValue(const Symbol &symbol) {
+	if(symbol.m_entry->cell == nullptr) {
+		// The symbol table keeps the first reference, the cell is never freed
+		auto *cell = new StringCell(symbol.str());
+		cell->hash = symbol.hash();
+		cell->hashed = true;
+		cell->interned = true;
+		symbol.m_entry->cell = cell;
 	}
-};
-struct GreaterThanOperator {
-	bool operator()(const Number v, const Number o) { return v > o; }
-	bool operator()(const std::monostate,
-					const std::monostate) { return false; }
-	bool operator()(const String &l, const String &r) { return l > r; }
-	template<class T, class V>
-	bool operator()(const T &_t, const V &_v) { return false; }
-};
-struct LessEqualsOperator {
-	bool operator()(const Number v, const Number o) { return v <= o; }
-	bool operator()(const std::monostate,
-					const std::monostate) { return false; }
-	bool operator()(const String &l, const String &r) { return l <= r; }
-	template<class T, class V>
-	bool operator()(const T &_t, const V &_v) { return false; }
-};
+	auto *cell = static_cast<CellHeader *>(const_cast<void *>(symbol.m_entry->cell));
+	cell->refs++;
+	m_bits = CELL_TAG | reinterpret_cast<uint64_t>(cell) | String_Cell;
+}
 
-struct GreaterEqualsOperator {
-	bool operator()(const Number v, const Number o) { return v >= o; }
-	bool operator()(const std::monostate,
-					const std::monostate) { return false; }
-	bool operator()(const String &l, const String &r) { return l >= r; }
-	template<class T, class V>
-	bool operator()(const T &_t, const V &_v) { return false; }
-};
+RuntimeValue RuntimeValue::slice(size_t start, size_t length) const {
+	auto text = as<String>();
+	if(start > text.size()) {
+		throw RuntimeException("Tried slicing outside this string's range");
+	}
+	const auto *string = cell<String>();
+	auto *owner = string->owner != nullptr ? string->owner : header();
+	CellHeader *slice = new StringCell(owner, text.substr(start, length));
+	RuntimeValue result;
+	result.m_bits = CELL_TAG | reinterpret_cast<uint64_t>(slice) | String_Cell;
+	return result;
+}
 
-struct SumOperator {
-	RuntimeValue operator()(const Number n, const Number o) { return n + o; }
-	template<class T>
-	RuntimeValue operator()(const String &s, const T &o) {
-		return s + StringVisitor()(o);
+bool RuntimeValue::same_kind(const RuntimeValue &other) const noexcept {
+	if(is<Number>() || other.is<Number>()) {
+		return is<Number>() && other.is<Number>();
 	}
-	template<class T, class U>
-	RuntimeValue operator()(const T &_t, const U &_u) {
-		throw RuntimeException("Values cannot be summed.");
+	if(is_cell() || other.is_cell()) {
+		return (m_bits & (CELL_TAG | KIND_MASK))
+			== (other.m_bits & (CELL_TAG | KIND_MASK));
 	}
-};
+	return is<bool>() == other.is<bool>();
+}
 
 bool RuntimeValue::is_truthy() const noexcept {
-	return std::visit(TruthinessVisitor{}, m_value);
+	if(is<Number>()) {
+		return number() == 1.0;
+	}
+	return m_bits == TRUE_BITS;
 }
 
 void RuntimeValue::negate() {
-	auto negated = std::visit(NegateVisitor{}, m_value);
-	m_value = negated;
+	if(is<Number>()) {
+		*this = -number();
+	} else if(is<bool>()) {
+		m_bits = m_bits == TRUE_BITS ? FALSE_BITS : TRUE_BITS;
+	} else {
+		throw RuntimeException("Cannot negate this value");
+	}
 }
 
 RuntimeValue RuntimeValue::operator+(const RuntimeValue &other) {
-	return std::visit(SumOperator{}, this->m_value, other.m_value);
-}
-RuntimeValue RuntimeValue::operator-(const RuntimeValue &other) const {
-	return this->as<Number>() - other.as<Number>();
-}
-RuntimeValue RuntimeValue::operator*(const RuntimeValue &other) const {
-	return this->as<Number>() * other.as<Number>();
-}
-RuntimeValue RuntimeValue::operator/(const RuntimeValue &other) const {
-	return this->as<Number>() / other.as<Number>();
+	if(is<Number>() && other.is<Number>()) {
+		return number() + other.number();
+	}
+	if(is<String>() && other.is<Number>()) {
+		// Formatted on the stack, appended without a cell of its own
+		char buffer[NUMBER_BUFFER_SIZE];
+		auto *end = format_number(other.number(), buffer);
+		if(cell<String>()->length + (end - buffer) < ROPE_MIN_LENGTH) {
+			auto text = String(as<String>());
+			text.append(buffer, end);
+			return text;
+		}
+		return *this + RuntimeValue(String(buffer, end));
+	}
+	if(is<String>()) {
+		auto right = other.is<String>() ? other : RuntimeValue(other.to_string());
+		const auto *left_string = cell<String>();
+		const auto *right_string = right.cell<String>();
+		auto length = left_string->length + right_string->length;
+		if(right_string->length == 0) {
+			return *this;
+		}
+		if(length < ROPE_MIN_LENGTH || left_string->length == 0) {
+			auto text = String(as<String>());
+			text.append(right.as<String>());
+			return text;
+		}
+		RuntimeValue result;
+		CellHeader *rope = new StringCell(header(), right.header(), length);
+		result.m_bits = CELL_TAG | reinterpret_cast<uint64_t>(rope) | String_Cell;
+		return result;
+	}
+	throw RuntimeException("Values cannot be summed.");
 }
 RuntimeValue RuntimeValue::to_power_of(const RuntimeValue &other) const {
 	return pow(this->as<Number>(), other.as<Number>());
@@ -172,39 +163,189 @@ RuntimeValue RuntimeValue::to_power_of(const RuntimeValue &other) const {
 RuntimeValue RuntimeValue::modulo(const RuntimeValue &other) const {
 	return fmod(this->as<Number>(), other.as<Number>());
 }
-bool RuntimeValue::operator!=(const RuntimeValue &other) const {
-	return std::visit(NegatedEqualityOperator{}, m_value, other.m_value);
-}
 bool RuntimeValue::operator==(const RuntimeValue &other) const {
-	return std::visit(EqualityOperator{}, m_value, other.m_value);
+	if(!same_kind(other)) {
+		return false;
+	}
+	if(is<Number>()) {
+		return number() == other.number();
+	}
+	if(!is_cell()) {
+		return m_bits == other.m_bits;
+	}
+	switch (kind_of_cell()) {
+		case String_Cell: {
+			if(m_bits == other.m_bits) {
+				return true;
+			}
+			const auto *mine = cell<String>();
+			const auto *theirs = other.cell<String>();
+			if(mine->interned && theirs->interned) {
+				return false;
+			}
+			return hash() == other.hash() && as<String>() == other.as<String>();
+		}
+		case Indexable_Cell:
+			return as<IndexablePtr>() == other.as<IndexablePtr>();
+		case Callable_Cell: return as<CallablePtr>() == other.as<CallablePtr>();
+	}
+	NOT_REACHED();
+}
+bool RuntimeValue::operator!=(const RuntimeValue &other) const {
+	// Values of different kinds are neither equal nor different
+	return same_kind(other) && !(*this == other);
 }
 bool RuntimeValue::operator<(const RuntimeValue &other) const {
-	return std::visit(LessThanOperator{}, m_value, other.m_value);
+	if(is<Number>() && other.is<Number>()) {
+		return number() < other.number();
+	}
+	if(is<String>() && other.is<String>()) {
+		return as<String>() < other.as<String>();
+	}
+	return false;
 }
 bool RuntimeValue::operator>(const RuntimeValue &other) const {
-	return std::visit(GreaterThanOperator{}, m_value, other.m_value);
+	if(is<Number>() && other.is<Number>()) {
+		return number() > other.number();
+	}
+	if(is<String>() && other.is<String>()) {
+		return as<String>() > other.as<String>();
+	}
+	return false;
 }
 bool RuntimeValue::operator<=(const RuntimeValue &other) const {
-	return std::visit(LessEqualsOperator{}, m_value, other.m_value);
+	if(is<Number>() && other.is<Number>()) {
+		return number() <= other.number();
+	}
+	if(is<String>() && other.is<String>()) {
+		return as<String>() <= other.as<String>();
+	}
+	return false;
 }
 bool RuntimeValue::operator>=(const RuntimeValue &other) const {
-	return std::visit(GreaterEqualsOperator{}, m_value, other.m_value);
+	if(is<Number>() && other.is<Number>()) {
+		return number() >= other.number();
+	}
+	if(is<String>() && other.is<String>()) {
+		return as<String>() >= other.as<String>();
+	}
+	return false;
+}
+
+size_t RuntimeValue::hash() const noexcept {
+	if(is<Number>()) {
+		return std::hash<Number>()(number());
+	}
+	if(is<String>()) {
+		const auto *string = cell<String>();
+		if(!string->hashed) {
+			string->hash = std::hash<std::string_view>()(as<String>());
+			string->hashed = true;
+		}
+		return string->hash;
+	}
+	if(is<IndexablePtr>()) {
+		return std::hash<IndexablePtr>()(as<IndexablePtr>());
+	}
+	if(is<CallablePtr>()) {
+		return std::hash<CallablePtr>()(as<CallablePtr>());
+	}
+	return std::hash<uint64_t>()(m_bits);
 }
 
 std::string RuntimeValue::to_string() const noexcept {
-	return std::visit(StringVisitor{}, m_value);
+	if(is<Number>()) {
+		return number_to_string(number());
+	}
+	if(!is_cell()) {
+		return is<bool>() ? std::to_string(m_bits == TRUE_BITS) : "nool";
+	}
+	switch (kind_of_cell()) {
+		case String_Cell: return String(as<String>());
+		case Indexable_Cell: return as<IndexablePtr>()->to_string();
+		case Callable_Cell: return as<CallablePtr>()->to_string();
+	}
+	return "";
 }
 
 std::string RuntimeValue::string_representation() const noexcept {
-	return std::visit(StringRepresentationVisitor{}, m_value);
+	if(is<Number>()) {
+		return number_to_string(number());
+	}
+	if(!is_cell()) {
+		return is<bool>() ? std::to_string(m_bits == TRUE_BITS) : "nool";
+	}
+	switch (kind_of_cell()) {
+		case String_Cell: return "\"" + String(as<String>()) + "\"";
+		case Indexable_Cell: return as<IndexablePtr>()->string_repr();
+		case Callable_Cell: return as<CallablePtr>()->string_repr();
+	}
+	return "";
 }
 
-const RawValue &RuntimeValue::raw_value() const noexcept { return m_value; }
 RuntimeValue &Module::get(const RuntimeValue &what) {
 	if(!what.is<String>()) {
 		throw RuntimeException("Modules are only indexable by strings!");
 	}
-	return m_env->get(what.as<String>());
+	// Looked up without interning, names never interned can't be bound
+	auto name = Symbol::find(what.as<String>());
+	if(!name) {
+		throw RuntimeException(String(what.as<String>()) + " is not bound");
+	}
+	return m_env->get(*name);
+}
+
+namespace {
+void visit_dict(const Dict &dict, GcVisitor &visitor) {
+	for (const auto &[key, value] : dict) {
+		visitor.visit(key);
+		visitor.visit(value);
+	}
+}
+}
+
+void List::visit_references(GcVisitor &visitor) const {
+	for (const auto &value : m_list) {
+		visitor.visit(value);
+	}
+	visit_dict(m_bound_methods, visitor);
+}
+
+List::~List() {
+	MethodTable::detach(m_bound_methods);
+}
+
+void List::clear_references() {
+	m_list.clear();
+	MethodTable::detach(m_bound_methods);
+}
+
+void Dictionary::visit_references(GcVisitor &visitor) const {
+	visit_dict(m_map, visitor);
+	visit_dict(m_bound_methods, visitor);
+}
+
+Dictionary::~Dictionary() {
+	MethodTable::detach(m_bound_methods);
+}
+
+void Dictionary::clear_references() {
+	m_map.clear();
+	MethodTable::detach(m_bound_methods);
+}
+
+Module::Module(RuntimeEnvPtr env)
+	: m_env(std::move(env)) {
+}
+
+Module::~Module() = default;
+
+void Module::visit_references(GcVisitor &visitor) const {
+	visitor.visit(m_env);
+}
+
+void Module::clear_references() {
+	m_env.reset();
 }
 
 std::string Module::to_string() const {
@@ -214,43 +355,91 @@ std::string Module::string_repr() const {
 	return "module " + m_env->to_string();
 }
 RuntimeValue &Indexable::get_named(const std::string &name) {
-	return get(name);
+	return get(RuntimeValue(Symbol(name)));
 }
 
 void Indexable::set_named(const std::string &name, RuntimeValue v) {
-	set(name, std::move(v));
-}
-List::List() {
-	m_functions["find"] = RuntimeValue(std::make_shared<LambdaStyleFunction>(
-		[this](const Args &args) {
-			auto it = std::find(m_list.begin(), m_list.end(), args[0]);
-			if(it == m_list.end())
-				return static_cast<Number>(-1);
-			return static_cast<Number>(std::distance(m_list.begin(), it));
-		},
-		1));
-	m_functions["contains"] =
-		RuntimeValue(std::make_shared<LambdaStyleFunction>(
-			[this](const Args &args) {
-				auto it = std::find(m_list.begin(), m_list.end(), args[0]);
-				return it != m_list.end();
-			},
-			1));
-	m_functions["append"] =
-		RuntimeValue(std::make_shared<VoidFunction>([this](const Args &args) {
-														this->append(args[0]);
-													},
-													1));
-}
-
-Dictionary::Dictionary() {
-	m_map["contains"] =
-		RuntimeValue(std::dynamic_pointer_cast<Callable>(std::make_shared<
-			LambdaStyleFunction>(
-			[this](const Args &args) {
-				return m_map.find(args[0].raw_value()) != m_map.end();
-			},
-			1)));
+	set(RuntimeValue(Symbol(name)), std::move(v));
+}
+namespace {
+// Doesn't keep its instance alive, which caches it and detaches it when
+// going away
+class BoundMethod : public Callable {
+private:
+	Indexable *m_self;
+	MethodTable::Method m_method;
+
+public:
+	BoundMethod(Indexable &self, MethodTable::Method method)
+		: m_self(&self), m_method(method) {
+	}
+	void detach() noexcept { m_self = nullptr; }
+	uint8_t arity() override { return m_method.arity; }
+	std::optional<RuntimeValue> call(const Args &args) override {
+		if(m_self == nullptr) {
+			throw RuntimeException("The object of this method no longer exists");
+		}
+		return m_method.function(*m_self, args);
+	}
+};
+}
+
+RuntimeValue *MethodTable::bind(Indexable &self,
+								const RuntimeValue &name,
+								Dict &bound) const {
+	if(!name.is<String>()) {
+		return nullptr;
+	}
+	if(auto it = bound.find(name); it != bound.end()) {
+		return &it->second;
+	}
+	auto method = m_methods.find(name);
+	if(method == m_methods.end()) {
+		return nullptr;
+	}
+	auto it = bound.emplace(method->first, RuntimeValue(CallablePtr(
+		make_ref<BoundMethod>(self, method->second)))).first;
+	return &it->second;
+}
+
+void MethodTable::detach(Dict &bound) noexcept {
+	for (auto &method : bound) {
+		static_cast<BoundMethod *>(method.second.as<CallablePtr>().get())
+			->detach();
+	}
+	bound.clear();
+}
+
+const MethodTable &List::methods() {
+	static const MethodTable table{
+		{"find", {[](Indexable &self, const Args &args) -> std::optional<RuntimeValue> {
+			const auto &list = static_cast<List &>(self).m_list;
+			auto it = std::find(list.begin(), list.end(), args[0]);
+			if(it == list.end())
+				return RuntimeValue(static_cast<Number>(-1));
+			return RuntimeValue(static_cast<Number>(std::distance(list.begin(), it)));
+		}, 1}},
+		{"contains", {[](Indexable &self, const Args &args) -> std::optional<RuntimeValue> {
+			const auto &list = static_cast<List &>(self).m_list;
+			auto it = std::find(list.begin(), list.end(), args[0]);
+			return RuntimeValue(static_cast<Number>(it != list.end()));
+		}, 1}},
+		{"append", {[](Indexable &self, const Args &args) -> std::optional<RuntimeValue> {
+			static_cast<List &>(self).append(args[0]);
+			return std::nullopt;
+		}, 1}},
+	};
+	return table;
+}
+
+const MethodTable &Dictionary::methods() {
+	static const MethodTable table{
+		{"contains", {[](Indexable &self, const Args &args) -> std::optional<RuntimeValue> {
+			const auto &map = static_cast<Dictionary &>(self).m_map;
+			return RuntimeValue(static_cast<Number>(map.find(args[0]) != map.end()));
+		}, 1}},
+	};
+	return table;
 }
 std::string Dictionary::to_string() const {
 	return "Dictionary " + addr_to_hex_str(*this);
@@ -259,7 +448,7 @@ std::string Dictionary::string_repr() const {
 	std::stringstream stream;
 	stream << " {\n";
 	for (const auto &pair : m_map) {
-		stream << "\t" << std::visit(StringVisitor{}, pair.first) << " : "
+		stream << "\t" << pair.first.to_string() << " : "
 			   << pair.second.to_string() << "\n";
 	}
 	stream << "}";
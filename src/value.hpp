@@ -2,12 +2,16 @@
 
 #include "commons.hpp"
 #include "exceptions.hpp"
+#include "gc.hpp"
 
+#include <cstring>
 #include <map>
 #include <memory>
 #include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <variant>
@@ -17,7 +21,7 @@ namespace CL {
 
 constexpr uint8_t VAR_ARGS = 0xFF;
 
-class Indexable {
+class Indexable : public GcObject {
 public:
 	virtual void set(const RuntimeValue &, RuntimeValue v) = 0;
 	virtual RuntimeValue &get(const RuntimeValue &) = 0;
@@ -28,7 +32,7 @@ public:
 	virtual std::string string_repr() const = 0;
 };
 
-class Callable {
+class Callable : public GcObject {
 public:
 	virtual std::optional<RuntimeValue> call(const Args &args) = 0;
 	std::optional<RuntimeValue> call();
@@ -45,20 +49,154 @@ public:
 	virtual std::string string_repr() const noexcept { return to_string(); }
 };
 
-using RawValue = std::variant<std::monostate,
-							  bool,
-							  Number,
-							  String,
-							  IndexablePtr,
-							  CallablePtr>;
+/*
+ * An 8 byte NaN-boxed value.
+ * Numbers are stored inline as doubles, nil and booleans are immediates
+ * living in the quiet NaN space, and strings, indexables and callables are
+ * tagged pointers to a refcounted HeapCell. The kind of a cell is kept in
+ * the low bits of its pointer so that is<T>() never touches the heap.
+ * Cells are shared by copies and never mutated, so their refcount doesn't
+ * need to be atomic.
+ */
 class RuntimeValue {
 private:
-	struct rv_tag {};
-	RawValue m_value;
-	RuntimeValue(rv_tag, RawValue v)
-		: m_value(std::move(v)) {
+	friend class Collector;
+
+	static constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+	static constexpr uint64_t QNAN = 0x7FFC000000000000;
+	static constexpr uint64_t CANONICAL_NAN = 0x7FF8000000000000;
+	static constexpr uint64_t NIL_BITS = QNAN | 0x1;
+	static constexpr uint64_t FALSE_BITS = QNAN | 0x2;
+	static constexpr uint64_t TRUE_BITS = QNAN | 0x3;
+	static constexpr uint64_t CELL_TAG = SIGN_BIT | QNAN;
+	static constexpr uint64_t KIND_MASK = 0x7;
+	static constexpr uint64_t POINTER_MASK = 0x0000FFFFFFFFFFF8;
+
+	enum CellKind : uint64_t {
+		String_Cell = 1,
+		Indexable_Cell = 2,
+		Callable_Cell = 3,
+	};
+
+	struct CellHeader {
+		uint32_t refs;
+	};
+	template<class T>
+	struct HeapCell : CellHeader {
+		explicit HeapCell(T v)
+			: CellHeader{1}, value(std::move(v)) {
+		}
+		T value;
+	};
+	/*
+	 * The immutable text of a string value. A slice shares the text of the
+	 * string it was cut from, keeping a reference to the cell owning it.
+	 * A rope is the concatenation of two strings, only copied into a text
+	 * of its own the first time it is read, so that appending to a string
+	 * in a loop doesn't copy what was built so far at every iteration.
+	 * Strings cache their hash, computed on first use, and the ones made
+	 * from a Symbol are shared by all its values, so two interned strings
+	 * are equal only when they are the same cell.
+	 */
+	struct StringCell : CellHeader {
+		explicit StringCell(String v)
+			: CellHeader{1}, text(std::move(v)), value(text), length(value.size()) {
+		}
+		StringCell(CellHeader *owner, std::string_view slice)
+			: CellHeader{1}, owner(owner), value(slice), length(slice.size()) {
+			owner->refs++;
+		}
+		StringCell(CellHeader *left, CellHeader *right, size_t length)
+			: CellHeader{1}, left(left), right(right), length(length) {
+			left->refs++;
+			right->refs++;
+		}
+		// The halves of a rope are released by destroy_cell
+		~StringCell() {
+			if(owner != nullptr && --owner->refs == 0) {
+				delete static_cast<StringCell *>(owner);
+			}
+		}
+		StringCell(const StringCell &) = delete;
+		StringCell &operator=(const StringCell &) = delete;
+
+		[[nodiscard]]
+		bool is_rope() const noexcept { return left != nullptr; }
+
+		// Empty for slices, which read the text of their owner
+		mutable String text;
+		CellHeader *const owner{nullptr};
+		mutable std::string_view value;
+		mutable CellHeader *left{nullptr};
+		mutable CellHeader *right{nullptr};
+		const size_t length;
+		mutable size_t hash{0};
+		mutable bool hashed{false};
+		bool interned{false};
+	};
+	// Concatenations shorter than this are copied right away
+	static constexpr size_t ROPE_MIN_LENGTH = 256;
+	template<class T>
+	using CellOf = std::conditional_t<std::is_same_v<T, String>, StringCell, HeapCell<T>>;
+
+	template<class T>
+	static constexpr CellKind cell_kind() noexcept {
+		if constexpr (std::is_same_v<T, String>) {
+			return String_Cell;
+		} else if constexpr (std::is_same_v<T, IndexablePtr>) {
+			return Indexable_Cell;
+		} else {
+			static_assert(std::is_same_v<T, CallablePtr>);
+			return Callable_Cell;
+		}
+	}
+
+	uint64_t m_bits;
+
+	[[nodiscard]]
+	bool is_cell() const noexcept { return (m_bits & CELL_TAG) == CELL_TAG; }
+	[[nodiscard]]
+	CellKind kind_of_cell() const noexcept {
+		return static_cast<CellKind>(m_bits & KIND_MASK);
+	}
+	[[nodiscard]]
+	CellHeader *header() const noexcept {
+		return reinterpret_cast<CellHeader *>(m_bits & POINTER_MASK);
+	}
+	template<class T>
+	[[nodiscard]]
+	CellOf<T> *cell() const noexcept {
+		return static_cast<CellOf<T> *>(header());
+	}
+	template<class T>
+	void make_cell(T value) {
+		CellHeader *cell = new CellOf<T>(std::move(value));
+		m_bits = CELL_TAG | reinterpret_cast<uint64_t>(cell) | cell_kind<T>();
+	}
+	[[nodiscard]]
+	Number number() const noexcept {
+		Number n;
+		std::memcpy(&n, &m_bits, sizeof(n));
+		return n;
+	}
 
+	void retain() const noexcept {
+		if(is_cell()) {
+			header()->refs++;
+		}
 	}
+	void release() noexcept {
+		if(is_cell() && --header()->refs == 0) {
+			destroy_cell();
+		}
+	}
+	void destroy_cell() noexcept;
+	// Copies the text of a rope in its cell and releases its halves
+	static void flatten(const StringCell *rope);
+	static void destroy_string(StringCell *string) noexcept;
+
+	[[nodiscard]]
+	bool same_kind(const RuntimeValue &other) const noexcept;
 
 public:
 	[[nodiscard]]
@@ -66,21 +204,55 @@ public:
 
 	template<class T>
 	[[nodiscard]]
-	bool is() const noexcept { return std::holds_alternative<T>(m_value); }
+	bool is() const noexcept {
+		if constexpr (std::is_same_v<T, Number>) {
+			return (m_bits & QNAN) != QNAN;
+		} else if constexpr (std::is_same_v<T, bool>) {
+			return (m_bits | 0x1) == TRUE_BITS;
+		} else if constexpr (std::is_same_v<T, std::monostate>) {
+			return m_bits == NIL_BITS;
+		} else {
+			return (m_bits & (CELL_TAG | KIND_MASK)) == (CELL_TAG | cell_kind<T>());
+		}
+	}
+	/*
+	 * Immediates are returned by value, heap values by reference to the
+	 * cell they live in, and strings as a view of their text.
+	 */
 	template<class T>
 	[[nodiscard]]
-	const T &as() const {
-		if(is<T>()) {
-			return std::get<T>(m_value);
+	decltype(auto) as() const {
+		if(!is<T>()) {
+			throw RuntimeException(to_string() + " is not " + typeid(T).name());
+		}
+		if constexpr (std::is_same_v<T, Number>) {
+			return number();
+		} else if constexpr (std::is_same_v<T, bool>) {
+			return m_bits == TRUE_BITS;
+		} else if constexpr (std::is_same_v<T, std::monostate>) {
+			return std::monostate();
+		} else if constexpr (std::is_same_v<T, String>) {
+			const auto *string = cell<T>();
+			if(string->is_rope()) {
+				flatten(string);
+			}
+			return string->value;
+		} else {
+			return static_cast<const T &>(cell<T>()->value);
 		}
-		throw RuntimeException(to_string() + " is not " + typeid(T).name());
 	}
 
 	void negate();
 	RuntimeValue operator+(const RuntimeValue &other);
-	RuntimeValue operator-(const RuntimeValue &other) const;
-	RuntimeValue operator*(const RuntimeValue &other) const;
-	RuntimeValue operator/(const RuntimeValue &other) const;
+	RuntimeValue operator-(const RuntimeValue &other) const {
+		return as<Number>() - other.as<Number>();
+	}
+	RuntimeValue operator*(const RuntimeValue &other) const {
+		return as<Number>() * other.as<Number>();
+	}
+	RuntimeValue operator/(const RuntimeValue &other) const {
+		return as<Number>() / other.as<Number>();
+	}
 	RuntimeValue modulo(const RuntimeValue &other) const;
 	RuntimeValue to_power_of(const RuntimeValue &other) const;
 
@@ -91,8 +263,11 @@ public:
 	bool operator<=(const RuntimeValue &other) const;
 	bool operator>=(const RuntimeValue &other) const;
 
-	explicit operator const std::string &() const {
-		return as<std::string>();
+	explicit operator std::string_view() const {
+		return as<String>();
+	}
+	explicit operator std::string() const {
+		return String(as<String>());
 	}
 	explicit operator int() const {
 		return static_cast<int>(as<Number>());
@@ -139,7 +314,11 @@ public:
 	}
 
 	[[nodiscard]]
-	const RawValue &raw_value() const noexcept;
+	size_t hash() const noexcept;
+
+	// At most length characters of this string from start, sharing its text
+	[[nodiscard]]
+	RuntimeValue slice(size_t start, size_t length) const;
 
 	[[nodiscard]]
 	std::string to_string() const noexcept;
@@ -147,42 +326,122 @@ public:
 	std::string string_representation() const noexcept;
 
 	explicit RuntimeValue(bool b) noexcept
-		: m_value(b) {
+		: m_bits(b ? TRUE_BITS : FALSE_BITS) {
 	}
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "google-explicit-constructor"
-	RuntimeValue(Number n) noexcept
-		: m_value(n) {
+	RuntimeValue(Number n) noexcept {
+		if(n != n) {
+			m_bits = CANONICAL_NAN;
+		} else {
+			std::memcpy(&m_bits, &n, sizeof(n));
+		}
 	}
-	RuntimeValue(String s) noexcept
-		: m_value(s) {
+	RuntimeValue(String s) {
+		make_cell(std::move(s));
 	}
-	RuntimeValue(CallablePtr c) noexcept
-		: m_value(c) {
+	// The string cell interned with the symbol
+	RuntimeValue(const Symbol &symbol);
+	template<size_t N>
+	RuntimeValue(const char (&s)[N])
+		: RuntimeValue(String(s)) {
 	}
-	RuntimeValue(IndexablePtr p) noexcept
-		: m_value(p) {
+	RuntimeValue(CallablePtr c) {
+		make_cell(std::move(c));
+	}
+	RuntimeValue(IndexablePtr p) {
+		make_cell(std::move(p));
 	}
 	RuntimeValue() noexcept
-		: m_value(std::monostate()) {
+		: m_bits(NIL_BITS) {
 	}
+#pragma clang diagnostic pop
 
-	static RuntimeValue make_from_raw_value(RawValue value) {
-		return RuntimeValue(rv_tag{}, std::move(value));
+	RuntimeValue(const RuntimeValue &other) noexcept
+		: m_bits(other.m_bits) {
+		retain();
 	}
+	RuntimeValue(RuntimeValue &&other) noexcept
+		: m_bits(other.m_bits) {
+		other.m_bits = NIL_BITS;
+	}
+	RuntimeValue &operator=(const RuntimeValue &other) noexcept {
+		// other may live inside the cell released here
+		auto bits = other.m_bits;
+		other.retain();
+		release();
+		m_bits = bits;
+		return *this;
+	}
+	RuntimeValue &operator=(RuntimeValue &&other) noexcept {
+		if(this != &other) {
+			release();
+			m_bits = other.m_bits;
+			other.m_bits = NIL_BITS;
+		}
+		return *this;
+	}
+	~RuntimeValue() { release(); }
 
-#pragma clang diagnostic pop
+	struct Hash {
+		size_t operator()(const RuntimeValue &value) const noexcept {
+			return value.hash();
+		}
+	};
 };
+static_assert(sizeof(RuntimeValue) == 8);
 
-using Dict = std::unordered_map<RawValue, RuntimeValue>;
+using Dict = std::unordered_map<RuntimeValue, RuntimeValue, RuntimeValue::Hash,
+								std::equal_to<RuntimeValue>,
+								PoolAllocator<std::pair<const RuntimeValue, RuntimeValue>>>;
 using Lis = std::vector<RuntimeValue>;
+
+/*
+ * The native methods of a container type, shared by all of its instances.
+ * A method is only bound to an instance, and allocated, the first time a
+ * script reads it, so creating a container costs a single allocation.
+ */
+class MethodTable {
+public:
+	using Function = std::optional<RuntimeValue> (*)(Indexable &self,
+													  const Args &args);
+	struct Method {
+		Function function;
+		uint8_t arity;
+	};
+
+	MethodTable(std::initializer_list<std::pair<const String, Method>> methods) {
+		for (const auto &[name, method] : methods) {
+			m_methods.emplace(RuntimeValue(Symbol(name)), method);
+		}
+	}
+
+	// The method called name bound to self and cached in bound, or nullptr
+	RuntimeValue *bind(Indexable &self,
+					   const RuntimeValue &name,
+					   Dict &bound) const;
+	// Drops the methods cached by an instance going away, the copies kept
+	// by scripts throw when called
+	static void detach(Dict &bound) noexcept;
+
+private:
+	std::unordered_map<RuntimeValue, Method, RuntimeValue::Hash> m_methods;
+};
+
 class List : public Indexable {
 private:
 	Lis m_list;
-	Dict m_functions;
+	Dict m_bound_methods;
+
+	static const MethodTable &methods();
 
 public:
-	List();
+	List() = default;
+	~List() override;
+
+	void visit_references(GcVisitor &visitor) const override;
+	void clear_references() override;
+
 	void set(const RuntimeValue &s, RuntimeValue v) override {
 		auto n = static_cast<size_t>(s.as<Number>());
 		if(n < m_list.size()) {
@@ -198,10 +457,10 @@ public:
 
 	RuntimeValue &get(const RuntimeValue &s) override {
 		if(!s.is<Number>()) {
-			if(m_functions.find(s.raw_value()) == m_functions.end()) {
-				throw RuntimeException(s.to_string() + " is not bound. ");
+			if(auto *method = methods().bind(*this, s, m_bound_methods)) {
+				return *method;
 			}
-			return m_functions.at(s.raw_value());
+			throw RuntimeException(s.to_string() + " is not bound. ");
 		}
 		auto n = static_cast<size_t>(s.as<Number>());
 		if(n < m_list.size()) {
@@ -228,14 +487,32 @@ class Dictionary : public Indexable {
 private:
 	Dict m_map;
 
+	static const MethodTable &methods();
+
+protected:
+	Dict m_bound_methods;
+
+	// Subclasses with methods of their own look them up after their parent's
+	virtual RuntimeValue *method(const RuntimeValue &name) {
+		return methods().bind(*this, name, m_bound_methods);
+	}
+
 public:
-	Dictionary();
+	Dictionary() = default;
+	~Dictionary() override;
+
+	void visit_references(GcVisitor &visitor) const override;
+	void clear_references() override;
+
 	void set(const RuntimeValue &s, RuntimeValue v) override {
-		m_map[s.raw_value()] = v;
+		m_map[s] = v;
 	}
 	RuntimeValue &get(const RuntimeValue &s) override {
-		if(m_map.find(s.raw_value()) != m_map.end()) {
-			return m_map.at(s.raw_value());
+		if(auto it = m_map.find(s); it != m_map.end()) {
+			return it->second;
+		}
+		if(auto *m = method(s)) {
+			return *m;
 		}
 		throw RuntimeException(s.to_string() + " not bound in dictionary\n");
 	}
@@ -249,9 +526,12 @@ private:
 	RuntimeEnvPtr m_env;
 
 public:
-	explicit Module(RuntimeEnvPtr env)
-		: m_env(std::move(env)) {
-	}
+	// Out of line, environments are only declared here
+	explicit Module(RuntimeEnvPtr env);
+	~Module() override;
+
+	void visit_references(GcVisitor &visitor) const override;
+	void clear_references() override;
 
 	RuntimeValue &get(const RuntimeValue &what) override;
 	void set(const RuntimeValue &,
@@ -0,0 +1,442 @@
+#include "virtual_machine.h"
+#include "exceptions.hpp"
+#include "stack_based_evaluator.hpp"
+#include "string_visitor.hpp"
+
+#include <cstring>
+
+namespace CL {
+static inline Value read_operand(const OpcodeValue *opcodes, size_t &ip) {
+	Value value;
+	std::memcpy(&value, opcodes + ip, sizeof(Value));
+	ip += sizeof(Value);
+	return value;
+}
+
+void VirtualMachine::poll_safe_point() {
+	if(--m_until_safe_point == 0) {
+		m_until_safe_point = SAFE_POINT_INTERVAL;
+		Collector::instance().safe_point();
+	}
+}
+
+SlotEnvPtr VirtualMachine::enter_call(const VMFunction &function,
+									  size_t base,
+									  size_t callee_index,
+									  size_t argc) {
+	// The arguments are found right above the callee
+	const auto &code = *function.code();
+	SlotEnvPtr locals;
+	if(code.params_on_stack()) {
+		for (size_t i = 0; i < argc; i++) {
+			m_stack[base + i] = std::move(m_stack[callee_index + 1 + i]);
+		}
+		m_stack.resize(base + argc);
+		locals = function.definition_locals();
+	} else {
+		locals = function.make_call_locals(&m_stack[callee_index + 1], argc);
+		m_stack.resize(base);
+	}
+	m_stack.resize(base + code.stack_size());
+	return locals;
+}
+
+std::optional<RuntimeValue> VirtualMachine::run(std::shared_ptr<StackFrame> code,
+												RuntimeEnvPtr env,
+												SlotEnvPtr locals) {
+	auto base = m_stack.size();
+	m_stack.resize(base + code->stack_size());
+	return run(CallFrame{std::move(code), 0, base,
+						 std::move(env), std::move(locals),
+						 std::nullopt});
+}
+
+std::optional<RuntimeValue> VirtualMachine::call(const VMFunction &function,
+												 const Args &args) {
+	auto base = m_stack.size();
+	// Nothing stands for the callee below the arguments
+	m_stack.emplace_back();
+	m_stack.insert(m_stack.end(), args.begin(), args.end());
+	auto locals = enter_call(function, base, base, args.size());
+	return run(CallFrame{function.code(), 0, base,
+						 function.definition_env(), std::move(locals),
+						 std::nullopt});
+}
+
+std::optional<RuntimeValue> VirtualMachine::run(CallFrame frame) {
+	auto entry_frame = m_frames.size();
+	auto entry_stack = frame.base;
+	m_frames.push_back(std::move(frame));
+	try {
+		return execute(entry_frame);
+	} catch (...) {
+		// Every frame above the entry one was counted by a call
+		CallDepthGuard::leave(m_frames.size() - entry_frame - 1);
+		m_frames.resize(entry_frame);
+		m_stack.resize(entry_stack);
+		throw;
+	}
+}
+
+std::optional<RuntimeValue> VirtualMachine::execute(size_t entry_frame) {
+	auto *frame = &m_frames.back();
+	const auto *code = frame->code.get();
+	const auto *opcodes = code->opcodes();
+	size_t ip = frame->ip;
+
+	while (true) {
+		auto op = static_cast<Opcode>(opcodes[ip++]);
+		switch (op) {
+			case Opcode::Push_Const:
+				push(code->constant(read_operand(opcodes, ip)));
+				break;
+			case Opcode::Push_Nil: push(RuntimeValue());
+				break;
+			case Opcode::Pop: m_stack.pop_back();
+				break;
+			case Opcode::Pop_Result: frame->result = pop();
+				break;
+			case Opcode::Load_Name: {
+				auto name = read_operand(opcodes, ip);
+				push(code->name_cache(name).get(*frame->env, code->name(name)));
+				break;
+			}
+			case Opcode::Store_Name: {
+				auto name = read_operand(opcodes, ip);
+				code->name_cache(name).assign(*frame->env, code->name(name), peek());
+				break;
+			}
+			case Opcode::Bind_Name:
+				frame->env->bind(code->name(read_operand(opcodes, ip)), pop());
+				break;
+			case Opcode::Load_Local: {
+				auto slot = read_operand(opcodes, ip);
+				push(frame->locals->at(slot >> 16, slot & 0xFFFF));
+				break;
+			}
+			case Opcode::Store_Local: {
+				auto slot = read_operand(opcodes, ip);
+				frame->locals->at(slot >> 16, slot & 0xFFFF) = peek();
+				break;
+			}
+			case Opcode::Bind_Local: {
+				auto slot = read_operand(opcodes, ip);
+				frame->locals->at(slot >> 16, slot & 0xFFFF) = pop();
+				break;
+			}
+			case Opcode::Load_Stack:
+				push(m_stack[frame->base + read_operand(opcodes, ip)]);
+				break;
+			case Opcode::Store_Stack:
+				m_stack[frame->base + read_operand(opcodes, ip)] = peek();
+				break;
+			case Opcode::Bind_Stack: {
+				auto offset = frame->base + read_operand(opcodes, ip);
+				m_stack[offset] = pop();
+				break;
+			}
+			case Opcode::Clear_Stack: {
+				auto slots = read_operand(opcodes, ip);
+				auto first = frame->base + (slots >> 16);
+				for (auto i = first; i < first + (slots & 0xFFFF); i++) {
+					m_stack[i] = RuntimeValue();
+				}
+				break;
+			}
+			case Opcode::Make_Function: {
+				auto &function = code->function(read_operand(opcodes, ip));
+				auto value = make_ref<VMFunction>(function,
+														  frame->env,
+														  frame->locals);
+				if(function->memoized()) {
+					push(RuntimeValue(make_ref<MemoizedFunction>(value)));
+				} else {
+					push(RuntimeValue(value));
+				}
+				break;
+			}
+			case Opcode::Make_Dict: {
+				auto pairs = read_operand(opcodes, ip);
+				auto d = make_ref<Dictionary>();
+				auto first = m_stack.size() - 2 * pairs;
+				for (auto i = first; i < m_stack.size(); i += 2) {
+					d->set(m_stack[i], m_stack[i + 1]);
+				}
+				m_stack.resize(first);
+				push(RuntimeValue(d));
+				break;
+			}
+			case Opcode::Make_List: {
+				auto elements = read_operand(opcodes, ip);
+				auto l = make_ref<List>();
+				auto first = m_stack.size() - elements;
+				for (auto i = first; i < m_stack.size(); i++) {
+					l->append(m_stack[i]);
+				}
+				m_stack.resize(first);
+				push(RuntimeValue(l));
+				break;
+			}
+			case Opcode::Make_Module: {
+				auto mod = make_ref<Module>(frame->env);
+				push(IndexablePtr(mod));
+				break;
+			}
+			case Opcode::Add: {
+				auto r_val = pop();
+				peek() = peek() + r_val;
+				break;
+			}
+			case Opcode::Subtract: {
+				auto r_val = pop();
+				peek() = peek() - r_val;
+				break;
+			}
+			case Opcode::Multiply: {
+				auto r_val = pop();
+				peek() = peek() * r_val;
+				break;
+			}
+			case Opcode::Divide: {
+				auto r_val = pop();
+				peek() = peek() / r_val;
+				break;
+			}
+			case Opcode::Modulo: {
+				auto r_val = pop();
+				peek() = peek().modulo(r_val);
+				break;
+			}
+			case Opcode::Power: {
+				auto r_val = pop();
+				peek() = peek().to_power_of(r_val);
+				break;
+			}
+			case Opcode::Less: {
+				auto r_val = pop();
+				peek() = RuntimeValue(peek() < r_val);
+				break;
+			}
+			case Opcode::Less_Equals: {
+				auto r_val = pop();
+				peek() = RuntimeValue(peek() <= r_val);
+				break;
+			}
+			case Opcode::Greater: {
+				auto r_val = pop();
+				peek() = RuntimeValue(peek() > r_val);
+				break;
+			}
+			case Opcode::Greater_Equals: {
+				auto r_val = pop();
+				peek() = RuntimeValue(peek() >= r_val);
+				break;
+			}
+			case Opcode::Equals: {
+				auto r_val = pop();
+				peek() = RuntimeValue(peek() == r_val);
+				break;
+			}
+			case Opcode::Not_Equals: {
+				auto r_val = pop();
+				peek() = RuntimeValue(peek() != r_val);
+				break;
+			}
+			case Opcode::Negate: peek().negate();
+				break;
+			case Opcode::Jump:
+				// Loops jump back at the end of every iteration
+				poll_safe_point();
+				ip = read_operand(opcodes, ip);
+				break;
+			case Opcode::Jump_If_False: {
+				auto target = read_operand(opcodes, ip);
+				if(!pop().is_truthy())
+					ip = target;
+				break;
+			}
+			case Opcode::Jump_If_True: {
+				auto target = read_operand(opcodes, ip);
+				if(pop().is_truthy())
+					ip = target;
+				break;
+			}
+			case Opcode::Enter_Scope: {
+				auto size = read_operand(opcodes, ip);
+				frame->locals = make_ref<SlotEnvironment>(size,
+																  frame->locals);
+				break;
+			}
+			case Opcode::Exit_Scope: frame->locals = frame->locals->parent();
+				break;
+			case Opcode::Enter_Module:
+				frame->env = make_ref<StackedEnvironment>(frame->env);
+				break;
+			case Opcode::Exit_Module: frame->env = frame->env->parent();
+				break;
+			case Opcode::Get_Iter: {
+				// The iterable stays below its methods, which don't own it
+				auto has_next = peek().get_named("__has_next");
+				auto next = peek().get_named("__next");
+				push(std::move(has_next));
+				push(std::move(next));
+				break;
+			}
+			case Opcode::For_Iter: {
+				auto target = read_operand(opcodes, ip);
+				const auto &has_next = m_stack[m_stack.size() - 2];
+				if(has_next.as<CallablePtr>()->call().value().is_truthy()) {
+					push(peek().as<CallablePtr>()->call().value());
+				} else {
+					ip = target;
+				}
+				break;
+			}
+			case Opcode::Get_Property: {
+				auto name = pop();
+				peek() = RuntimeValue(peek().get_property(name));
+				break;
+			}
+			case Opcode::Set_Property: {
+				auto name = pop();
+				auto val = pop();
+				peek().set_property(name, val);
+				peek() = std::move(val);
+				break;
+			}
+			case Opcode::Call:
+			case Opcode::Tail_Call: {
+				auto argc = read_operand(opcodes, ip);
+				auto callee_index = m_stack.size() - argc - 1;
+				const auto &callee = m_stack[callee_index];
+				if(!callee.is<CallablePtr>()) {
+					throw RuntimeException(callee.to_string() + " is not callable.");
+				}
+				auto callable = callee.as<CallablePtr>();
+				if(argc != callable->arity() && callable->arity() != VAR_ARGS) {
+					throw RuntimeException(
+						"This callable expects " + std::to_string(callable->arity())
+							+ " arguments, but it got " + std::to_string(argc)
+							+ "!");
+				}
+
+				auto *function = dynamic_cast<VMFunction *>(callable.get());
+				// A cache miss of a memoized script function runs in a frame
+				// like any other, which stores the result when it returns
+				Ref<MemoizedFunction> memo;
+				Args memo_args;
+				if(function == nullptr) {
+					memo = dynamic_ref_cast<MemoizedFunction>(callable);
+				}
+				if(memo != nullptr) {
+					memo_args.assign(m_stack.begin() + callee_index + 1,
+									 m_stack.end());
+					if(auto *cached = memo->lookup(memo_args)) {
+						auto result = *cached;
+						m_stack.resize(callee_index);
+						push(result.has_value() ? std::move(result.value())
+												: RuntimeValue());
+						break;
+					}
+					function = dynamic_cast<VMFunction *>(memo->function().get());
+				}
+
+				// The frame of a memoized function has to return to store its result
+				if(function != nullptr && op == Opcode::Tail_Call
+					&& memo == nullptr && frame->memo == nullptr) {
+					poll_safe_point();
+					// The callee may be the only reference to the function
+					auto callee_code = function->code();
+					frame->env = function->definition_env();
+					auto locals = enter_call(*function, frame->base, callee_index, argc);
+					frame->code = std::move(callee_code);
+					frame->locals = std::move(locals);
+					frame->result = std::nullopt;
+					code = frame->code.get();
+					opcodes = code->opcodes();
+					ip = 0;
+				} else if(function != nullptr) {
+					poll_safe_point();
+					CallDepthGuard::enter();
+					auto locals = enter_call(*function, callee_index, callee_index, argc);
+					frame->ip = ip;
+					m_frames.push_back(CallFrame{function->code(), 0, callee_index,
+												 function->definition_env(),
+												 std::move(locals),
+												 std::nullopt,
+												 std::move(memo),
+												 std::move(memo_args)});
+					frame = &m_frames.back();
+					code = frame->code.get();
+					opcodes = code->opcodes();
+					ip = 0;
+				} else {
+					Args args(m_stack.begin() + callee_index + 1, m_stack.end());
+					m_stack.resize(callee_index);
+					auto result = callable->call(args);
+					push(result.has_value() ? std::move(result.value())
+											: RuntimeValue());
+				}
+				break;
+			}
+			case Opcode::Return:
+			case Opcode::Return_Result: {
+				std::optional<RuntimeValue> result;
+				if(op == Opcode::Return)
+					result = pop();
+				else
+					result = std::move(frame->result);
+				if(frame->memo != nullptr) {
+					frame->memo->store(frame->memo_args, result);
+				}
+
+				m_stack.resize(frame->base);
+				m_frames.pop_back();
+				if(m_frames.size() == entry_frame) {
+					return result;
+				}
+				CallDepthGuard::leave();
+				push(result.has_value() ? std::move(result.value())
+										: RuntimeValue());
+				frame = &m_frames.back();
+				code = frame->code.get();
+				opcodes = code->opcodes();
+				ip = frame->ip;
+				break;
+			}
+		}
+	}
+}
+
+SlotEnvPtr VMFunction::make_call_locals(const RuntimeValue *args,
+										size_t count) const {
+	auto locals = make_ref<SlotEnvironment>(m_code->scope_size(),
+													m_definition_locals);
+	for (size_t i = 0; i < count; i++) {
+		(*locals)[i] = args[i];
+	}
+	return locals;
+}
+
+std::optional<RuntimeValue> VMFunction::call(const Args &args) {
+	// Called by natives, the nested VM recurses on the C++ stack
+	CallDepthGuard guard;
+	VirtualMachine vm;
+	return vm.call(*this, args);
+}
+
+std::string VMFunction::string_repr() const noexcept {
+	StringVisitor eval;
+	std::string name_string;
+	for (const auto &name : m_code->params()) {
+		name_string += name + ", ";
+	}
+
+	if(name_string.length() > 2) {
+		name_string.pop_back();
+		name_string.pop_back();
+	}
+	m_code->body()->execute(eval);
+	return "fun( " + name_string + " ) -> " + eval.get_result();
+}
+}
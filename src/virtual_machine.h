@@ -0,0 +1,111 @@
+#pragma once
+
+#include "commons.hpp"
+#include "environment.hpp"
+#include "memoized_function.hpp"
+#include "value.hpp"
+#include "vm_ast_evaluator.h"
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace CL {
+class VMFunction;
+
+/*
+ * Runs the bytecode produced by VMASTEvaluator.
+ * Calls between script functions push a CallFrame and stay inside the
+ * dispatch loop, native callables are invoked directly. Since frames live
+ * on the heap, recursion is only bounded by the limit of CallDepthGuard,
+ * which counts them along with the calls of natives back into a VM.
+ * The stack locals of a call start at the base of its frame, where the
+ * callee was, with the values being computed on top of them.
+ */
+class VirtualMachine {
+private:
+	// Collector::safe_point is only polled every so many jumps and calls
+	static constexpr uint32_t SAFE_POINT_INTERVAL = 128;
+
+	struct CallFrame {
+		std::shared_ptr<StackFrame> code;
+		size_t ip;
+		size_t base;
+		RuntimeEnvPtr env;
+		SlotEnvPtr locals;
+		std::optional<RuntimeValue> result;
+		// Set on the frames of memoized functions, see Opcode::Call
+		Ref<MemoizedFunction> memo{nullptr};
+		Args memo_args{};
+	};
+
+	std::vector<RuntimeValue> m_stack;
+	std::vector<CallFrame> m_frames;
+	uint32_t m_until_safe_point{SAFE_POINT_INTERVAL};
+
+	void push(RuntimeValue value) { m_stack.push_back(std::move(value)); }
+	RuntimeValue pop() {
+		auto value = std::move(m_stack.back());
+		m_stack.pop_back();
+		return value;
+	}
+	RuntimeValue &peek() { return m_stack.back(); }
+
+	void poll_safe_point();
+	SlotEnvPtr enter_call(const VMFunction &function,
+						  size_t base,
+						  size_t callee_index,
+						  size_t argc);
+	std::optional<RuntimeValue> run(CallFrame frame);
+	std::optional<RuntimeValue> execute(size_t entry_frame);
+
+public:
+	std::optional<RuntimeValue> run(std::shared_ptr<StackFrame> code,
+									RuntimeEnvPtr env,
+									SlotEnvPtr locals = nullptr);
+	// Calls function from native code, with its own frame
+	std::optional<RuntimeValue> call(const VMFunction &function, const Args &args);
+};
+
+class VMFunction : public Callable {
+private:
+	std::shared_ptr<StackFrame> m_code;
+	RuntimeEnvPtr m_definition_env;
+	SlotEnvPtr m_definition_locals;
+
+public:
+	VMFunction(std::shared_ptr<StackFrame> code,
+			   RuntimeEnvPtr definition_env,
+			   SlotEnvPtr definition_locals)
+		: m_code(std::move(code)),
+		  m_definition_env(std::move(definition_env)),
+		  m_definition_locals(std::move(definition_locals)) {
+	}
+
+	[[nodiscard]]
+	const std::shared_ptr<StackFrame> &code() const noexcept { return m_code; }
+	[[nodiscard]]
+	const RuntimeEnvPtr &definition_env() const noexcept {
+		return m_definition_env;
+	}
+	[[nodiscard]]
+	const SlotEnvPtr &definition_locals() const noexcept {
+		return m_definition_locals;
+	}
+	SlotEnvPtr make_call_locals(const RuntimeValue *args, size_t count) const;
+
+	void visit_references(GcVisitor &visitor) const override {
+		visitor.visit(m_definition_env);
+		visitor.visit(m_definition_locals);
+	}
+	void clear_references() override {
+		m_definition_env.reset();
+		m_definition_locals.reset();
+	}
+
+	std::optional<RuntimeValue> call(const Args &args) override;
+	uint8_t arity() override { return m_code->params().size(); }
+	[[nodiscard]]
+	std::string string_repr() const noexcept override;
+};
+}
@@ -3,3 +3,445 @@
 //
 
 #include "vm_ast_evaluator.h"
+#include "exceptions.hpp"
+
+#include <cstring>
+
+namespace CL {
+size_t StackFrame::add_opcode(Opcode op) {
+	m_opcodes.push_back(static_cast<OpcodeValue>(op));
+	return m_opcodes.size();
+}
+
+size_t StackFrame::add_opcode(Opcode op, Value value) {
+	auto operand_offset = add_opcode(op);
+	m_opcodes.resize(operand_offset + sizeof(Value));
+	patch(operand_offset, value);
+	return operand_offset;
+}
+
+void StackFrame::patch(size_t operand_offset, Value value) {
+	std::memcpy(&m_opcodes[operand_offset], &value, sizeof(Value));
+}
+
+Value StackFrame::add_constant(RuntimeValue value) {
+	m_constants.push_back(std::move(value));
+	return m_constants.size() - 1;
+}
+
+Value StackFrame::add_name(const Symbol &name) {
+	auto it = m_name_indices.find(name);
+	if(it != m_name_indices.end()) {
+		return it->second;
+	}
+	m_names.push_back(name);
+	m_name_caches.emplace_back();
+	return m_name_indices[name] = m_names.size() - 1;
+}
+
+Value StackFrame::add_function(std::shared_ptr<StackFrame> function) {
+	m_functions.push_back(std::move(function));
+	return m_functions.size() - 1;
+}
+
+std::shared_ptr<StackFrame> VMASTEvaluator::compile(const StatementList &statements,
+													AstArenaPtr arena) {
+	auto frame = std::make_shared<StackFrame>("<script>",
+											  Names(),
+											  0,
+											  std::move(arena));
+	VMASTEvaluator compiler(frame);
+	for (const auto &statement : statements) {
+		statement->execute(compiler);
+	}
+	frame->add_opcode(Opcode::Return_Result);
+	return frame;
+}
+
+std::shared_ptr<StackFrame> VMASTEvaluator::compile_function(const String &name,
+															 const Names &params,
+															 const ScopeLayout &layout,
+															 const StatementPtr &body,
+															 AstArenaPtr arena) {
+	auto frame = std::make_shared<StackFrame>(name,
+											  params,
+											  layout.size,
+											  std::move(arena),
+											  body);
+	VMASTEvaluator compiler(frame);
+	// The call scope is made by the VM, the compiler only lays it out
+	if(layout.captured) {
+		compiler.m_scopes.push_back(Scope{false, 0, layout.size});
+	} else {
+		frame->set_params_on_stack();
+		frame->reserve_stack(layout.size);
+		compiler.m_scopes.push_back(Scope{true, 0, layout.size});
+		compiler.m_stack_top = layout.size;
+	}
+	body->execute(compiler);
+	frame->add_opcode(Opcode::Return_Result);
+	return frame;
+}
+
+Value VMASTEvaluator::slot_operand(const Slot &slot) {
+	if(slot.depth > UINT16_MAX || slot.index > UINT16_MAX) {
+		throw RuntimeException("Too many nested scopes or locals to compile");
+	}
+	return slot.depth << 16 | slot.index;
+}
+
+size_t VMASTEvaluator::emit_jump(Opcode op) {
+	return m_frame->add_opcode(op, 0);
+}
+
+void VMASTEvaluator::patch_jump_here(size_t operand_offset) {
+	m_frame->patch(operand_offset, m_frame->size());
+}
+
+void VMASTEvaluator::emit_slot(Opcode local_op,
+								Opcode stack_op,
+								const Slot &slot) {
+	// Only the captured scopes count in the depth of the SlotEnvironments
+	auto depth = slot.depth;
+	uint32_t captured_depth = 0;
+	for (auto scope = m_scopes.rbegin(); scope != m_scopes.rend(); scope++) {
+		if(depth == 0) {
+			if(scope->on_stack) {
+				m_frame->add_opcode(stack_op, scope->first + slot.index);
+				return;
+			}
+			break;
+		}
+		depth--;
+		captured_depth += scope->on_stack ? 0 : 1;
+	}
+	m_frame->add_opcode(local_op,
+						slot_operand(Slot{captured_depth + depth, slot.index}));
+}
+
+void VMASTEvaluator::enter_scope(const ScopeLayout &layout) {
+	if(layout.captured) {
+		m_frame->add_opcode(Opcode::Enter_Scope, layout.size);
+		m_scopes.push_back(Scope{false, 0, layout.size});
+	} else {
+		m_scopes.push_back(Scope{true, m_stack_top, layout.size});
+		m_stack_top += layout.size;
+		m_frame->reserve_stack(m_stack_top);
+	}
+}
+
+void VMASTEvaluator::emit_scope_exit(const Scope &scope) {
+	if(!scope.on_stack) {
+		m_frame->add_opcode(Opcode::Exit_Scope);
+		return;
+	}
+	// Dropped right away, like the SlotEnvironment of a captured scope
+	if(scope.first > UINT16_MAX || scope.size > UINT16_MAX) {
+		throw RuntimeException("Too many nested scopes or locals to compile");
+	}
+	m_frame->add_opcode(Opcode::Clear_Stack, scope.first << 16 | scope.size);
+}
+
+void VMASTEvaluator::exit_scope() {
+	emit_scope_exit(m_scopes.back());
+	if(m_scopes.back().on_stack) {
+		m_stack_top -= m_scopes.back().size;
+	}
+	m_scopes.pop_back();
+}
+
+void VMASTEvaluator::emit_scope_exits(size_t target_depth) {
+	for (auto depth = m_scopes.size(); depth > target_depth; depth--) {
+		emit_scope_exit(m_scopes[depth - 1]);
+	}
+}
+
+void VMASTEvaluator::visit_number_expression(Number n) {
+	m_frame->add_opcode(Opcode::Push_Const, m_frame->add_constant(n));
+}
+
+void VMASTEvaluator::visit_string_expression(const RuntimeValue &s) {
+	m_frame->add_opcode(Opcode::Push_Const,
+						m_frame->add_constant(std::move(s)));
+}
+
+void VMASTEvaluator::visit_dict_expression(const std::vector<std::pair<ExprPtr,
+																	   ExprPtr>> &exprs) {
+	for (const auto &e : exprs) {
+		e.first->evaluate(*this);
+		e.second->evaluate(*this);
+	}
+	m_frame->add_opcode(Opcode::Make_Dict, exprs.size());
+}
+
+void VMASTEvaluator::visit_list_expression(const ExprList &exprs) {
+	for (const auto &e : exprs) {
+		e->evaluate(*this);
+	}
+	m_frame->add_opcode(Opcode::Make_List, exprs.size());
+}
+
+void VMASTEvaluator::visit_and_expression(const ExprPtr &left,
+										  const ExprPtr &right) {
+	left->evaluate(*this);
+	auto short_circuit = emit_jump(Opcode::Jump_If_False);
+	right->evaluate(*this);
+	auto end = emit_jump(Opcode::Jump);
+	patch_jump_here(short_circuit);
+	m_frame->add_opcode(Opcode::Push_Const,
+						m_frame->add_constant(RuntimeValue(false)));
+	patch_jump_here(end);
+}
+
+void VMASTEvaluator::visit_or_expression(const ExprPtr &left,
+										 const ExprPtr &right) {
+	left->evaluate(*this);
+	auto short_circuit = emit_jump(Opcode::Jump_If_True);
+	right->evaluate(*this);
+	auto end = emit_jump(Opcode::Jump);
+	patch_jump_here(short_circuit);
+	m_frame->add_opcode(Opcode::Push_Const,
+						m_frame->add_constant(RuntimeValue(true)));
+	patch_jump_here(end);
+}
+
+void VMASTEvaluator::visit_binary_expression(const ExprPtr &left,
+											 BinaryOp op,
+											 const ExprPtr &right,
+											 TypeFeedback &feedback) {
+	left->evaluate(*this);
+	right->evaluate(*this);
+
+	switch (op) {
+		case BinaryOp::Addition: m_frame->add_opcode(Opcode::Add);
+			break;
+		case BinaryOp::Subtraction: m_frame->add_opcode(Opcode::Subtract);
+			break;
+		case BinaryOp::Multiplication: m_frame->add_opcode(Opcode::Multiply);
+			break;
+		case BinaryOp::Division: m_frame->add_opcode(Opcode::Divide);
+			break;
+		case BinaryOp::Exponentiation: m_frame->add_opcode(Opcode::Power);
+			break;
+		case BinaryOp::Modulo: m_frame->add_opcode(Opcode::Modulo);
+			break;
+		case BinaryOp::Less: m_frame->add_opcode(Opcode::Less);
+			break;
+		case BinaryOp::Less_Equals: m_frame->add_opcode(Opcode::Less_Equals);
+			break;
+		case BinaryOp::Greater: m_frame->add_opcode(Opcode::Greater);
+			break;
+		case BinaryOp::Greater_Equals:
+			m_frame->add_opcode(Opcode::Greater_Equals);
+			break;
+		case BinaryOp::Equals: m_frame->add_opcode(Opcode::Equals);
+			break;
+		case BinaryOp::Not_Equals: m_frame->add_opcode(Opcode::Not_Equals);
+			break;
+		case BinaryOp::And:
+		case BinaryOp::Or: NOT_REACHED()
+			break;
+	}
+}
+
+void VMASTEvaluator::visit_unary_expression(UnaryOp op, const ExprPtr &expr) {
+	expr->evaluate(*this);
+	if(op == UnaryOp::Negation) {
+		m_frame->add_opcode(Opcode::Negate);
+	}
+}
+
+void VMASTEvaluator::visit_var_expression(const Symbol &var, Slot &slot) {
+	if(slot.is_local()) {
+		emit_slot(Opcode::Load_Local, Opcode::Load_Stack, slot);
+	} else {
+		m_frame->add_opcode(Opcode::Load_Name, m_frame->add_name(var));
+	}
+}
+
+void VMASTEvaluator::visit_assign_expression(const Symbol &name,
+											 Slot &slot,
+											 const ExprPtr &value) {
+	value->evaluate(*this);
+	if(slot.is_local()) {
+		emit_slot(Opcode::Store_Local, Opcode::Store_Stack, slot);
+	} else {
+		m_frame->add_opcode(Opcode::Store_Name, m_frame->add_name(name));
+	}
+}
+
+void VMASTEvaluator::visit_fun_call(const ExprPtr &fun,
+									const ExprList &args,
+									bool tail_call) {
+	fun->evaluate(*this);
+	for (const auto &arg : args) {
+		arg->evaluate(*this);
+	}
+	// The Return following a tail call only runs when it called native code
+	m_frame->add_opcode(tail_call ? Opcode::Tail_Call : Opcode::Call, args.size());
+}
+
+void VMASTEvaluator::visit_fun_def_statement(const Symbol &name,
+											 Slot &slot,
+											 const Names &names,
+											 ScopeLayout &layout,
+											 const StatementPtr &body,
+											 bool memoized) {
+	auto function = compile_function(name,
+									 names,
+									 layout,
+									 body,
+									 m_frame->arena());
+	if(memoized) {
+		function->mark_memoized();
+	}
+	m_frame->add_opcode(Opcode::Make_Function,
+						m_frame->add_function(std::move(function)));
+	if(slot.is_local()) {
+		emit_slot(Opcode::Bind_Local, Opcode::Bind_Stack, slot);
+	} else {
+		m_frame->add_opcode(Opcode::Bind_Name, m_frame->add_name(name));
+	}
+}
+
+void VMASTEvaluator::visit_expression_statement(const ExprPtr &expr) {
+	expr->evaluate(*this);
+	m_frame->add_opcode(Opcode::Pop_Result);
+}
+
+void VMASTEvaluator::visit_block_statement(const StatementList &block,
+										   ScopeLayout &layout) {
+	// Blocks without locals of their own get no slot array
+	auto has_scope = layout.size > 0;
+	if(has_scope) {
+		enter_scope(layout);
+	}
+	for (const auto &statement : block) {
+		statement->execute(*this);
+	}
+	if(has_scope) {
+		exit_scope();
+	}
+}
+
+void VMASTEvaluator::visit_return_expression(const ExprPtr &expr) {
+	if(expr) {
+		expr->evaluate(*this);
+	} else {
+		m_frame->add_opcode(Opcode::Push_Nil);
+	}
+	m_frame->add_opcode(Opcode::Return);
+}
+
+void VMASTEvaluator::visit_break_expression() {
+	if(m_loops.empty()) {
+		throw RuntimeException("break used outside of a loop");
+	}
+	auto &loop = m_loops.back();
+	emit_scope_exits(loop.scope_depth);
+	loop.pending_breaks.push_back(emit_jump(Opcode::Jump));
+}
+
+void VMASTEvaluator::visit_continue_expression() {
+	if(m_loops.empty()) {
+		throw RuntimeException("continue used outside of a loop");
+	}
+	const auto &loop = m_loops.back();
+	emit_scope_exits(loop.scope_depth);
+	m_frame->add_opcode(Opcode::Jump, loop.continue_target);
+}
+
+void VMASTEvaluator::visit_if_statement(const ExprPtr &cond,
+										const StatementPtr &if_branch,
+										const StatementPtr &else_branch) {
+	cond->evaluate(*this);
+	auto skip_if = emit_jump(Opcode::Jump_If_False);
+	if_branch->execute(*this);
+	if(else_branch) {
+		auto skip_else = emit_jump(Opcode::Jump);
+		patch_jump_here(skip_if);
+		else_branch->execute(*this);
+		patch_jump_here(skip_else);
+	} else {
+		patch_jump_here(skip_if);
+	}
+}
+
+void VMASTEvaluator::visit_while_statement(const ExprPtr &cond,
+										   const StatementPtr &body) {
+	auto loop_start = m_frame->size();
+	cond->evaluate(*this);
+	auto exit = emit_jump(Opcode::Jump_If_False);
+
+	m_loops.push_back(Loop{loop_start, m_scopes.size(), {}});
+	body->execute(*this);
+	m_frame->add_opcode(Opcode::Jump, loop_start);
+
+	patch_jump_here(exit);
+	for (auto pending_break : m_loops.back().pending_breaks) {
+		patch_jump_here(pending_break);
+	}
+	m_loops.pop_back();
+}
+
+void VMASTEvaluator::visit_for_statement(const Symbol &name,
+										 Slot &slot,
+										 const ExprPtr &iterable,
+										 const StatementPtr &body) {
+	iterable->evaluate(*this);
+	m_frame->add_opcode(Opcode::Get_Iter);
+	auto loop_start = m_frame->size();
+	auto exit = emit_jump(Opcode::For_Iter);
+	if(slot.is_local()) {
+		emit_slot(Opcode::Store_Local, Opcode::Store_Stack, slot);
+	} else {
+		m_frame->add_opcode(Opcode::Store_Name, m_frame->add_name(name));
+	}
+	m_frame->add_opcode(Opcode::Pop);
+
+	m_loops.push_back(Loop{loop_start, m_scopes.size(), {}});
+	body->execute(*this);
+	m_frame->add_opcode(Opcode::Jump, loop_start);
+
+	patch_jump_here(exit);
+	for (auto pending_break : m_loops.back().pending_breaks) {
+		patch_jump_here(pending_break);
+	}
+	m_loops.pop_back();
+
+	// Discards the iterable along with __has_next and __next
+	m_frame->add_opcode(Opcode::Pop);
+	m_frame->add_opcode(Opcode::Pop);
+	m_frame->add_opcode(Opcode::Pop);
+}
+
+void VMASTEvaluator::visit_set_expression(const ExprPtr &obj,
+										  const ExprPtr &name,
+										  const ExprPtr &val) {
+	obj->evaluate(*this);
+	val->evaluate(*this);
+	name->evaluate(*this);
+	m_frame->add_opcode(Opcode::Set_Property);
+}
+
+void VMASTEvaluator::visit_get_expression(const ExprPtr &obj,
+										  const ExprPtr &name) {
+	obj->evaluate(*this);
+	name->evaluate(*this);
+	m_frame->add_opcode(Opcode::Get_Property);
+}
+
+void VMASTEvaluator::visit_module_definition(const ExprList &list) {
+	// Loops around the module can't be left from inside its body
+	auto outer_loops = std::move(m_loops);
+	m_loops.clear();
+	m_frame->add_opcode(Opcode::Enter_Module);
+	for (const auto &expr : list) {
+		expr->evaluate(*this);
+		m_frame->add_opcode(Opcode::Pop);
+	}
+	m_frame->add_opcode(Opcode::Make_Module);
+	m_frame->add_opcode(Opcode::Exit_Module);
+	m_loops = std::move(outer_loops);
+}
+}
@@ -4,25 +4,246 @@
 
 #pragma once
 
+#include "environment.hpp"
 #include "nodes.hpp"
-#include "stack_based_evaluator.hpp"
-
+#include "value.hpp"
 
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace CL {
-    using OpcodeValue = uint8_t;
-    using Value = uint32_t;
-    class StackFrame {
-        std::string name;
-        std::vector<OpcodeValue> Opcodes;
-        void add_opcode(OpcodeValue op) { }
-        void add_opcode(OpcodeValue op, Value value) { }
-    };
-
-    std::vector<std::string> names;
-
-    class VMASTEvaluator :
-            public StackMachine<StackFrame>, public Evaluator {
-    private:
-    };
-}
\ No newline at end of file
+using OpcodeValue = uint8_t;
+using Value = uint32_t;
+
+enum class Opcode : OpcodeValue {
+	Push_Const,     // [constant] pushes a constant of the frame
+	Push_Nil,
+	Pop,
+	Pop_Result,     // pops the top of the stack into the result register
+	Load_Name,      // [name] pushes the value bound to name
+	Store_Name,     // [name] assigns the top of the stack, leaving it there
+	Bind_Name,      // [name] pops and binds in the innermost scope
+	Load_Local,     // [slot] like Load_Name, for a slot found by the Resolver
+	Store_Local,    // [slot]
+	Bind_Local,     // [slot]
+	Load_Stack,     // [offset] like Load_Local, for a slot kept on the VM stack
+	Store_Stack,    // [offset]
+	Bind_Stack,     // [offset]
+	Clear_Stack,    // [first << 16 | count] drops the values of stack slots
+	Make_Function,  // [function] closes a nested frame over the current scopes
+	Make_Dict,      // [pairs] pops key/value pairs into a new dict
+	Make_List,      // [elements] pops elements into a new list
+	Make_Module,    // wraps the current scope into a module
+	Add,
+	Subtract,
+	Multiply,
+	Divide,
+	Modulo,
+	Power,
+	Less,
+	Less_Equals,
+	Greater,
+	Greater_Equals,
+	Equals,
+	Not_Equals,
+	Negate,
+	Jump,           // [target]
+	Jump_If_False,  // [target] pops the condition
+	Jump_If_True,   // [target] pops the condition
+	Enter_Scope,    // [size] pushes a slot array for the locals of a captured block
+	Exit_Scope,
+	Enter_Module,   // pushes a dynamic environment for a module body
+	Exit_Module,
+	Get_Iter,       // pushes __has_next and __next of the iterable on top
+	For_Iter,       // [target] pushes the next element or jumps to target
+	Get_Property,
+	Set_Property,
+	Call,           // [argc] calls the callable found below the arguments
+	Tail_Call,      // [argc] like Call, a script function replaces the caller's frame
+	Return,         // returns the top of the stack
+	Return_Result,  // returns the result register, if anything was stored
+};
+
+/*
+ * The locals of the scopes that aren't captured by a function, including
+ * the parameters when the call scope isn't, live in the first stack_size
+ * values of the VM stack of a call instead of in SlotEnvironments.
+ */
+class StackFrame {
+private:
+	std::string m_name;
+	Names m_params;
+	uint32_t m_scope_size;
+	bool m_params_on_stack{false};
+	uint32_t m_stack_size{0};
+	std::vector<OpcodeValue> m_opcodes;
+	std::vector<RuntimeValue> m_constants;
+	std::vector<Symbol> m_names;
+	mutable std::vector<NameCache> m_name_caches;
+	std::unordered_map<Symbol, Value, Symbol::Hash> m_name_indices;
+	std::vector<std::shared_ptr<StackFrame>> m_functions;
+	StatementPtr m_body;
+	AstArenaPtr m_arena;
+	bool m_memoized{false};
+
+public:
+	StackFrame(std::string name,
+			   Names params,
+			   uint32_t scope_size,
+			   AstArenaPtr arena,
+			   StatementPtr body = nullptr)
+		: m_name(std::move(name)),
+		  m_params(std::move(params)),
+		  m_scope_size(scope_size),
+		  m_body(body),
+		  m_arena(std::move(arena)) {
+	}
+
+	size_t add_opcode(Opcode op);
+	size_t add_opcode(Opcode op, Value value);
+	void patch(size_t operand_offset, Value value);
+	[[nodiscard]]
+	size_t size() const noexcept { return m_opcodes.size(); }
+
+	Value add_constant(RuntimeValue value);
+	Value add_name(const Symbol &name);
+	Value add_function(std::shared_ptr<StackFrame> function);
+	void set_params_on_stack() noexcept { m_params_on_stack = true; }
+	void reserve_stack(uint32_t size) noexcept {
+		m_stack_size = std::max(m_stack_size, size);
+	}
+
+	[[nodiscard]]
+	const OpcodeValue *opcodes() const noexcept { return m_opcodes.data(); }
+	[[nodiscard]]
+	const RuntimeValue &constant(Value index) const { return m_constants[index]; }
+	[[nodiscard]]
+	const Symbol &name(Value index) const { return m_names[index]; }
+	[[nodiscard]]
+	NameCache &name_cache(Value index) const { return m_name_caches[index]; }
+	[[nodiscard]]
+	const std::shared_ptr<StackFrame> &function(Value index) const {
+		return m_functions[index];
+	}
+	[[nodiscard]]
+	const Names &params() const noexcept { return m_params; }
+	[[nodiscard]]
+	uint32_t scope_size() const noexcept { return m_scope_size; }
+	[[nodiscard]]
+	bool params_on_stack() const noexcept { return m_params_on_stack; }
+	[[nodiscard]]
+	uint32_t stack_size() const noexcept { return m_stack_size; }
+	[[nodiscard]]
+	const std::string &name() const noexcept { return m_name; }
+	[[nodiscard]]
+	const StatementPtr &body() const noexcept { return m_body; }
+	[[nodiscard]]
+	const AstArenaPtr &arena() const noexcept { return m_arena; }
+	// Functions made from a memoized frame cache their results
+	[[nodiscard]]
+	bool memoized() const noexcept { return m_memoized; }
+	void mark_memoized() noexcept { m_memoized = true; }
+};
+
+/*
+ * Compiles a Statement/Expression tree into the bytecode of a StackFrame.
+ * Every function body is compiled by its own VMASTEvaluator into a
+ * StackFrame of its own, nested in the frame of the enclosing code.
+ */
+class VMASTEvaluator : public Evaluator {
+private:
+	struct Loop {
+		size_t continue_target;
+		size_t scope_depth;
+		std::vector<size_t> pending_breaks;
+	};
+	// A scope with locals of the frame, on the stack from first or in a
+	// SlotEnvironment when captured
+	struct Scope {
+		bool on_stack;
+		uint32_t first;
+		uint32_t size;
+	};
+
+	std::shared_ptr<StackFrame> m_frame;
+	std::vector<Loop> m_loops;
+	std::vector<Scope> m_scopes;
+	uint32_t m_stack_top{0};
+
+	static Value slot_operand(const Slot &slot);
+	size_t emit_jump(Opcode op);
+	void patch_jump_here(size_t operand_offset);
+	void emit_slot(Opcode local_op, Opcode stack_op, const Slot &slot);
+	void enter_scope(const ScopeLayout &layout);
+	void emit_scope_exit(const Scope &scope);
+	void exit_scope();
+	void emit_scope_exits(size_t target_depth);
+
+	void visit_number_expression(Number n) override;
+	void visit_string_expression(const RuntimeValue &s) override;
+	void visit_dict_expression(const std::vector<std::pair<ExprPtr,
+														   ExprPtr>> &) override;
+	void visit_list_expression(const ExprList &) override;
+
+	void visit_and_expression(const ExprPtr &left,
+							  const ExprPtr &right) override;
+	void visit_or_expression(const ExprPtr &left,
+							 const ExprPtr &right) override;
+	void visit_binary_expression(const ExprPtr &left,
+								 BinaryOp op,
+								 const ExprPtr &right,
+								 TypeFeedback &feedback) override;
+
+	void visit_unary_expression(UnaryOp op, const ExprPtr &expr) override;
+
+	void visit_var_expression(const Symbol &var, Slot &slot) override;
+	void visit_assign_expression(const Symbol &name,
+								 Slot &slot,
+								 const ExprPtr &value) override;
+	void visit_fun_call(const ExprPtr &fun,
+						const ExprList &args,
+						bool tail_call) override;
+	void visit_fun_def_statement(const Symbol &name,
+								 Slot &slot,
+								 const Names &names,
+								 ScopeLayout &layout,
+								 const StatementPtr &body,
+								 bool memoized) override;
+	void visit_expression_statement(const ExprPtr &expr) override;
+	void visit_block_statement(const StatementList &block,
+							   ScopeLayout &layout) override;
+	void visit_return_expression(const ExprPtr &expr) override;
+	void visit_break_expression() override;
+	void visit_continue_expression() override;
+	void visit_if_statement(const ExprPtr &cond,
+							const StatementPtr &expr,
+							const StatementPtr &else_branch) override;
+	void visit_while_statement(const ExprPtr &cond,
+							   const StatementPtr &body) override;
+	void visit_for_statement(const Symbol &name,
+							 Slot &slot,
+							 const ExprPtr &iterable,
+							 const StatementPtr &body) override;
+	void visit_set_expression(const ExprPtr &obj,
+							  const ExprPtr &name,
+							  const ExprPtr &val) override;
+	void visit_get_expression(const ExprPtr &obj, const ExprPtr &name) override;
+	void visit_module_definition(const ExprList &list) override;
+
+	explicit VMASTEvaluator(std::shared_ptr<StackFrame> frame)
+		: m_frame(std::move(frame)) {
+	}
+
+public:
+	static std::shared_ptr<StackFrame> compile(const StatementList &statements,
+											   AstArenaPtr arena);
+	static std::shared_ptr<StackFrame> compile_function(const String &name,
+														const Names &params,
+														const ScopeLayout &layout,
+														const StatementPtr &body,
+														AstArenaPtr arena);
+};
+}